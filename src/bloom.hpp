@@ -6,6 +6,12 @@ inline unsigned int ngram(char a, char b, char c, char d)
     return (static_cast<unsigned char>(a) << 24) + (static_cast<unsigned char>(b) << 16) + (static_cast<unsigned char>(c) << 8) + static_cast<unsigned char>(d);
 }
 
+// trigrams are stored in the same index as ngrams to be able to filter short strings; NUL bytes are rare in text so collisions are unlikely
+inline unsigned int trigram(char a, char b, char c)
+{
+    return (static_cast<unsigned char>(a) << 16) + (static_cast<unsigned char>(b) << 8) + static_cast<unsigned char>(c);
+}
+
 // 6-shift variant from http://burtleburtle.net/bob/hash/integer.html
 inline unsigned int bloomHash1(unsigned int v)
 {
@@ -15,16 +15,24 @@
 #include "compression.hpp"
 #include "workqueue.hpp"
 #include "blockingqueue.hpp"
+#include "scancache.hpp"
 
 #include <algorithm>
 #include <vector>
 #include <list>
+#include <deque>
+#include <future>
 #include <string>
 #include <memory>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 
+#include <math.h>
 #include <string.h>
 
+#include "xxhash.h"
+
 struct BuildStatistics
 {
 	size_t chunkCount;
@@ -65,8 +73,14 @@ struct File
 	Blob contents;
 
 	uint32_t startLine;
+	uint32_t flags;
 	uint64_t fileSize;
 	uint64_t timeStamp;
+	uint64_t contentHash;
+
+	// for duplicate files, contents is empty; the file references the original file and keeps its contents for indexing
+	std::string duplicateOf;
+	Blob duplicateContents;
 };
 
 struct Chunk
@@ -86,6 +100,8 @@ struct ChunkData
 
 	size_t dataOffset;
 	size_t dataSize;
+
+	std::vector<Blob> duplicateContents;
 };
 
 struct ChunkIndex
@@ -108,6 +124,35 @@ struct ChunkFileData
 	std::unique_ptr<char[]> index;
 	std::unique_ptr<char[]> extra;
 	bool firstFileIsSuffix;
+
+	// preserved chunks are copied from the source data file at the specified offset instead of being kept in memory
+	bool copyFromSource;
+	uint64_t sourceOffset;
+};
+
+// Files are read on worker threads, but they are appended to chunks in the order of buildAppend* calls
+struct PendingAppend
+{
+	std::string path;
+	unsigned int startLine;
+	uint64_t timeStamp;
+	uint64_t fileSize;
+	uint64_t contentHash;
+	unsigned int flags;
+
+	std::vector<char> contents;
+
+	// contents of the entire file, which is appended as a duplicate if the same contents was appended before
+	bool fullFile;
+
+	// the file was found to be identical to an earlier file, so it isn't read and the contents of the original is used instead
+	bool duplicate;
+
+	// the original that the existing database references for this file; the contents of the original comes from the database as well
+	std::string duplicateOf;
+
+	// valid for files that are being read; the result is false if the file could not be read
+	std::future<bool> read;
 };
 
 struct BuildContext
@@ -118,16 +163,46 @@ struct BuildContext
 	std::list<File> pendingFiles;
 	size_t pendingSize;
 
+	// content hashes that are shared by several files; the first file with the contents stores them
+	std::unordered_set<uint64_t> duplicateHashes;
+	std::unordered_map<uint64_t, std::string> originalFiles;
+
+	// files that were compared with the first file with the same contents; for each content hash, the first file and the number of duplicates
+	std::unordered_map<std::string, uint64_t> duplicateFiles;
+	std::unordered_map<uint64_t, std::pair<std::string, unsigned int>> duplicateGroups;
+
+	// contents of original files that still have duplicates to append, and the number of duplicates left
+	std::unordered_map<uint64_t, std::pair<Blob, unsigned int>> originalContents;
+	size_t originalContentsSize;
+
+	std::deque<std::unique_ptr<PendingAppend>> pendingAppends;
+	size_t pendingAppendSize;
+	WorkQueue readFileQueue;
+
 	FileStream outData;
+	FileStream sourceData;
+
+	// chunks are compressed using the dictionary if it's not empty
+	std::vector<char> dictionary;
+	unsigned int codec;
+	int compressionLevel;
+
+	// chunks are compressed with a lower level than the project uses, so they need to be recompressed later
+	bool recompress;
+
+	double indexFalsePositiveRate;
 
 	unsigned int chunkOrder;
 	WorkQueue prepareChunkQueue;
 	BlockingQueue<ChunkFileData> writeChunkQueue;
 	std::thread writeChunkThread;
 
+	// set by the write thread if some of the chunk data couldn't be written; the data file must not be published in that case
+	bool writeFailed;
+
 	BuildContext(Output* output, size_t fileCount)
-		: output(output), fileCount(fileCount), pendingSize(0), chunkOrder(0)
-		, prepareChunkQueue(std::max(WorkQueue::getIdealWorkerCount(), 2u) - 1, kMaxQueuedChunkData)
+		: output(output), fileCount(fileCount), pendingSize(0), originalContentsSize(0), pendingAppendSize(0), readFileQueue(WorkQueue::getIdealWorkerCount(), 0), chunkOrder(0)
+		, prepareChunkQueue(std::max(WorkQueue::getIdealWorkerCount(), 2u) - 1, kMaxQueuedChunkData), writeFailed(false)
 	{
 	}
 };
@@ -225,9 +300,15 @@ static File splitPrefix(File& file, size_t size)
 	return result;
 }
 
+static size_t getFileIndexedSize(const File& file)
+{
+	// duplicates are indexed using the contents of the original, so they count towards the chunk size to keep the index size bounded
+	return file.contents.size() + file.duplicateContents.size();
+}
+
 static void appendChunkFile(Chunk& chunk, File&& file)
 {
-	chunk.totalSize += file.contents.size();
+	chunk.totalSize += getFileIndexedSize(file);
 	chunk.files.emplace_back(std::move(file));
 }
 
@@ -255,7 +336,15 @@ static void appendChunkFilePrefix(Chunk& chunk, File& file, size_t remainingSize
 static void writeChunk(BuildContext* context, unsigned int order, const DataChunkHeader& header, std::unique_ptr<char[]> compressedData, std::unique_ptr<char[]> index, std::unique_ptr<char[]> extra, bool firstFileIsSuffix)
 {
 	assert(compressedData);
-	ChunkFileData chunk = { order, header, std::move(compressedData), std::move(index), std::move(extra), firstFileIsSuffix };
+	ChunkFileData chunk = { order, header, std::move(compressedData), std::move(index), std::move(extra), firstFileIsSuffix, false, 0 };
+
+	context->writeChunkQueue.push(std::move(chunk));
+}
+
+static void writeChunkFromSource(BuildContext* context, unsigned int order, const DataChunkHeader& header, uint64_t sourceOffset, std::unique_ptr<char[]> index, std::unique_ptr<char[]> extra, bool firstFileIsSuffix)
+{
+	assert(context->sourceData);
+	ChunkFileData chunk = { order, header, std::unique_ptr<char[]>(), std::move(index), std::move(extra), firstFileIsSuffix, true, sourceOffset };
 
 	context->writeChunkQueue.push(std::move(chunk));
 }
@@ -265,7 +354,7 @@ static size_t getChunkNameTotalSize(const Chunk& chunk)
 	size_t result = 0;
 
 	for (size_t i = 0; i < chunk.files.size(); ++i)
-		result += chunk.files[i].name.size();
+		result += chunk.files[i].name.size() + chunk.files[i].duplicateOf.size();
 
 	return result;
 }
@@ -312,13 +401,27 @@ static ChunkData prepareChunkData(const Chunk& chunk)
 		h.dataSize = f.contents.size();
 
 		h.startLine = f.startLine;
-		h.reserved = 0;
+		h.flags = f.flags;
 
 		h.fileSize = f.fileSize;
 		h.timeStamp = f.timeStamp;
+		h.contentHash = f.contentHash;
 
 		nameOffset += f.name.size();
 		dataOffset += f.contents.size();
+
+		// duplicate files store the path to the original file in the name table so that it's available without full decompression
+		if (f.flags & DF_DUPLICATE)
+		{
+			memcpy(result.data.get() + nameOffset, f.duplicateOf.c_str(), f.duplicateOf.length());
+
+			h.dataOffset = nameOffset;
+			h.dataSize = f.duplicateOf.size();
+
+			nameOffset += f.duplicateOf.size();
+
+			result.duplicateContents.push_back(f.duplicateContents);
+		}
 	}
 
 	assert(nameOffset == headerSize + nameSize && dataOffset == totalSize);
@@ -326,15 +429,21 @@ static ChunkData prepareChunkData(const Chunk& chunk)
 	return result;
 }
 
-static size_t getChunkIndexSize(size_t dataSize)
+static bool isChunkIndexNeeded(size_t dataSize)
+{
+	// don't bother storing indices for tiny chunks
+	return dataSize >= 50 * 1024;
+}
+
+static size_t getChunkIndexSize(size_t dataSize, size_t ngramCount, double falsePositiveRate)
 {
-	// data compression ratio is ~5x
-	// we want the index to be ~10% of the compressed data
-	// so index is ~50x smaller than the original data
-	size_t indexSize = dataSize / 50;
+	// optimal bloom filter size for the target false positive rate is -n*ln(p)/ln(2)^2 bits
+	double bits = -static_cast<double>(ngramCount) * log(falsePositiveRate) / (0.693147181 * 0.693147181);
+	size_t indexSize = static_cast<size_t>(bits / 8);
 
-	// don't bother storing tiny indices
-	return indexSize < 1024 ? 0 : indexSize;
+	// chunks with very diverse contents (minified or encoded data) need large filters to reach the target rate;
+	// cap the index size since decompressing the chunk is cheaper than reading a huge index
+	return std::max(std::min(indexSize, dataSize / 8), size_t(64));
 }
 
 // http://pages.cs.wisc.edu/~cao/papers/summary-cache/node8.html
@@ -417,28 +526,51 @@ struct IntSet
 	}
 };
 
-static ChunkIndex prepareChunkIndex(const char* data, size_t size)
+static void collectNgrams(IntSet& ngrams, const char* data, size_t size)
 {
-	// estimate index size
-	size_t indexSize = getChunkIndexSize(size);
-
-	if (indexSize == 0) return ChunkIndex();
-
-	// collect ngram data; assume ~10% ngrams are unique
-	IntSet ngrams(IntSet::optimalCapacity(size / 10));
-
-	for (size_t i = 3; i < size; ++i)
+	for (size_t i = 2; i < size; ++i)
 	{
-		char a = data[i - 3], b = data[i - 2], c = data[i - 1], d = data[i];
+		char b = data[i - 2], c = data[i - 1], d = data[i];
 
 		// don't waste bits on ngrams that cross lines
-		if (a != '\n' && b != '\n' && c != '\n' && d != '\n')
+		if (b != '\n' && c != '\n' && d != '\n')
 		{
-			unsigned int n = ngram(casefold(a), casefold(b), casefold(c), casefold(d));
-			if (n != 0)
-				ngrams.insert(n);
+			unsigned int t = trigram(casefold(b), casefold(c), casefold(d));
+			if (t != 0)
+				ngrams.insert(t);
+
+			char a = (i >= 3) ? data[i - 3] : '\n';
+
+			if (a != '\n')
+			{
+				unsigned int n = ngram(casefold(a), casefold(b), casefold(c), casefold(d));
+				if (n != 0)
+					ngrams.insert(n);
+			}
 		}
 	}
+}
+
+static ChunkIndex prepareChunkIndex(const char* data, size_t size, const std::vector<Blob>& duplicateContents, double falsePositiveRate)
+{
+	// duplicate files are searched using the contents of the original file, but the index has to account for them
+	size_t totalSize = size;
+
+	for (auto& b: duplicateContents)
+		totalSize += b.size();
+
+	if (!isChunkIndexNeeded(totalSize)) return ChunkIndex();
+
+	// collect ngram data; assume ~10% ngrams are unique
+	IntSet ngrams(IntSet::optimalCapacity(totalSize / 10));
+
+	collectNgrams(ngrams, data, size);
+
+	for (auto& b: duplicateContents)
+		collectNgrams(ngrams, b.data(), b.size());
+
+	// size the index based on the number of unique ngrams
+	size_t indexSize = getChunkIndexSize(totalSize, ngrams.size, falsePositiveRate);
 
 	// estimate iteration count
 	unsigned int iterations = getIndexHashIterations(indexSize, ngrams.size);
@@ -471,16 +603,34 @@ static void storeChunk(BuildContext* context, const Chunk& chunk)
 	bool firstFileIsSuffix = !chunk.files.empty() && chunk.files[0].startLine != 0;
 	std::string lastFile = chunk.files.empty() ? "" : chunk.files.back().name;
 
+	// search keeps the matches of the original files until all chunks that reference them are processed
+	std::vector<uint64_t> duplicateHashes;
+
+	for (auto& f: chunk.files)
+		if (f.flags & DF_DUPLICATE)
+			duplicateHashes.push_back(f.contentHash);
+
+	std::sort(duplicateHashes.begin(), duplicateHashes.end());
+	duplicateHashes.erase(std::unique(duplicateHashes.begin(), duplicateHashes.end()), duplicateHashes.end());
+
 	// workaround for lack of generalized capture
 	std::shared_ptr<ChunkData> sdata(new ChunkData(std::move(data)));
 
 	context->prepareChunkQueue.push([=] {
-		ChunkIndex index = prepareChunkIndex(sdata->data.get() + sdata->dataOffset, sdata->dataSize);
+		ChunkIndex index = prepareChunkIndex(sdata->data.get() + sdata->dataOffset, sdata->dataSize, sdata->duplicateContents, context->indexFalsePositiveRate);
+
+		const std::vector<char>& dictionary = context->dictionary;
+		unsigned int codec = context->codec;
 
-		std::pair<std::unique_ptr<char[]>, size_t> cdata = compress(sdata->data.get(), sdata->size, kFileDataCompressionLevel);
+		std::pair<std::unique_ptr<char[]>, size_t> cdata = (codec == DCC_NONE)
+			? std::make_pair(std::move(sdata->data), sdata->size)
+			: compress(sdata->data.get(), sdata->size, context->compressionLevel, dictionary.data(), dictionary.size());
 
-		std::unique_ptr<char[]> extra(new char[lastFile.size()]);
+		size_t extraSize = lastFile.size() + duplicateHashes.size() * sizeof(uint64_t);
+
+		std::unique_ptr<char[]> extra(new char[extraSize]);
 		memcpy(extra.get(), lastFile.data(), lastFile.size());
+		memcpy(extra.get() + lastFile.size(), duplicateHashes.data(), duplicateHashes.size() * sizeof(uint64_t));
 
 		DataChunkHeader header = {};
 		header.fileCount = fileCount;
@@ -489,7 +639,10 @@ static void storeChunk(BuildContext* context, const Chunk& chunk)
 		header.uncompressedSize = sdata->size;
 		header.indexSize = index.size;
 		header.indexHashIterations = index.iterations;
-		header.extraSize = lastFile.size();
+		header.extraSize = extraSize;
+		header.duplicateCount = duplicateHashes.size();
+		header.flags = ((codec == DCC_LZ4 && !dictionary.empty()) ? DC_DICTIONARY : 0) | (index.size ? DC_INDEX_TRIGRAMS : 0) | (context->recompress ? DC_RECOMPRESS : 0);
+		header.codec = codec;
 
 		writeChunk(context, order, header, std::move(cdata.first), std::move(index.data), std::move(extra), firstFileIsSuffix);
 	}, sdata->size);
@@ -507,11 +660,21 @@ static void flushChunk(BuildContext* context, size_t size)
 
 		size_t remainingSize = size - chunk.totalSize;
 
-		if (file.contents.size() <= remainingSize)
+		if (getFileIndexedSize(file) <= remainingSize)
 		{
 			// no need to split the file, just add it
 			appendChunkFile(chunk, std::move(file));
 		}
+		else if (file.flags & DF_DUPLICATE)
+		{
+			// duplicates can't be split, so they start the next chunk unless the chunk is empty
+			if (chunk.files.empty())
+				appendChunkFile(chunk, std::move(file));
+			else
+				context->pendingFiles.emplace_front(std::move(file));
+
+			break;
+		}
 		else
 		{
 			// last file may not fit completely, store some part of it and put the remaining lines back into pending list
@@ -553,16 +716,42 @@ static void writeChunkThreadFun(BuildContext* context)
 		while (!chunks.empty() && chunks.begin()->first == order)
 		{
 			const ChunkFileData& chunk = chunks.begin()->second;
-			const DataChunkHeader& header = chunk.header;
+			DataChunkHeader header = chunk.header;
 
 			// empty compressed data acts as a terminator flag
-			if (!chunk.compressedData)
+			if (!chunk.compressedData && !chunk.copyFromSource)
 				return;
 
+			// uncompressed data is aligned so that it can be searched directly from the mapped file
+			if (header.codec == DCC_NONE)
+			{
+				uint64_t dataOffset = context->outData.tell() + sizeof(header) + header.extraSize + header.indexSize;
+
+				header.dataPadding = (kUncompressedChunkAlignment - dataOffset % kUncompressedChunkAlignment) % kUncompressedChunkAlignment;
+			}
+			else
+				header.dataPadding = 0;
+
+			static const char padding[kUncompressedChunkAlignment] = {};
+
 			context->outData.write(&header, sizeof(header));
 			context->outData.write(chunk.extra.get(), header.extraSize);
 			context->outData.write(chunk.index.get(), header.indexSize);
-			context->outData.write(chunk.compressedData.get(), header.compressedSize);
+			context->outData.write(padding, header.dataPadding);
+
+			if (chunk.copyFromSource)
+			{
+				if (context->outData.copy(context->sourceData, chunk.sourceOffset, header.compressedSize) != header.compressedSize)
+				{
+					context->output->error("Error copying chunk data from source data file\n");
+					context->writeFailed = true;
+				}
+			}
+			else if (context->outData.write(chunk.compressedData.get(), header.compressedSize) != header.compressedSize)
+			{
+				context->output->error("Error writing chunk data\n");
+				context->writeFailed = true;
+			}
 
 			stats.chunkCount++;
 			stats.fileCount += header.fileCount - chunk.firstFileIsSuffix;
@@ -577,10 +766,16 @@ static void writeChunkThreadFun(BuildContext* context)
 	}
 }
 
-BuildContext* buildStart(Output* output, const char* path, unsigned int fileCount)
+BuildContext* buildStart(Output* output, const char* path, const ProjectOptions& options, unsigned int fileCount, const std::vector<char>& dictionary)
 {
 	std::unique_ptr<BuildContext> context(new BuildContext(output, fileCount));
 
+	context->dictionary = dictionary;
+	context->codec = (options.compression == PC_NONE) ? DCC_NONE : DCC_LZ4;
+	context->compressionLevel = options.compressionLevel;
+	context->recompress = false;
+	context->indexFalsePositiveRate = options.indexFalsePositiveRate;
+
 	createPathForFile(path);
 
 	context->outData.open(path, "wb");
@@ -592,22 +787,57 @@ BuildContext* buildStart(Output* output, const char* path, unsigned int fileCoun
 
 	DataFileHeader header = {};
 	memcpy(header.magic, kDataFileHeaderMagic, sizeof(header.magic));
+	header.dictionarySize = dictionary.size();
 
 	context->outData.write(&header, sizeof(header));
+	context->outData.write(dictionary.data(), dictionary.size());
 
 	std::thread(std::bind(writeChunkThreadFun, context.get())).swap(context->writeChunkThread);
 
 	return context.release();
 }
 
-static void appendFilePart(BuildContext* context, const char* path, unsigned int startLine, const char* data, size_t dataSize, uint64_t timeStamp, uint64_t fileSize, std::vector<char>* dataSource)
+static bool isChunkBoundary(const File& file)
+{
+	// Chunk boundaries only depend on the file path and size, so inserting or removing files doesn't move the boundaries in the
+	// rest of the project and only the neighboring chunks need to be recompressed on update.
+	// The boundary probability is proportional to the file size so that the chunks are kChunkSize on average.
+	const uint64_t kChunkBoundaryInterval = kChunkSize - kChunkMinSize;
+
+	return XXH64(file.name.data(), file.name.size(), 0) % kChunkBoundaryInterval < file.fileSize;
+}
+
+static void flushChunkBoundary(BuildContext* context)
+{
+	// The boundary after a file can only be checked once all parts of the file are added, so we check the last pending file
+	// before adding the next one. Pending files never contain a boundary before the last file.
+	if (!context->pendingFiles.empty() && context->pendingSize >= kChunkMinSize && isChunkBoundary(context->pendingFiles.back()))
+	{
+		while (!context->pendingFiles.empty())
+		{
+			flushChunk(context, kChunkMaxSize);
+		}
+	}
+}
+
+static void flushPendingFiles(BuildContext* context)
+{
+	// If there's no boundary for a while, we have to split the chunk; this is deterministic given the previous boundary,
+	// so after an insertion the chunks converge to the same boundaries at the next content-defined boundary.
+	while (context->pendingSize >= kChunkMaxSize)
+	{
+		flushChunk(context, kChunkSize);
+	}
+}
+
+static void appendFilePart(BuildContext* context, const char* path, unsigned int startLine, const char* data, size_t dataSize, uint64_t timeStamp, uint64_t fileSize, uint64_t contentHash, unsigned int flags, const Blob* dataSource)
 {
 	if (!context->pendingFiles.empty() && context->pendingFiles.back().name == path)
 	{
 		File& file = context->pendingFiles.back();
 
 		assert(file.startLine < startLine);
-		assert(file.timeStamp == timeStamp && file.fileSize == fileSize);
+		assert(file.timeStamp == timeStamp && file.fileSize == fileSize && file.contentHash == contentHash);
 		assert(file.contents.offset + file.contents.count == file.contents.storage->size());
 
 		file.contents.storage->insert(file.contents.storage->end(), data, data + dataSize);
@@ -617,114 +847,580 @@ static void appendFilePart(BuildContext* context, const char* path, unsigned int
 	}
 	else
 	{
+		flushChunkBoundary(context);
+
 		File file;
 
 		file.name = path;
 		file.startLine = startLine;
+		file.flags = flags;
 		file.timeStamp = timeStamp;
 		file.fileSize = fileSize;
-		file.contents = dataSource ? std::move(*dataSource) : std::vector<char>(data, data + dataSize);
+		file.contentHash = contentHash;
+		file.contents = dataSource ? *dataSource : Blob(std::vector<char>(data, data + dataSize));
 
 		context->pendingFiles.emplace_back(file);
 		context->pendingSize += dataSize;
-	}
 
-	// We try to maintain a small pending set; this makes sure we have at most 2 chunk sizes worth of data
-	// It's possible in theory to flush chunks earlier (when we reach kChunkSize), but this means that if we
-	// see an already compressed chunk (buildAppendChunk), we may not be able to rebalance chunk sizes and will
-	// be forced to recompress.
-	while (context->pendingSize >= kChunkSize * 2)
-	{
-		flushChunk(context, kChunkSize);
+		// the first part of the original file has to be added before any duplicates can reference it
+		if ((flags & DF_HASDUPLICATES) && startLine == 0)
+			context->originalFiles[contentHash] = path;
 	}
+
+	flushPendingFiles(context);
+}
+
+static void appendDuplicateFile(BuildContext* context, const char* path, uint64_t timeStamp, uint64_t fileSize, uint64_t contentHash, const std::string& original, const Blob& contents)
+{
+	flushChunkBoundary(context);
+
+	File file;
+
+	file.name = path;
+	file.startLine = 0;
+	file.flags = DF_DUPLICATE;
+	file.timeStamp = timeStamp;
+	file.fileSize = fileSize;
+	file.contentHash = contentHash;
+	file.duplicateOf = original;
+	file.duplicateContents = contents;
+
+	context->pendingFiles.emplace_back(file);
+	context->pendingSize += contents.size();
+
+	flushPendingFiles(context);
 }
 
-void buildAppendFilePart(BuildContext* context, const char* path, unsigned int startLine, const char* data, size_t dataSize, uint64_t timeStamp, uint64_t fileSize)
+static uint64_t getContentHash(const char* data, size_t size)
 {
-	appendFilePart(context, path, startLine, data, dataSize, timeStamp, fileSize, nullptr);
+	return XXH64(data, size, 0);
 }
 
-bool buildAppendFile(BuildContext* context, const char* path, uint64_t timeStamp, uint64_t fileSize)
+static bool readFileContents(const char* path, std::vector<char>& result)
 {
 	FileStream in(path, "rb");
 	if (!in)
+		return false;
+
+	try
+	{
+		result = convertToUTF8(readFile(in));
+		return true;
+	}
+	catch (const std::bad_alloc&)
 	{
-		context->output->error("Error reading file %s\n", path);
 		return false;
 	}
+}
 
-	try
+static bool readPendingFile(Output* output, PendingAppend& file)
+{
+	FileStream in(file.path.c_str(), "rb");
+	if (!in)
 	{
-		std::vector<char> contents = convertToUTF8(readFile(in));
+		output->error("Error reading file %s\n", file.path.c_str());
+		return false;
+	}
 
-		appendFilePart(context, path, 0, contents.empty() ? 0 : &contents[0], contents.size(), timeStamp, fileSize, &contents);
+	try
+	{
+		file.contents = convertToUTF8(readFile(in));
+		file.contentHash = getContentHash(file.contents.data(), file.contents.size());
 
 		return true;
 	}
 	catch (const std::bad_alloc&)
 	{
-		context->output->error("Error reading file %s: out of memory\n", path);
+		output->error("Error reading file %s: out of memory\n", file.path.c_str());
 		return false;
 	}
 }
 
-static size_t getOptimalChunkSize(size_t pendingSize)
+static bool isOriginalContents(BuildContext* context, uint64_t contentHash, const std::string& original, const std::vector<char>& contents)
 {
-	// This function returns a size in [0.75x .. 1.5x] range (or 0)
-	const size_t kChunkMaxSize = kChunkSize * 3 / 2;
-	const size_t kChunkMinSize = kChunkMaxSize / 2;
+	auto cached = context->originalContents.find(contentHash);
 
-	// Never store chunks smaller than 0.75x
-	if (pendingSize < kChunkMinSize)
-		return 0;
+	if (cached != context->originalContents.end())
+	{
+		const Blob& blob = cached->second.first;
 
-	// If we have at least 2 chunks worth of data, it's safe to store a full chunk
-	if (pendingSize >= kChunkSize * 2)
-		return kChunkSize;
+		return blob.size() == contents.size() && memcmp(blob.data(), contents.data(), contents.size()) == 0;
+	}
 
-	// If we have less than 1.5x chunks, we need to store the entire set in one go
-	if (pendingSize < kChunkMaxSize)
-		return pendingSize;
+	// the original contents isn't in memory if the original is in a chunk preserved by update, so we read the original again
+	std::vector<char> originalContents;
 
-	// Otherwise we should split the chunk in half; the reason why it's important to not just
-	// return kChunkSize here is that if we have, say, 1.6x chunks to store, splitting into 1x and 0.6x
-	// leaves us with a chunk that's smaller than 0.75x
-	// Splitting in half makes sure that both halves are at least kChunkMinSize
-	return pendingSize / 2;
+	return readFileContents(original.c_str(), originalContents) && originalContents == contents;
 }
 
-bool buildAppendChunk(BuildContext* context, const DataChunkHeader& header, std::unique_ptr<char[]>& compressedData, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra, bool firstFileIsSuffix)
+static void releaseOriginalContents(BuildContext* context, std::unordered_map<uint64_t, std::pair<Blob, unsigned int>>::iterator it)
 {
-	// In order to maintain file order, we need to flush pending files before writing the chunk.
-	// To balance the cost of chunk recompression with chunk sizes, we flush all files but instead of
-	// using a fixed chunk size, we use a balanced chunk size computed in getOptimalChunkSize
-	while (!context->pendingFiles.empty())
+	assert(it->second.second > 0);
+
+	if (--it->second.second == 0)
+	{
+		context->originalContentsSize -= it->second.first.size();
+		context->originalContents.erase(it);
+	}
+}
+
+static void appendPendingFile(BuildContext* context, PendingAppend& file)
+{
+	if (!file.duplicateOf.empty())
+	{
+		auto original = context->originalFiles.find(file.contentHash);
+
+		Blob contents(std::move(file.contents));
+
+		// the reference is still valid if the original was appended again with the same contents; otherwise the file gets its own copy
+		if (original != context->originalFiles.end() && original->second == file.duplicateOf)
+			appendDuplicateFile(context, file.path.c_str(), file.timeStamp, file.fileSize, file.contentHash, original->second, contents);
+		else
+			appendFilePart(context, file.path.c_str(), 0, contents.data(), contents.size(), file.timeStamp, file.fileSize, file.contentHash, 0, &contents);
+
+		return;
+	}
+
+	if (file.duplicate)
+	{
+		auto cached = context->originalContents.find(file.contentHash);
+		auto original = context->originalFiles.find(file.contentHash);
+
+		if (cached != context->originalContents.end() && original != context->originalFiles.end())
+		{
+			appendDuplicateFile(context, file.path.c_str(), file.timeStamp, file.fileSize, file.contentHash, original->second, cached->second.first);
+			releaseOriginalContents(context, cached);
+			return;
+		}
+
+		// the original wasn't added with the contents it had when the duplicates were found, so the file has to be read
+		if (!readPendingFile(context->output, file))
+			return;
+	}
+	else if (file.read.valid() && !file.read.get())
+		return;
+
+	if (file.fullFile)
 	{
-		size_t chunkSize = getOptimalChunkSize(context->pendingSize);
+		auto original = context->originalFiles.find(file.contentHash);
 
-		if (chunkSize == 0)
-			return false;
+		// content hashes can collide, so the contents are compared before the file is stored as a duplicate
+		if (original != context->originalFiles.end() && isOriginalContents(context, file.contentHash, original->second, file.contents))
+		{
+			appendDuplicateFile(context, file.path.c_str(), file.timeStamp, file.fileSize, file.contentHash, original->second, Blob(std::move(file.contents)));
+		}
+		else
+		{
+			unsigned int flags = (original == context->originalFiles.end() && context->duplicateHashes.count(file.contentHash)) ? DF_HASDUPLICATES : 0;
 
-		flushChunk(context, chunkSize);
+			Blob contents(std::move(file.contents));
+
+			appendFilePart(context, file.path.c_str(), 0, contents.data(), contents.size(), file.timeStamp, file.fileSize, file.contentHash, flags, &contents);
+
+			// duplicates that were found before the build reuse the contents of the original instead of reading the files again
+			auto group = context->duplicateGroups.find(file.contentHash);
+
+			if ((flags & DF_HASDUPLICATES) && group != context->duplicateGroups.end() && group->second.first == file.path &&
+				context->originalContentsSize + contents.size() <= kDuplicateMaxCachedSize)
+			{
+				context->originalContents[file.contentHash] = std::make_pair(contents, group->second.second);
+				context->originalContentsSize += contents.size();
+			}
+		}
+	}
+	else
+	{
+		Blob contents(std::move(file.contents));
+
+		appendFilePart(context, file.path.c_str(), file.startLine, contents.data(), contents.size(), file.timeStamp, file.fileSize, file.contentHash, file.flags, &contents);
+	}
+}
+
+static size_t getPendingSize(const PendingAppend& file)
+{
+	// file contents can be larger than the file size after UTF-8 conversion, but this is good enough to limit the memory use
+	return file.read.valid() ? file.fileSize : file.contents.size();
+}
+
+static void flushPendingAppends(BuildContext* context, bool wait)
+{
+	while (!context->pendingAppends.empty())
+	{
+		PendingAppend& file = *context->pendingAppends.front();
+
+		// append files that were read already; wait for the reads to finish only if there's too much data in flight
+		if (!wait && context->pendingAppendSize <= kMaxQueuedFileData && file.read.valid() && file.read.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+			break;
+
+		context->pendingAppendSize -= getPendingSize(file);
+
+		appendPendingFile(context, file);
+
+		context->pendingAppends.pop_front();
+	}
+}
+
+void buildAppendFilePart(BuildContext* context, const char* path, unsigned int startLine, const char* data, size_t dataSize, uint64_t timeStamp, uint64_t fileSize, uint64_t contentHash, unsigned int flags)
+{
+	assert((flags & DF_DUPLICATE) == 0);
+
+	// fast path: nothing is being read so we can append the data directly
+	if (context->pendingAppends.empty())
+	{
+		appendFilePart(context, path, startLine, data, dataSize, timeStamp, fileSize, contentHash, flags, nullptr);
+		return;
+	}
+
+	std::unique_ptr<PendingAppend> file(new PendingAppend());
+
+	file->path = path;
+	file->startLine = startLine;
+	file->timeStamp = timeStamp;
+	file->fileSize = fileSize;
+	file->contentHash = contentHash;
+	file->flags = flags;
+	file->contents.assign(data, data + dataSize);
+	file->fullFile = false;
+	file->duplicate = false;
+
+	context->pendingAppendSize += getPendingSize(*file);
+	context->pendingAppends.push_back(std::move(file));
+
+	flushPendingAppends(context, false);
+}
+
+void buildAppendFile(BuildContext* context, const char* path, uint64_t timeStamp, uint64_t fileSize)
+{
+	std::unique_ptr<PendingAppend> file(new PendingAppend());
+
+	file->path = path;
+	file->startLine = 0;
+	file->timeStamp = timeStamp;
+	file->fileSize = fileSize;
+	file->contentHash = 0;
+	file->flags = 0;
+	file->fullFile = true;
+	file->duplicate = false;
+
+	// the file was compared with the original when preparing the build, so it's appended using the contents of the original
+	auto duplicate = context->duplicateFiles.find(path);
+
+	if (duplicate != context->duplicateFiles.end())
+	{
+		file->contentHash = duplicate->second;
+		file->duplicate = true;
+
+		context->pendingAppendSize += getPendingSize(*file);
+		context->pendingAppends.push_back(std::move(file));
+
+		flushPendingAppends(context, false);
+		return;
+	}
+
+	std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+	file->read = promise->get_future();
+
+	Output* output = context->output;
+	PendingAppend* target = file.get();
+
+	context->readFileQueue.push([=]() { promise->set_value(readPendingFile(output, *target)); });
+
+	context->pendingAppendSize += getPendingSize(*file);
+	context->pendingAppends.push_back(std::move(file));
+
+	flushPendingAppends(context, false);
+}
+
+void buildAppendDuplicateFile(BuildContext* context, const char* path, uint64_t timeStamp, uint64_t fileSize, uint64_t contentHash, const char* original, std::vector<char> contents)
+{
+	std::unique_ptr<PendingAppend> file(new PendingAppend());
+
+	file->path = path;
+	file->startLine = 0;
+	file->timeStamp = timeStamp;
+	file->fileSize = fileSize;
+	file->contentHash = contentHash;
+	file->flags = 0;
+	file->contents = std::move(contents);
+	file->fullFile = true;
+	file->duplicate = false;
+	file->duplicateOf = original;
+
+	context->pendingAppendSize += getPendingSize(*file);
+	context->pendingAppends.push_back(std::move(file));
+
+	flushPendingAppends(context, false);
+}
+
+uint64_t buildHashFile(const char* path)
+{
+	std::vector<char> contents;
+
+	return readFileContents(path, contents) ? getContentHash(contents.data(), contents.size()) : 0;
+}
+
+void buildPrepareDuplicates(BuildContext* context, const std::vector<FileInfo>& files)
+{
+	// Only files that have the same size as some other file can be duplicates, so we only need to hash these
+	std::unordered_map<uint64_t, unsigned int> sizeCounts;
+
+	for (auto& f: files)
+		if (f.fileSize >= kDuplicateMinFileSize)
+			sizeCounts[f.fileSize]++;
+
+	std::vector<const FileInfo*> candidates;
+
+	for (auto& f: files)
+		if (f.fileSize >= kDuplicateMinFileSize && sizeCounts[f.fileSize] > 1)
+			candidates.push_back(&f);
+
+	std::vector<uint64_t> hashes(candidates.size());
+
+	{
+		WorkQueue queue(WorkQueue::getIdealWorkerCount(), 0);
+
+		for (size_t i = 0; i < candidates.size(); ++i)
+			queue.push([&, i] { hashes[i] = buildHashFile(candidates[i]->path.c_str()); });
+	}
+
+	// Candidates are in file order, so the first file in each group is the one that will be appended as the original
+	std::unordered_map<uint64_t, std::vector<const FileInfo*>> groups;
+
+	for (size_t i = 0; i < candidates.size(); ++i)
+		if (hashes[i] != 0)
+			groups[hashes[i]].push_back(candidates[i]);
+
+	std::vector<std::pair<uint64_t, const std::vector<const FileInfo*>*>> duplicateGroups;
+
+	for (auto& g: groups)
+		if (g.second.size() > 1)
+			duplicateGroups.push_back(std::make_pair(g.first, &g.second));
+
+	// Content hashes can collide, so the files are compared with the original; only files with the same contents can reuse it
+	std::vector<std::vector<bool>> equal(duplicateGroups.size());
+
+	{
+		WorkQueue queue(WorkQueue::getIdealWorkerCount(), 0);
+
+		for (size_t i = 0; i < duplicateGroups.size(); ++i)
+			queue.push([&, i] {
+				const std::vector<const FileInfo*>& group = *duplicateGroups[i].second;
+
+				equal[i].resize(group.size());
+
+				std::vector<char> original;
+				if (!readFileContents(group[0]->path.c_str(), original))
+					return;
+
+				for (size_t j = 1; j < group.size(); ++j)
+				{
+					std::vector<char> contents;
+					equal[i][j] = readFileContents(group[j]->path.c_str(), contents) && contents == original;
+				}
+			});
+	}
+
+	for (size_t i = 0; i < duplicateGroups.size(); ++i)
+	{
+		uint64_t hash = duplicateGroups[i].first;
+		const std::vector<const FileInfo*>& group = *duplicateGroups[i].second;
+
+		// files that don't match the original may still be duplicates of each other; these are found while building
+		context->duplicateHashes.insert(hash);
+
+		unsigned int count = 0;
+
+		for (size_t j = 1; j < group.size(); ++j)
+			if (equal[i][j])
+			{
+				context->duplicateFiles[group[j]->path] = hash;
+				count++;
+			}
+
+		if (count > 0)
+			context->duplicateGroups[hash] = std::make_pair(group[0]->path, count);
+	}
+}
+
+static std::vector<char> readFileSample(const char* path, size_t size)
+{
+	FileStream in(path, "rb");
+	if (!in)
+		return std::vector<char>();
+
+	try
+	{
+		std::vector<char> result(size);
+		result.resize(in.read(result.data(), result.size()));
+
+		if (!result.empty())
+			result.resize(normalizeEOL(&result[0], result.size()));
+
+		result = convertToUTF8(std::move(result));
+
+		if (result.size() > size)
+			result.resize(size);
+
+		return result;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return std::vector<char>();
+	}
+}
+
+std::vector<char> buildPrepareDictionary(Output* output, const std::vector<FileInfo>& files)
+{
+	output->print("Training dictionary...\r");
+
+	// The dictionary is trained on file prefixes sampled uniformly across the project; this captures common content like
+	// license headers and include lists, whereas the rest of the file is usually well compressible by itself
+	size_t sampleCount = std::min(files.size(), kDictionarySampleSize / kDictionarySampleFileSize);
+
+	std::vector<std::vector<char>> samples(sampleCount);
+
+	{
+		WorkQueue queue(WorkQueue::getIdealWorkerCount(), 0);
+
+		for (size_t i = 0; i < sampleCount; ++i)
+			queue.push([&, i] { samples[i] = readFileSample(files[i * files.size() / sampleCount].path.c_str(), kDictionarySampleFileSize); });
+	}
+
+	return trainDictionary(samples, kDictionarySize);
+}
+
+static bool prepareAppendChunk(BuildContext* context, const DataChunkHeader& header, const char* fileTable)
+{
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(fileTable);
+
+	// Duplicate files can only be preserved if the original file is still stored with the same contents; the original can be in the same chunk
+	std::unordered_map<uint64_t, std::string> chunkOriginals;
+
+	for (size_t i = 0; i < header.fileCount; ++i)
+	{
+		const DataChunkFileHeader& f = files[i];
+
+		if ((f.flags & DF_HASDUPLICATES) && f.startLine == 0)
+			chunkOriginals[f.contentHash] = std::string(fileTable + f.nameOffset, f.nameLength);
+
+		if (f.flags & DF_DUPLICATE)
+		{
+			auto chunkOriginal = chunkOriginals.find(f.contentHash);
+			auto original = context->originalFiles.find(f.contentHash);
+
+			const std::string* originalPath =
+				(chunkOriginal != chunkOriginals.end()) ? &chunkOriginal->second :
+				(original != context->originalFiles.end()) ? &original->second :
+				nullptr;
+
+			if (!originalPath || originalPath->compare(0, std::string::npos, fileTable + f.dataOffset, f.dataSize) != 0)
+				return false;
+		}
+	}
+
+	// In order to maintain file order, we need to flush pending files before writing the chunk.
+	// Pending files end at a boundary of the existing chunk, so we store them in a separate chunk unless it's too small;
+	// in that case the chunk is recompressed together with pending files, which gets us to the next boundary.
+	if (!context->pendingFiles.empty() && context->pendingSize < kChunkMinSize)
+		return false;
+
+	while (!context->pendingFiles.empty())
+	{
+		flushChunk(context, kChunkMaxSize);
 	}
 
 	// We should be good to go now
 	assert(context->pendingSize == 0 && context->pendingFiles.empty());
 
+	for (auto& o: chunkOriginals)
+		context->originalFiles[o.first] = o.second;
+
+	return true;
+}
+
+void buildSetCompressionLevel(BuildContext* context, int level)
+{
+	context->recompress = context->codec == DCC_LZ4 && level < context->compressionLevel;
+	context->compressionLevel = level;
+}
+
+bool buildOpenSource(BuildContext* context, const char* path)
+{
+	return context->sourceData.open(path, "rb");
+}
+
+bool buildAppendChunk(BuildContext* context, const DataChunkHeader& header, const char* fileTable, uint64_t sourceOffset, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra)
+{
+	// the chunk goes after all files that were appended before it
+	flushPendingAppends(context, true);
+
+	// Chunks stored with a different codec need to be recompressed
+	if (!context->sourceData || header.codec != context->codec || !prepareAppendChunk(context, header, fileTable))
+		return false;
+
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(fileTable);
+	bool firstFileIsSuffix = header.fileCount > 0 && files[0].startLine != 0;
+
 	unsigned int order = context->chunkOrder++;
-	writeChunk(context, order, header, std::move(compressedData), std::move(index), std::move(extra), firstFileIsSuffix);
+	writeChunkFromSource(context, order, header, sourceOffset, std::move(index), std::move(extra), firstFileIsSuffix);
 
 	return true;
 }
 
-unsigned int buildFinish(BuildContext* context)
+bool buildAppendChunkData(BuildContext* context, const DataChunkHeader& header, const char* data, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra)
 {
+	// the chunk goes after all files that were appended before it
+	flushPendingAppends(context, true);
+
+	if (!prepareAppendChunk(context, header, data))
+		return false;
+
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
+	bool firstFileIsSuffix = header.fileCount > 0 && files[0].startLine != 0;
+
+	unsigned int order = context->chunkOrder++;
+
+	// workaround for lack of generalized capture
+	std::shared_ptr<ChunkFileData> schunk(new ChunkFileData());
+
+	schunk->header = header;
+	schunk->compressedData.reset(new char[header.uncompressedSize]);
+	schunk->index = std::move(index);
+	schunk->extra = std::move(extra);
+
+	memcpy(schunk->compressedData.get(), data, header.uncompressedSize);
+
+	// the chunk contents didn't change so the index is preserved, but the data has to be compressed again
+	context->prepareChunkQueue.push([=] {
+		const std::vector<char>& dictionary = context->dictionary;
+		unsigned int codec = context->codec;
+
+		std::pair<std::unique_ptr<char[]>, size_t> cdata = (codec == DCC_NONE)
+			? std::make_pair(std::move(schunk->compressedData), size_t(schunk->header.uncompressedSize))
+			: compress(schunk->compressedData.get(), schunk->header.uncompressedSize, context->compressionLevel, dictionary.data(), dictionary.size());
+
+		DataChunkHeader header = schunk->header;
+		header.compressedSize = cdata.second;
+		header.flags = (header.flags & ~(DC_DICTIONARY | DC_RECOMPRESS)) | ((codec == DCC_LZ4 && !dictionary.empty()) ? DC_DICTIONARY : 0) | (context->recompress ? DC_RECOMPRESS : 0);
+		header.codec = codec;
+		header.dataPadding = 0;
+
+		writeChunk(context, order, header, std::move(cdata.first), std::move(schunk->index), std::move(schunk->extra), firstFileIsSuffix);
+	}, header.uncompressedSize);
+
+	return true;
+}
+
+bool buildFinish(BuildContext* context, unsigned int* chunkCount)
+{
+	flushPendingAppends(context, true);
+
 	if (context->writeChunkThread.joinable())
 	{
-		// Write all remaining files (usually just flushes a single chunk)
+		// Write all remaining files (pending files always fit in a single chunk)
 		while (!context->pendingFiles.empty())
 		{
-			flushChunk(context, kChunkSize);
+			flushChunk(context, kChunkMaxSize);
 		}
 
 		ChunkFileData chunkDummy = { context->chunkOrder };
@@ -732,26 +1428,37 @@ unsigned int buildFinish(BuildContext* context)
 		context->writeChunkThread.join();
 	}
 
-	unsigned int result = context->chunkOrder;
+	if (chunkCount)
+		*chunkCount = context->chunkOrder;
+
+	bool result = !context->writeFailed;
 
 	delete context;
 
 	return result;
 }
 
-void buildProject(Output* output, const char* path)
+void buildProject(Output* output, const char* path, bool fast)
 {
 	output->print("Building %s:\n", path);
 
-	std::unique_ptr<ProjectGroup> group = parseProject(output, path);
+	ProjectOptions options;
+	std::unique_ptr<ProjectGroup> group = parseProject(output, path, &options);
 	if (!group)
 		return;
 
+	FileLock lock(replaceExtension(path, ".qgl").c_str());
+	if (!lock)
+	{
+		output->error("Error locking project %s\n", path);
+		return;
+	}
+
 	removeFile(replaceExtension(path, ".qgc").c_str());
 
 	output->print("Scanning project...\r");
 
-	std::vector<FileInfo> files = getProjectGroupFiles(output, group.get());
+	std::vector<FileInfo> files = scanProjectFiles(output, path, group.get(), options, true, std::vector<std::string>());
 
 	output->print("Building file table...\r");
 
@@ -762,15 +1469,29 @@ void buildProject(Output* output, const char* path)
 	std::string tempPath = targetPath + "_";
 
 	{
-		BuildContext* builder = buildStart(output, tempPath.c_str(), files.size());
+		std::vector<char> dictionary;
+
+		if (options.dictionary && options.compression == PC_LZ4)
+			dictionary = buildPrepareDictionary(output, files);
+
+		output->print("Finding duplicate files...\r");
+
+		BuildContext* builder = buildStart(output, tempPath.c_str(), options, files.size(), dictionary);
 		if (!builder) return;
 
+		// fast builds are recompressed with the project compression level on the next update
+		if (fast)
+			buildSetCompressionLevel(builder, kFastDataCompressionLevel);
+
+		buildPrepareDuplicates(builder, files);
+
 		for (auto& f: files)
 		{
 			buildAppendFile(builder, f.path.c_str(), f.timeStamp, f.fileSize);
 		}
 
-		buildFinish(builder);
+		if (!buildFinish(builder))
+			return;
 	}
 
 	output->print("\n");
@@ -780,4 +1501,6 @@ void buildProject(Output* output, const char* path)
 		output->error("Error saving data file %s\n", targetPath.c_str());
 		return;
 	}
+
+	removeFile(replaceExtension(path, ".qgs").c_str());
 }
@@ -2,18 +2,33 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 
 class Output;
 struct DataChunkHeader;
+struct FileInfo;
+struct ProjectOptions;
 
 struct BuildContext;
 
-BuildContext* buildStart(Output* output, const char* path, unsigned int fileCount = 0);
+BuildContext* buildStart(Output* output, const char* path, const ProjectOptions& options, unsigned int fileCount = 0, const std::vector<char>& dictionary = std::vector<char>());
 
-void buildAppendFilePart(BuildContext* context, const char* path, unsigned int startLine, const char* data, size_t dataSize, uint64_t timeStamp, uint64_t fileSize);
-bool buildAppendFile(BuildContext* context, const char* path, uint64_t timeStamp, uint64_t fileSize);
-bool buildAppendChunk(BuildContext* context, const DataChunkHeader& header, std::unique_ptr<char[]>& compressedData, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra, bool firstFileIsSuffix);
+std::vector<char> buildPrepareDictionary(Output* output, const std::vector<FileInfo>& files);
 
-unsigned int buildFinish(BuildContext* context);
+void buildPrepareDuplicates(BuildContext* context, const std::vector<FileInfo>& files);
+void buildSetCompressionLevel(BuildContext* context, int level);
 
-void buildProject(Output* output, const char* path);
+void buildAppendFilePart(BuildContext* context, const char* path, unsigned int startLine, const char* data, size_t dataSize, uint64_t timeStamp, uint64_t fileSize, uint64_t contentHash, unsigned int flags);
+void buildAppendFile(BuildContext* context, const char* path, uint64_t timeStamp, uint64_t fileSize);
+// Appends a file that the existing database stores as a duplicate of the original, using the original contents from the database instead of reading the file
+void buildAppendDuplicateFile(BuildContext* context, const char* path, uint64_t timeStamp, uint64_t fileSize, uint64_t contentHash, const char* original, std::vector<char> contents);
+bool buildOpenSource(BuildContext* context, const char* path);
+bool buildAppendChunk(BuildContext* context, const DataChunkHeader& header, const char* fileTable, uint64_t sourceOffset, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra);
+bool buildAppendChunkData(BuildContext* context, const DataChunkHeader& header, const char* data, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra);
+
+uint64_t buildHashFile(const char* path);
+
+// Returns false if the data file could not be written completely, in which case it must not be published
+bool buildFinish(BuildContext* context, unsigned int* chunkCount = nullptr);
+
+void buildProject(Output* output, const char* path, bool fast = false);
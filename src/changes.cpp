@@ -6,21 +6,93 @@
 #include "filestream.hpp"
 #include "output.hpp"
 #include "project.hpp"
+#include "format.hpp"
 
 #include <algorithm>
-#include <fstream>
 
-std::vector<std::string> readChanges(const char* path)
+#include <string.h>
+
+static bool readChangeList(const char* data, size_t size, std::vector<FileInfo>& result)
 {
-	std::string filePath = replaceExtension(path, ".qgc");
+	ChangeFileHeader header;
+	if (size < sizeof(header))
+		return false;
 
-	std::vector<std::string> result;
-	std::string line;
+	memcpy(&header, data, sizeof(header));
+
+	size_t pathBufferOffset = sizeof(header) + header.fileCount * sizeof(ChangeFileEntry);
+
+	if (pathBufferOffset + header.pathBufferLength > size)
+		return false;
+
+	const ChangeFileEntry* entries = reinterpret_cast<const ChangeFileEntry*>(data + sizeof(header));
+	const char* pathBuffer = data + pathBufferOffset;
+
+	result.reserve(header.fileCount);
+
+	for (size_t i = 0; i < header.fileCount; ++i)
+	{
+		const ChangeFileEntry& e = entries[i];
+
+		if (e.pathOffset > header.pathBufferLength || e.pathLength > header.pathBufferLength - e.pathOffset)
+			return false;
+
+		result.push_back({ std::string(pathBuffer + e.pathOffset, e.pathLength), e.timeStamp, e.fileSize });
+	}
+
+	return true;
+}
 
-	std::ifstream in(filePath.c_str(), std::ios::in);
+static void readLegacyChangeList(const char* data, size_t size, std::vector<FileInfo>& result)
+{
+	const char* end = data + size;
+
+	// change lists written by older versions are text files with one path per line and no attributes
+	while (data < end)
+	{
+		const char* line = std::find(data, end, '\n');
+
+		if (line != data)
+			result.push_back({ std::string(data, line), 0, 0 });
+
+		data = (line == end) ? line : line + 1;
+	}
+
+	std::sort(result.begin(), result.end(), [](const FileInfo& l, const FileInfo& r) { return l.path < r.path; });
+	result.erase(std::unique(result.begin(), result.end(), [](const FileInfo& l, const FileInfo& r) { return l.path == r.path; }), result.end());
+}
+
+std::vector<FileInfo> readChangedFiles(Output* output, const char* path)
+{
+	std::string listPath = replaceExtension(path, ".qgc");
+	FileMapping mapping(listPath.c_str());
+
+	std::vector<FileInfo> result;
 
-	while (std::getline(in, line))
-		result.push_back(line);
+	if (!mapping)
+		return result;
+
+	if (mapping.size() >= strlen(kChangeFileHeaderMagic) && memcmp(mapping.data(), kChangeFileHeaderMagic, strlen(kChangeFileHeaderMagic)) == 0)
+	{
+		// a damaged list can't be read as text since its paths would be garbage
+		if (!readChangeList(mapping.data(), mapping.size(), result))
+		{
+			output->error("Error reading change list %s: file is corrupted\n", listPath.c_str());
+			result.clear();
+		}
+	}
+	else
+		readLegacyChangeList(mapping.data(), mapping.size(), result);
+
+	return result;
+}
+
+std::vector<std::string> readChanges(Output* output, const char* path)
+{
+	std::vector<std::string> result;
+
+	for (auto& f: readChangedFiles(output, path))
+		result.push_back(std::move(f.path));
 
 	return result;
 }
@@ -30,35 +102,47 @@ bool writeChanges(const char* path, const std::vector<std::string>& files)
 	std::string targetPath = replaceExtension(path, ".qgc");
 	std::string tempPath = targetPath + "_";
 
+	std::vector<std::string> paths = files;
+
+	std::sort(paths.begin(), paths.end());
+	paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+	std::vector<ChangeFileEntry> entries(paths.size());
+	std::string pathBuffer;
+
+	for (size_t i = 0; i < paths.size(); ++i)
+	{
+		ChangeFileEntry& e = entries[i];
+
+		// searches can use the delta segment instead of reading the file if the file is still the same as when the change was recorded
+		if (!getFileAttributes(paths[i].c_str(), &e.timeStamp, &e.fileSize))
+			e.timeStamp = e.fileSize = 0;
+
+		e.pathOffset = pathBuffer.size();
+		e.pathLength = paths[i].size();
+
+		pathBuffer += paths[i];
+	}
+
+	ChangeFileHeader header = {};
+	memcpy(header.magic, kChangeFileHeaderMagic, sizeof(header.magic));
+	header.fileCount = entries.size();
+	header.pathBufferLength = pathBuffer.size();
+
 	{
 		FileStream out(tempPath.c_str(), "wb");
 		if (!out)
 			return false;
 
-		for (auto& f: files)
-		{
-			out.write(f.data(), f.size());
-			out.write("\n", 1);
-		}
+		out.write(&header, sizeof(header));
+		out.write(entries.data(), entries.size() * sizeof(ChangeFileEntry));
+		out.write(pathBuffer.data(), pathBuffer.size());
 	}
 
+	// the list is replaced atomically so that concurrent searches never see a partially written list
 	return renameFile(tempPath.c_str(), targetPath.c_str());
 }
 
-static bool isFileInProjectGroupRec(ProjectGroup* group, const std::string& file)
-{
-	for (auto& path: group->paths)
-		if (file.length() > path.length() && file.compare(0, path.length(), path) == 0)
-			if (isFileAcceptable(group, file.c_str()))
-				return true;
-
-	for (auto& child: group->groups)
-		if (isFileInProjectGroupRec(child.get(), file))
-			return true;
-
-	return false;
-}
-
 void appendChanges(Output* output, const char* path, const std::vector<std::string>& files)
 {
 	std::unique_ptr<ProjectGroup> group = parseProject(output, path);
@@ -66,13 +150,13 @@ void appendChanges(Output* output, const char* path, const std::vector<std::stri
 		return;
 
 	bool writeNeeded = false;
-	std::vector<std::string> changes = readChanges(path);
+	std::vector<std::string> changes = readChanges(output, path);
 
 	for (auto& file: files)
 	{
 		std::string nf = normalizePath(getCurrentDirectory().c_str(), file.c_str());
 
-		if (isFileInProjectGroupRec(group.get(), nf.c_str()))
+		if (isFileInProject(group.get(), nf))
 		{
 			writeNeeded = true;
 			changes.push_back(nf);
@@ -81,9 +165,6 @@ void appendChanges(Output* output, const char* path, const std::vector<std::stri
 
 	if (writeNeeded)
 	{
-		std::sort(changes.begin(), changes.end());
-		changes.erase(std::unique(changes.begin(), changes.end()), changes.end());
-
 		if (!writeChanges(path, changes))
 			output->error("Error writing changes for project %s\n", path);
 	}
@@ -5,8 +5,11 @@
 #include <string>
 
 class Output;
+struct FileInfo;
 
-std::vector<std::string> readChanges(const char* path);
+// Change list is sorted by path and has the attributes each file had when the list was written
+std::vector<FileInfo> readChangedFiles(Output* output, const char* path);
+std::vector<std::string> readChanges(Output* output, const char* path);
 bool writeChanges(const char* path, const std::vector<std::string>& files);
 
 void appendChanges(Output* output, const char* path, const std::vector<std::string>& files);
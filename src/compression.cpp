@@ -5,7 +5,41 @@
 #include "lz4.h"
 #include "lz4hc.h"
 
-std::pair<std::unique_ptr<char[]>, size_t> compress(const void* data, size_t dataSize, int level)
+#include <queue>
+#include <algorithm>
+#include <new>
+
+#include <string.h>
+
+static int getAcceleration(int level)
+{
+	// negative levels select fast compression with higher acceleration, which trades compression ratio for speed
+	return std::max(-level, 1);
+}
+
+static int compressWithDictionary(const char* data, char* cdata, int dataSize, int csizeBound, int level, const char* dictionary, int dictionarySize)
+{
+	if (level <= 0)
+	{
+		LZ4_stream_t stream;
+		LZ4_initStream(&stream, sizeof(stream));
+		LZ4_loadDict(&stream, dictionary, dictionarySize);
+
+		return LZ4_compress_fast_continue(&stream, data, cdata, dataSize, csizeBound, getAcceleration(level));
+	}
+	else
+	{
+		std::unique_ptr<LZ4_streamHC_t, int (*)(LZ4_streamHC_t*)> stream(LZ4_createStreamHC(), LZ4_freeStreamHC);
+		if (!stream) throw std::bad_alloc();
+
+		LZ4_resetStreamHC_fast(stream.get(), level);
+		LZ4_loadDictHC(stream.get(), dictionary, dictionarySize);
+
+		return LZ4_compress_HC_continue(stream.get(), data, cdata, dataSize, csizeBound);
+	}
+}
+
+std::pair<std::unique_ptr<char[]>, size_t> compress(const void* data, size_t dataSize, int level, const void* dictionary, size_t dictionarySize)
 {
 	if (dataSize == 0) return std::make_pair(std::unique_ptr<char[]>(), 0);
 
@@ -13,30 +47,169 @@ std::pair<std::unique_ptr<char[]>, size_t> compress(const void* data, size_t dat
 
 	std::unique_ptr<char[]> cdata(new char[csizeBound]);
 	
-	int csize = (level == 0)
-		? LZ4_compress_default(static_cast<const char*>(data), cdata.get(), dataSize, csizeBound)
+	int csize = (dictionarySize > 0)
+		? compressWithDictionary(static_cast<const char*>(data), cdata.get(), dataSize, csizeBound, level, static_cast<const char*>(dictionary), dictionarySize)
+		: (level <= 0)
+		? LZ4_compress_fast(static_cast<const char*>(data), cdata.get(), dataSize, csizeBound, getAcceleration(level))
 		: LZ4_compress_HC(static_cast<const char*>(data), cdata.get(), dataSize, csizeBound, level);
 	assert(csize >= 0 && csize <= csizeBound);
 
 	return std::make_pair(std::move(cdata), csize);
 }
 
-void decompress(void* dest, size_t destSize, const void* source, size_t sourceSize)
+void decompress(void* dest, size_t destSize, const void* source, size_t sourceSize, const void* dictionary, size_t dictionarySize)
 {
 	if (sourceSize == 0 && destSize == 0) return;
 
-	int result = LZ4_decompress_safe(static_cast<const char*>(source), static_cast<char*>(dest), sourceSize, destSize);
+	int result = (dictionarySize > 0)
+		? LZ4_decompress_safe_usingDict(static_cast<const char*>(source), static_cast<char*>(dest), sourceSize, destSize, static_cast<const char*>(dictionary), dictionarySize)
+		: LZ4_decompress_safe(static_cast<const char*>(source), static_cast<char*>(dest), sourceSize, destSize);
 	assert(result >= 0);
 	assert(static_cast<size_t>(result) == destSize);
 }
 
-void decompressPartial(void* dest, size_t destSize, const void* source, size_t sourceSize, size_t targetSize)
+bool decompressPartial(void* dest, size_t destSize, const void* source, size_t sourceSize, size_t targetSize, const void* dictionary, size_t dictionarySize)
 {
 	assert(targetSize <= destSize);
-	if (sourceSize == 0 && destSize == 0) return;
+	if (sourceSize == 0 && destSize == 0) return true;
 
-	int result = LZ4_decompress_safe_partial(static_cast<const char*>(source), static_cast<char*>(dest), sourceSize, targetSize, destSize);
-	assert(result >= 0);
-	assert(static_cast<size_t>(result) >= targetSize);
-	assert(static_cast<size_t>(result) <= destSize);
+	int result = (dictionarySize > 0)
+		? LZ4_decompress_safe_partial_usingDict(static_cast<const char*>(source), static_cast<char*>(dest), sourceSize, targetSize, destSize, static_cast<const char*>(dictionary), dictionarySize)
+		: LZ4_decompress_safe_partial(static_cast<const char*>(source), static_cast<char*>(dest), sourceSize, targetSize, destSize);
+	assert(result < 0 || static_cast<size_t>(result) <= destSize);
+
+	return result >= 0 && static_cast<size_t>(result) >= targetSize;
+}
+
+size_t getCompressedPrefixBound(size_t targetSize)
+{
+	// this is enough for all sequences that start in the prefix unless a literal run that starts in the prefix is much longer than the prefix itself;
+	// in that case decompressPartial fails and the caller needs to provide more data
+	return LZ4_compressBound(targetSize);
+}
+
+static const size_t kDictionaryDmerSize = 8;
+static const size_t kDictionarySegmentSize = 256;
+static const unsigned int kDictionaryHashBits = 20;
+
+struct DictionarySegment
+{
+	unsigned int score;
+	unsigned int sample;
+	unsigned int offset;
+	unsigned int size;
+
+	bool operator<(const DictionarySegment& other) const
+	{
+		return score < other.score;
+	}
+};
+
+static unsigned int hashDmer(const char* data)
+{
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+
+	return static_cast<unsigned int>((value * 0x9E3779B97F4A7C15ull) >> (64 - kDictionaryHashBits));
+}
+
+static unsigned int getSegmentScore(const std::vector<std::vector<char>>& samples, const std::vector<unsigned int>& counts, const DictionarySegment& segment)
+{
+	const char* data = samples[segment.sample].data() + segment.offset;
+	unsigned int result = 0;
+
+	// dmers that are only present in one sample are useless for the dictionary
+	for (size_t i = 0; i + kDictionaryDmerSize <= segment.size; ++i)
+	{
+		unsigned int count = counts[hashDmer(data + i)];
+
+		result += (count > 1) ? count : 0;
+	}
+
+	return result;
+}
+
+// Dictionary is assembled from the sample segments that contain the largest number of dmers shared between samples,
+// which is a simplified version of COVER algorithm used by zstd; dmers are identified by their hash, collisions are harmless.
+std::vector<char> trainDictionary(const std::vector<std::vector<char>>& samples, size_t maxSize)
+{
+	std::vector<unsigned int> counts(1 << kDictionaryHashBits);
+	std::vector<unsigned int> lastSample(1 << kDictionaryHashBits, ~0u);
+
+	// count the number of samples each dmer occurs in
+	for (size_t s = 0; s < samples.size(); ++s)
+	{
+		const std::vector<char>& sample = samples[s];
+
+		for (size_t i = 0; i + kDictionaryDmerSize <= sample.size(); ++i)
+		{
+			unsigned int h = hashDmer(sample.data() + i);
+
+			if (lastSample[h] != s)
+			{
+				lastSample[h] = s;
+				counts[h]++;
+			}
+		}
+	}
+
+	std::priority_queue<DictionarySegment> queue;
+
+	for (size_t s = 0; s < samples.size(); ++s)
+		for (size_t offset = 0; offset + kDictionaryDmerSize <= samples[s].size(); offset += kDictionarySegmentSize)
+		{
+			DictionarySegment segment = { 0, unsigned(s), unsigned(offset), unsigned(std::min(kDictionarySegmentSize, samples[s].size() - offset)) };
+			segment.score = getSegmentScore(samples, counts, segment);
+
+			if (segment.score > 0)
+				queue.push(segment);
+		}
+
+	// greedily select the best segments; scores only decrease as segments are selected, so we can rescore lazily
+	std::vector<DictionarySegment> segments;
+	size_t totalSize = 0;
+
+	while (!queue.empty() && totalSize < maxSize)
+	{
+		DictionarySegment segment = queue.top();
+		queue.pop();
+
+		unsigned int score = getSegmentScore(samples, counts, segment);
+		if (score == 0)
+			continue;
+
+		if (score < segment.score && !queue.empty() && score < queue.top().score)
+		{
+			segment.score = score;
+			queue.push(segment);
+			continue;
+		}
+
+		// contents of the selected segment is in the dictionary now, so other segments don't benefit from the same dmers
+		const char* data = samples[segment.sample].data() + segment.offset;
+
+		for (size_t i = 0; i + kDictionaryDmerSize <= segment.size; ++i)
+			counts[hashDmer(data + i)] = 0;
+
+		segments.push_back(segment);
+		totalSize += segment.size;
+	}
+
+	// LZ4 encodes closer matches slightly more efficiently, so the best segments go to the end of the dictionary
+	std::vector<char> result;
+	result.reserve(totalSize);
+
+	for (size_t i = segments.size(); i > 0; --i)
+	{
+		const DictionarySegment& segment = segments[i - 1];
+		const char* data = samples[segment.sample].data() + segment.offset;
+
+		result.insert(result.end(), data, data + segment.size);
+	}
+
+	// the last selected segment may not fit completely
+	if (result.size() > maxSize)
+		result.erase(result.begin(), result.begin() + (result.size() - maxSize));
+
+	return result;
 }
@@ -3,8 +3,13 @@
 
 #include <memory>
 #include <utility>
+#include <vector>
 
-std::pair<std::unique_ptr<char[]>, size_t> compress(const void* data, size_t dataSize, int level);
+std::pair<std::unique_ptr<char[]>, size_t> compress(const void* data, size_t dataSize, int level, const void* dictionary = nullptr, size_t dictionarySize = 0);
 
-void decompress(void* dest, size_t destSize, const void* source, size_t sourceSize);
-void decompressPartial(void* dest, size_t destSize, const void* source, size_t sourceSize, size_t targetSize);
+void decompress(void* dest, size_t destSize, const void* source, size_t sourceSize, const void* dictionary = nullptr, size_t dictionarySize = 0);
+// Decompresses at least targetSize bytes; source can be truncated (see getCompressedPrefixBound), returns false if it's too short
+bool decompressPartial(void* dest, size_t destSize, const void* source, size_t sourceSize, size_t targetSize, const void* dictionary = nullptr, size_t dictionarySize = 0);
+size_t getCompressedPrefixBound(size_t targetSize);
+
+std::vector<char> trainDictionary(const std::vector<std::vector<char>>& samples, size_t maxSize);
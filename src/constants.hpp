@@ -7,29 +7,79 @@
 // Approximate uncompressed total size of the chunk
 const size_t kChunkSize = 512 Kb;
 
+// Chunk boundaries are content-defined; chunks are split at file boundaries within these size bounds
+const size_t kChunkMinSize = 128 Kb;
+const size_t kChunkMaxSize = 1 Mb;
+
 // Total amount of chunk data in flight
 const size_t kMaxQueuedChunkData = 256 Mb;
 
+// Total amount of file data read ahead while building
+const size_t kMaxQueuedFileData = 64 Mb;
+
+// Number of threads used to scan project folders; scanning is mostly bound by file system latency so this doesn't depend on the core count
+const unsigned int kScanWorkerCount = 8;
+
 // Total amount of buffered output in flight
 const size_t kMaxBufferedOutput = 32 Mb;
 
 // Flush buffered output from the current chunk after reaching this threshold, if possible
 const size_t kBufferedOutputFlushThreshold = 32 Kb;
 
-// File list compression level, 0-9
-const int kFileListCompressionLevel = 1;
-
-// File data compression level, 0-9
+// File data compression level; negative levels use fast LZ4 with acceleration, 0 is fast LZ4, 1-12 are LZ4 HC levels
 const int kFileDataCompressionLevel = 3;
 
+// File data compression level for fast builds
+const int kFastDataCompressionLevel = -4;
+
+// File data compression level used by compaction; this is the maximum LZ4 HC level
+const int kCompactDataCompressionLevel = 12;
+
+// Alignment of uncompressed chunk data in the data file; should be a multiple of page size
+const size_t kUncompressedChunkAlignment = 4 Kb;
+
+// Default target false positive rate of chunk index (bloom filter)
+const double kIndexFalsePositiveRate = 0.02;
+
+// Maximum size of chunk compression dictionary; LZ4 can't reference data further than 64 Kb away
+const size_t kDictionarySize = 64 Kb;
+
+// Amount of data read from the beginning of each sampled file for dictionary training
+const size_t kDictionarySampleFileSize = 4 Kb;
+
+// Total amount of data sampled for dictionary training
+const size_t kDictionarySampleSize = 4 Mb;
+
+// Files smaller than this are never deduplicated since the reference is not much smaller than the contents
+const size_t kDuplicateMinFileSize = 256;
+
+// Total size of original file contents kept in memory while building so that duplicates don't need to be read again
+const size_t kDuplicateMaxCachedSize = 64 Mb;
+
+// Fold delta segment into the base data file once the delta contents exceed this fraction of the base contents
+const double kDeltaMaxRatio = 0.1;
+
 // Wait for several seconds before writing changes to amortize writes when many changes are done at once
 const int kWatchWriteDeadline = 1;
 
-// Wait for many seconds before launching an update to minimize the chance of concurrent work
-const int kWatchUpdateTimeout = 60;
+// Wait for changes to settle before launching an update; the update runs in the background and searches still see the changes while it runs
+const int kWatchUpdateTimeout = 5;
 
 // When we're above a certain threshold of changed files, automatically update
 const int kWatchUpdateThresholdFiles = 100;
 
+// Also update when the changed files are spread over this fraction of the chunks, so that scattered edits in small projects become searchable from the database quickly
+const double kWatchUpdateThresholdChunks = 0.05;
+
+// Interactive mode keeps the contents of changed files in memory up to this size
+const size_t kOverlayMaxSize = 64 Mb;
+
+// Polling watcher checks directories that changed recently after a second, and backs off up to a minute for directories that don't change
+const int kWatchPollMinInterval = 1;
+const int kWatchPollMaxInterval = 60;
+
+// Polling watcher lists at most this many directories per second to limit the load on network file systems
+const int kWatchPollRate = 1000;
+
 #undef Mb
 #undef Kb
\ No newline at end of file
@@ -7,9 +7,7 @@
 #include "fileutil.hpp"
 #include "filestream.hpp"
 #include "format.hpp"
-#include "compression.hpp"
 #include "filter.hpp"
-#include "constants.hpp"
 
 #include <memory>
 
@@ -41,9 +39,25 @@ static size_t getStringBufferSize(const std::vector<const char*>& strings)
 	return result;
 }
 
-typedef std::pair<unsigned int, unsigned int> BufferOffsetLength;
+static void appendStrings(std::vector<char>& data, FileFileEntry* entries, const std::vector<const char*>& strings, size_t bufferOffset)
+{
+	size_t offset = bufferOffset;
+
+	for (size_t i = 0; i < strings.size(); ++i)
+	{
+		size_t length = strlen(strings[i]);
+
+		std::copy(strings[i], strings[i] + length, data.begin() + offset);
+		data[offset + length] = '\n';
+
+		entries[i].offset = offset - bufferOffset;
+		entries[i].length = length;
+
+		offset += length + 1;
+	}
+}
 
-static std::pair<std::vector<char>, std::pair<BufferOffsetLength, BufferOffsetLength>> prepareFileData(const std::vector<FileInfo>& files)
+static std::vector<char> prepareFileData(const std::vector<FileInfo>& files)
 {
 	size_t count = files.size();
 
@@ -54,38 +68,31 @@ static std::pair<std::vector<char>, std::pair<BufferOffsetLength, BufferOffsetLe
 	std::vector<const char*> names = getFileNames(paths.data(), count);
 
 	size_t entrySize = sizeof(FileFileEntry) * count;
-	size_t nameSize = getStringBufferSize(names);
 	size_t pathSize = getStringBufferSize(paths);
-	size_t totalSize = entrySize + nameSize + pathSize;
+	size_t nameSize = getStringBufferSize(names);
 
-	std::vector<char> data(totalSize);
+	FileFileHeader header;
+	memcpy(header.magic, kFileFileHeaderMagic, sizeof(header.magic));
 
-	size_t nameOffset = entrySize;
-	size_t pathOffset = entrySize + nameSize;
-	
-	for (unsigned int i = 0; i < count; ++i)
-	{
-		size_t nameLength = strlen(names[i]);
-		size_t pathLength = strlen(paths[i]);
+	header.fileCount = count;
 
-		std::copy(names[i], names[i] + nameLength, data.begin() + nameOffset);
-		data[nameOffset + nameLength] = '\n';
+	header.pathEntryOffset = sizeof(header);
+	header.nameEntryOffset = header.pathEntryOffset + entrySize;
 
-		std::copy(paths[i], paths[i] + pathLength, data.begin() + pathOffset);
-		data[pathOffset + pathLength] = '\n';
+	header.pathBufferOffset = header.nameEntryOffset + entrySize;
+	header.pathBufferLength = pathSize;
 
-		FileFileEntry& e = reinterpret_cast<FileFileEntry*>(&data[0])[i];
+	header.nameBufferOffset = header.pathBufferOffset + pathSize;
+	header.nameBufferLength = nameSize;
 
-		e.nameOffset = nameOffset;
-		e.pathOffset = pathOffset;
+	std::vector<char> data(sizeof(header) + entrySize * 2 + pathSize + nameSize);
 
-		nameOffset += nameLength + 1;
-		pathOffset += pathLength + 1;
-	}
+	memcpy(&data[0], &header, sizeof(header));
 
-	assert(nameOffset == entrySize + nameSize && pathOffset == totalSize);
+	appendStrings(data, reinterpret_cast<FileFileEntry*>(&data[header.pathEntryOffset]), paths, header.pathBufferOffset);
+	appendStrings(data, reinterpret_cast<FileFileEntry*>(&data[header.nameEntryOffset]), names, header.nameBufferOffset);
 
-	return std::make_pair(data, std::make_pair(BufferOffsetLength(entrySize, nameSize), BufferOffsetLength(entrySize + nameSize, pathSize)));
+	return data;
 }
 
 bool buildFiles(Output* output, const char* path, const std::vector<FileInfo>& files)
@@ -103,23 +110,16 @@ bool buildFiles(Output* output, const char* path, const std::vector<FileInfo>& f
 			return false;
 		}
 
-		std::pair<std::vector<char>, std::pair<BufferOffsetLength, BufferOffsetLength>> data = prepareFileData(files);
-		std::pair<std::unique_ptr<char[]>, size_t> compressed = compress(data.first.data(), data.first.size(), kFileListCompressionLevel);
-
-		FileFileHeader header;
-		memcpy(header.magic, kFileFileHeaderMagic, sizeof(header.magic));
+		std::vector<char> data = prepareFileData(files);
 
-		header.fileCount = files.size();
-		header.compressedSize = compressed.second;
-		header.uncompressedSize = data.first.size();
-
-		header.nameBufferOffset = data.second.first.first;
-		header.nameBufferLength = data.second.first.second;
-		header.pathBufferOffset = data.second.second.first;
-		header.pathBufferLength = data.second.second.second;
+		// offsets in the file list are 32-bit
+		if (data.size() > UINT32_MAX)
+		{
+			output->error("Error saving data file %s: file list is too large\n", tempPath.c_str());
+			return false;
+		}
 
-		out.write(&header, sizeof(header));
-		if (compressed.first) out.write(compressed.first.get(), compressed.second);
+		out.write(data.data(), data.size());
 	}
 
 	if (!renameFile(tempPath.c_str(), targetPath.c_str()))
@@ -131,66 +131,59 @@ bool buildFiles(Output* output, const char* path, const std::vector<FileInfo>& f
 	return true;
 }
 
-template <typename ExtractOffset>
-static void buildFilterEntries(FilterEntries& result, std::unique_ptr<FilterEntry[]>& entryptr,
-    const FileFileHeader& header, const char* data, unsigned int bufferOffset, unsigned int bufferLength, ExtractOffset extractOffset)
+static bool getFilterEntries(FilterEntries& result, const char* data, size_t size, uint32_t fileCount, uint32_t entryOffset, uint32_t bufferOffset, uint32_t bufferLength)
 {
-    const FileFileEntry* entries = reinterpret_cast<const FileFileEntry*>(data);
-
-    entryptr.reset(new FilterEntry[header.fileCount]);
+	if (entryOffset % alignof(FileFileEntry) != 0 || entryOffset > size || (size - entryOffset) / sizeof(FileFileEntry) < fileCount || bufferOffset > size || bufferLength > size - bufferOffset)
+		return false;
 
-    result.buffer = data + bufferOffset;
-    result.bufferSize = bufferLength;
+	const FileFileEntry* entries = reinterpret_cast<const FileFileEntry*>(data + entryOffset);
 
-    result.entries = entryptr.get();
-    result.entryCount = header.fileCount;
+	// the filter reads names without bounds checks, so every entry has to be inside the buffer
+	for (uint32_t i = 0; i < fileCount; ++i)
+		if (entries[i].offset > bufferLength || entries[i].length > bufferLength - entries[i].offset)
+			return false;
 
-    for (size_t i = 0; i < header.fileCount; ++i)
-    {
-        FilterEntry& e = result.entries[i];
+	// entries are stored in the same layout that the filter uses, so the mapped data is used directly
+	result.buffer = data + bufferOffset;
+	result.bufferSize = bufferLength;
 
-        size_t offset = extractOffset(entries[i]);
+	result.entries = reinterpret_cast<const FilterEntry*>(data + entryOffset);
+	result.entryCount = fileCount;
 
-        e.offset = offset - bufferOffset;
-        e.length = (i + 1 < header.fileCount ? extractOffset(entries[i + 1]) : bufferOffset + bufferLength) - offset - 1;
-    }
+	return true;
 }
 
 unsigned int searchFiles(Output* output, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude)
 {
+	static_assert(sizeof(FilterEntry) == sizeof(FileFileEntry) && offsetof(FilterEntry, offset) == offsetof(FileFileEntry, offset) && offsetof(FilterEntry, length) == offsetof(FileFileEntry, length),
+		"File list entries must match filter entries");
+
 	std::string dataPath = replaceExtension(file, ".qgf");
-	FileStream in(dataPath.c_str(), "rb");
-	if (!in)
+	FileMapping mapping(dataPath.c_str());
+	if (!mapping)
 	{
 		output->error("Error reading data file %s\n", dataPath.c_str());
 		return 0;
 	}
-	
-	FileFileHeader header;
-	if (!read(in, header) || memcmp(header.magic, kFileFileHeaderMagic, strlen(kFileFileHeaderMagic)) != 0)
+
+	FileFileHeader header = {};
+	if (mapping.size() >= sizeof(header))
+		memcpy(&header, mapping.data(), sizeof(header));
+
+	if (memcmp(header.magic, kFileFileHeaderMagic, strlen(kFileFileHeaderMagic)) != 0)
 	{
-		output->error("Error reading data file %s: malformed header\n", dataPath.c_str());
+		output->error("Error reading data file %s: file format is out of date, update the project to fix\n", dataPath.c_str());
 		return 0;
 	}
 
-	std::unique_ptr<char[]> buffer(new (std::nothrow) char[header.compressedSize + header.uncompressedSize]);
+	FilterEntries paths, names;
 
-	if (!buffer || !read(in, buffer.get(), header.compressedSize))
+	if (!getFilterEntries(paths, mapping.data(), mapping.size(), header.fileCount, header.pathEntryOffset, header.pathBufferOffset, header.pathBufferLength) ||
+		!getFilterEntries(names, mapping.data(), mapping.size(), header.fileCount, header.nameEntryOffset, header.nameBufferOffset, header.nameBufferLength))
 	{
-		output->error("Error reading data file %s: malformed header\n", dataPath.c_str());
+		output->error("Error reading data file %s: file list is corrupted, update the project to fix\n", dataPath.c_str());
 		return 0;
 	}
 
-	char* data = buffer.get() + header.compressedSize;
-	decompress(data, header.uncompressedSize, buffer.get(), header.compressedSize);
-
-    FilterEntries paths;
-    std::unique_ptr<FilterEntry[]> pathEntries;
-    buildFilterEntries(paths, pathEntries, header, data, header.pathBufferOffset, header.pathBufferLength, [](const FileFileEntry& e) { return e.pathOffset; });
-
-    FilterEntries names;
-    std::unique_ptr<FilterEntry[]> nameEntries;
-    buildFilterEntries(names, nameEntries, header, data, header.nameBufferOffset, header.nameBufferLength, [](const FileFileEntry& e) { return e.nameOffset; });
-
-    return filter(output, string, options, limit, paths, &names);
+	return filter(output, string, options, limit, paths, &names);
 }
@@ -4,10 +4,17 @@
 
 #include "fileutil.hpp"
 
+#include <algorithm>
+
 #include <stdio.h>
 
+#ifdef __linux__
+#   include <unistd.h>
+#endif
+
 #ifdef _WIN32
 #   define fseeko _fseeki64
+#   define ftello _ftelli64
 #endif
 
 FileStream::FileStream(): file(0)
@@ -41,6 +48,16 @@ void FileStream::skip(size_t offset)
     fseeko(static_cast<FILE*>(file), offset, SEEK_CUR);
 }
 
+void FileStream::seek(uint64_t offset)
+{
+    fseeko(static_cast<FILE*>(file), offset, SEEK_SET);
+}
+
+uint64_t FileStream::tell() const
+{
+    return ftello(static_cast<FILE*>(file));
+}
+
 size_t FileStream::read(void* data, size_t size)
 {
     return fread(data, 1, size, static_cast<FILE*>(file));
@@ -50,3 +67,100 @@ size_t FileStream::write(const void* data, size_t size)
 {
     return fwrite(data, 1, size, static_cast<FILE*>(file));
 }
+
+size_t FileStream::copy(FileStream& source, uint64_t offset, size_t size)
+{
+    FILE* out = static_cast<FILE*>(file);
+    FILE* in = static_cast<FILE*>(source.file);
+
+    size_t result = 0;
+
+#ifdef __linux__
+    // copy the data without reading it into user space; filesystems with reflink support can share the blocks between files
+    fflush(out);
+
+    loff_t inOffset = offset;
+    loff_t outOffset = ftello(out);
+
+    while (result < size)
+    {
+        ssize_t copied = copy_file_range(fileno(in), &inOffset, fileno(out), &outOffset, size - result, 0);
+        if (copied <= 0) break;
+
+        result += copied;
+    }
+
+    fseeko(out, outOffset, SEEK_SET);
+#endif
+
+    // fall back to buffered copy if the data could not be copied by the kernel, e.g. across file systems
+    if (result < size)
+    {
+        char buffer[65536];
+
+        fseeko(in, offset + result, SEEK_SET);
+
+        while (result < size)
+        {
+            size_t count = fread(buffer, 1, std::min(sizeof(buffer), size - result), in);
+            if (count == 0 || fwrite(buffer, 1, count, out) != count) break;
+
+            result += count;
+        }
+    }
+
+    return result;
+}
+
+FileMapping::FileMapping(const char* path): mappedData(0), mappedSize(0)
+{
+    mappedData = mapFile(path, &mappedSize);
+}
+
+FileMapping::FileMapping(const FileStream& stream): mappedData(0), mappedSize(0)
+{
+    if (stream.file) mappedData = mapFile(static_cast<FILE*>(stream.file), &mappedSize);
+}
+
+FileMapping::~FileMapping()
+{
+    if (mappedData) unmapFile(mappedData, mappedSize);
+}
+
+FileMapping::operator bool() const
+{
+    return mappedData != nullptr;
+}
+
+const char* FileMapping::data() const
+{
+    return static_cast<const char*>(mappedData);
+}
+
+size_t FileMapping::size() const
+{
+    return mappedSize;
+}
+
+FileLock::FileLock(const char* path): file(0)
+{
+    FILE* lockFile = openFile(path, "ab");
+
+    if (lockFile && !::lockFile(lockFile))
+    {
+        fclose(lockFile);
+        lockFile = 0;
+    }
+
+    file = lockFile;
+}
+
+FileLock::~FileLock()
+{
+    if (file) fclose(static_cast<FILE*>(file));
+}
+
+FileLock::operator bool() const
+{
+    return file != 0;
+}
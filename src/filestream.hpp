@@ -15,8 +15,44 @@ public:
 	operator bool() const;
 
 	void skip(size_t offset);
+	void seek(uint64_t offset);
+	uint64_t tell() const;
 	size_t read(void* data, size_t size);
 	size_t write(const void* data, size_t size);
+	size_t copy(FileStream& source, uint64_t offset, size_t size);
+
+private:
+	friend class FileMapping;
+
+	void* file;
+};
+
+class FileMapping
+{
+public:
+	FileMapping(const char* path);
+	// maps the file that the stream has open, even if the path was replaced since
+	FileMapping(const FileStream& stream);
+	~FileMapping();
+
+	operator bool() const;
+
+	const char* data() const;
+	size_t size() const;
+
+private:
+	const void* mappedData;
+	size_t mappedSize;
+};
+
+// holds an exclusive lock on the file for the lifetime of the object, waiting for other processes to release it first
+class FileLock
+{
+public:
+	FileLock(const char* path);
+	~FileLock();
+
+	operator bool() const;
 
 private:
 	void* file;
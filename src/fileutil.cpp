@@ -4,6 +4,13 @@
 
 #include <string.h>
 
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
 static bool isSeparator(char ch)
 {
 	return ch == '/' || ch == '\\';
@@ -68,6 +75,215 @@ bool passthroughDirectoryFilter(const char* name)
 	return true;
 }
 
+static bool traverseDirectoryRec(const char* path, const char* relpath, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
+{
+	std::string buf, relbuf;
+	std::vector<std::string> directories;
+
+	bool result = enumerateDirectory(path, [&](const char* name, uint64_t mtime, uint64_t size) {
+		joinPaths(relbuf, relpath, name);
+		callback(relbuf.c_str(), mtime, size);
+	}, [&](const char* name) {
+		joinPaths(relbuf, relpath, name);
+
+		if (directoryFilter(relbuf.c_str()))
+			directories.push_back(name);
+	});
+
+	// enumerateDirectory doesn't support recursive calls from callbacks
+	for (auto& name: directories)
+	{
+		joinPaths(relbuf, relpath, name.c_str());
+		joinPaths(buf, path, name.c_str());
+
+		traverseDirectoryRec(buf.c_str(), relbuf.c_str(), callback, directoryFilter);
+	}
+
+	return result;
+}
+
+bool traverseDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
+{
+	return traverseDirectoryRec(path, "", callback, directoryFilter);
+}
+
+struct TraverseTask
+{
+	std::string path;
+	std::string relpath;
+};
+
+struct TraverseQueue
+{
+	std::mutex mutex;
+	std::deque<TraverseTask> tasks;
+};
+
+struct TraverseContext
+{
+	std::unique_ptr<TraverseQueue[]> queues;
+	unsigned int workerCount;
+
+	// number of directories that are queued or being enumerated; generation changes every time new directories are queued
+	std::mutex mutex;
+	std::condition_variable changed;
+	size_t pending;
+	uint64_t generation;
+
+	const std::function<void (unsigned int worker, const char* name, uint64_t mtime, uint64_t size)>* callback;
+	const std::function<bool (const char* name)>* directoryFilter;
+	const EnumerateDirectoryFunction* enumerate;
+};
+
+static bool popTraverseTask(TraverseContext& context, unsigned int worker, TraverseTask& task)
+{
+	// process our own directories depth-first to keep the queues short
+	{
+		TraverseQueue& queue = context.queues[worker];
+		std::unique_lock<std::mutex> lock(queue.mutex);
+
+		if (!queue.tasks.empty())
+		{
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+			return true;
+		}
+	}
+
+	// steal the oldest directory from other workers; it's likely to have the largest subtree
+	for (unsigned int i = 1; i < context.workerCount; ++i)
+	{
+		TraverseQueue& queue = context.queues[(worker + i) % context.workerCount];
+		std::unique_lock<std::mutex> lock(queue.mutex);
+
+		if (!queue.tasks.empty())
+		{
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool enumerateTraverseTask(TraverseContext& context, unsigned int worker, const TraverseTask& task, std::vector<TraverseTask>& children)
+{
+	std::string buf;
+
+	return (*context.enumerate)(task.path.c_str(), [&](const char* name, uint64_t mtime, uint64_t size) {
+		joinPaths(buf, task.relpath.c_str(), name);
+		(*context.callback)(worker, buf.c_str(), mtime, size);
+	}, [&](const char* name) {
+		joinPaths(buf, task.relpath.c_str(), name);
+
+		if ((*context.directoryFilter)(buf.c_str()))
+		{
+			TraverseTask child;
+			child.relpath = buf;
+			joinPaths(child.path, task.path.c_str(), name);
+
+			children.push_back(std::move(child));
+		}
+	});
+}
+
+static void pushTraverseTasks(TraverseContext& context, unsigned int worker, std::vector<TraverseTask>& children)
+{
+	bool wake;
+
+	{
+		std::unique_lock<std::mutex> lock(context.mutex);
+
+		{
+			TraverseQueue& queue = context.queues[worker];
+			std::unique_lock<std::mutex> qlock(queue.mutex);
+
+			for (auto& child: children)
+				queue.tasks.push_back(std::move(child));
+		}
+
+		// the directory that produced the children is complete
+		context.pending += children.size();
+		context.pending -= 1;
+		context.generation++;
+
+		wake = !children.empty() || context.pending == 0;
+	}
+
+	if (wake)
+		context.changed.notify_all();
+
+	children.clear();
+}
+
+static void traverseWorkerThread(TraverseContext& context, unsigned int worker)
+{
+	std::vector<TraverseTask> children;
+
+	for (;;)
+	{
+		uint64_t generation;
+
+		{
+			std::unique_lock<std::mutex> lock(context.mutex);
+
+			if (context.pending == 0)
+				break;
+
+			generation = context.generation;
+		}
+
+		TraverseTask task;
+
+		if (popTraverseTask(context, worker, task))
+		{
+			enumerateTraverseTask(context, worker, task, children);
+			pushTraverseTasks(context, worker, children);
+		}
+		else
+		{
+			// all queues were empty; wait until somebody queues more directories or the traversal is complete
+			std::unique_lock<std::mutex> lock(context.mutex);
+
+			context.changed.wait(lock, [&] { return context.generation != generation || context.pending == 0; });
+		}
+	}
+}
+
+bool traverseDirectoryParallel(const char* path, unsigned int workerCount, const std::function<void (unsigned int worker, const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter, const EnumerateDirectoryFunction& enumerate)
+{
+	TraverseContext context;
+	context.queues.reset(new TraverseQueue[workerCount]);
+	context.workerCount = workerCount;
+	context.pending = 1;
+	context.generation = 0;
+	context.callback = &callback;
+	context.directoryFilter = &directoryFilter;
+	context.enumerate = &enumerate;
+
+	// enumerate the root on the calling thread so that we can report errors
+	TraverseTask root = { path, "" };
+	std::vector<TraverseTask> children;
+
+	if (!enumerateTraverseTask(context, 0, root, children))
+		return false;
+
+	pushTraverseTasks(context, 0, children);
+
+	std::vector<std::thread> workers;
+
+	for (unsigned int i = 1; i < workerCount; ++i)
+		workers.emplace_back(traverseWorkerThread, std::ref(context), i);
+
+	traverseWorkerThread(context, 0);
+
+	for (auto& worker: workers)
+		worker.join();
+
+	return true;
+}
+
 void joinPaths(std::string& buf, const char* lhs, const char* rhs)
 {
 	buf = lhs;
@@ -6,7 +6,14 @@
 
 #include <stdio.h>
 
+// Lists files (with high resolution modification time and size) and subdirectories of a single directory; callbacks must not call enumerateDirectory
+bool enumerateDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback);
 bool traverseDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter);
+
+typedef std::function<bool (const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback)> EnumerateDirectoryFunction;
+
+bool traverseDirectoryParallel(const char* path, unsigned int workerCount, const std::function<void (unsigned int worker, const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter, const EnumerateDirectoryFunction& enumerate = enumerateDirectory);
+
 bool traverseFileNeeded(const char* name);
 bool passthroughDirectoryFilter(const char* name);
 
@@ -25,6 +32,23 @@ std::string normalizePath(const char* base, const char* path);
 
 bool getFileAttributes(const char* path, uint64_t* mtime, uint64_t* size);
 
+// Returns the time that was the given number of seconds ago, in the same units as file modification times
+uint64_t getCurrentTimeStamp(unsigned int secondsAgo);
+
 FILE* openFile(const char* path, const char* mode);
 
-bool watchDirectory(const char* path, const std::function<void (const char* name)>& callback);
+// Waits for an exclusive advisory lock on the open file; the lock is released when the file is closed
+bool lockFile(FILE* file);
+
+const void* mapFile(const char* path, size_t* size);
+const void* mapFile(FILE* file, size_t* size);
+void unmapFile(const void* data, size_t size);
+
+void setBackgroundPriority();
+
+// Lowers CPU and I/O priority of the calling thread only, so that background work doesn't slow down the rest of the process
+void setBackgroundThreadPriority();
+
+// Starts watching the folder in the background; the callback is called with paths of changed files relative to the folder from a watcher thread
+// Directories rejected by the filter aren't watched where watches are per directory; recursive watchers report their files anyway
+bool watchDirectory(const char* path, const std::function<void (const char* name)>& callback, const std::function<bool (const char* name)>& directoryFilter);
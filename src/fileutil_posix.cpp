@@ -3,33 +3,177 @@
 
 #include "common.hpp"
 #include "fileutil.hpp"
+#include "pollwatch.hpp"
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef __linux__
+#include <sys/epoll.h>
 #include <sys/inotify.h>
+#include <sys/syscall.h>
 #endif
 
 #ifdef __APPLE__
 #include <CoreServices/CoreServices.h>
+#include <pthread.h>
 #endif
 
-static bool traverseDirectoryRec(const char* path, const char* relpath, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
+static uint64_t getTimeStamp(const struct stat& st)
 {
-	int fd = open(path, O_DIRECTORY);
+#ifdef __APPLE__
+	return uint64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+	return uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+}
+
+#if defined(__linux__) && defined(SYS_getdents64)
+// Large enough to list most directories with a single syscall
+const size_t kDirectoryBufferSize = 256 * 1024;
+
+struct LinuxDirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+
+static bool getEntryAttributes(int fd, const char* name, int* type, uint64_t* mtime, uint64_t* size)
+{
+#ifdef STATX_TYPE
+	struct statx stx;
+
+	// only request the fields we need; AT_STATX_DONT_SYNC avoids server round trips on network file systems
+	if (statx(fd, name, AT_STATX_DONT_SYNC, STATX_TYPE | STATX_MTIME | STATX_SIZE, &stx) == 0)
+	{
+		*type = IFTODT(stx.stx_mode);
+		*mtime = uint64_t(stx.stx_mtime.tv_sec) * 1000000000 + stx.stx_mtime.tv_nsec;
+		*size = stx.stx_size;
+		return true;
+	}
+
+	// statx is not supported by kernels older than 4.11
+	if (errno != ENOSYS)
+		return false;
+#endif
+
+	struct stat st;
+
+	if (fstatat(fd, name, &st, 0) == 0)
+	{
+		*type = IFTODT(st.st_mode);
+		*mtime = getTimeStamp(st);
+		*size = st.st_size;
+		return true;
+	}
+
+	return false;
+}
+
+bool enumerateDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback)
+{
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd < 0)
+		return false;
+
+	// the buffer is reused for all directories enumerated on this thread; callbacks can't enumerate directories recursively
+	static thread_local std::unique_ptr<char[]> buffer;
+
+	if (!buffer)
+		buffer.reset(new char[kDirectoryBufferSize]);
+
+	for (;;)
+	{
+		long bytes = syscall(SYS_getdents64, fd, buffer.get(), kDirectoryBufferSize);
+
+		if (bytes <= 0)
+			break;
+
+		for (long offset = 0; offset < bytes; )
+		{
+			const LinuxDirent64& data = *reinterpret_cast<const LinuxDirent64*>(buffer.get() + offset);
+
+			offset += data.d_reclen;
+
+			if (!traverseFileNeeded(data.d_name))
+				continue;
+
+			int type = data.d_type;
+			uint64_t mtime = 0, size = 0;
+
+			// we need to stat DT_UNKNOWN to be able to tell the type, and we need to stat files to get mtime/size
+			if (type == DT_UNKNOWN || type == DT_REG)
+			{
+				int sttype = DT_UNKNOWN;
+
+				if (getEntryAttributes(fd, data.d_name, &sttype, &mtime, &size))
+				{
+					assert(type == DT_UNKNOWN || type == sttype);
+					type = sttype;
+				}
+				else
+				{
+					type = DT_UNKNOWN; // skip file entry
+				}
+			}
+
+			if (type == DT_DIR)
+			{
+				directoryCallback(data.d_name);
+			}
+			else if (type == DT_REG)
+			{
+				fileCallback(data.d_name, mtime, size);
+			}
+			else if (type == DT_LNK)
+			{
+				// Skip symbolic links to avoid handling cycles
+			}
+		}
+	}
+
+	close(fd);
+
+	return true;
+}
+#else
+bool enumerateDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback)
+{
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd < 0)
+		return false;
+
 	DIR* dir = fdopendir(fd);
 
 	if (!dir)
+	{
+		close(fd);
 		return false;
+	}
 
-	std::string buf, relbuf;
+	std::string buf;
 
 	while (dirent* entry = readdir(dir))
 	{
@@ -37,9 +181,6 @@ static bool traverseDirectoryRec(const char* path, const char* relpath, const st
 
 		if (traverseFileNeeded(data.d_name))
 		{
-			joinPaths(relbuf, relpath, data.d_name);
-			joinPaths(buf, path, data.d_name);
-
 			struct stat st = {};
 			int type = data.d_type;
 
@@ -49,6 +190,8 @@ static bool traverseDirectoryRec(const char* path, const char* relpath, const st
 			#ifdef _ATFILE_SOURCE
 				int rc = fstatat(fd, data.d_name, &st, 0);
 			#else
+				joinPaths(buf, path, data.d_name);
+
 				int rc = lstat(buf.c_str(), &st);
 			#endif
 
@@ -65,12 +208,11 @@ static bool traverseDirectoryRec(const char* path, const char* relpath, const st
 
 			if (type == DT_DIR)
 			{
-				if (directoryFilter(relbuf.c_str()))
-					traverseDirectoryRec(buf.c_str(), relbuf.c_str(), callback, directoryFilter);
+				directoryCallback(data.d_name);
 			}
 			else if (type == DT_REG)
 			{
-				callback(relbuf.c_str(), st.st_mtime, st.st_size);
+				fileCallback(data.d_name, getTimeStamp(st), st.st_size);
 			}
 			else if (type == DT_LNK)
 			{
@@ -83,11 +225,7 @@ static bool traverseDirectoryRec(const char* path, const char* relpath, const st
 
 	return true;
 }
-
-bool traverseDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool(const char* name)>& directoryFilter)
-{
-	return traverseDirectoryRec(path, "", callback, directoryFilter);
-}
+#endif
 
 bool renameFile(const char* oldpath, const char* newpath)
 {
@@ -105,7 +243,7 @@ bool getFileAttributes(const char* path, uint64_t* mtime, uint64_t* size)
 
 	if (stat(path, &st) == 0)
 	{
-		*mtime = st.st_mtime;
+		*mtime = getTimeStamp(st);
 		*size = st.st_size;
 		return true;
 	}
@@ -113,6 +251,14 @@ bool getFileAttributes(const char* path, uint64_t* mtime, uint64_t* size)
 	return false;
 }
 
+uint64_t getCurrentTimeStamp(unsigned int secondsAgo)
+{
+	struct timespec ts = {};
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t(ts.tv_sec) - secondsAgo) * 1000000000 + ts.tv_nsec;
+}
+
 void createDirectory(const char* path)
 {
 	mkdir(path, 0755);
@@ -139,79 +285,521 @@ FILE* openFile(const char* path, const char* mode)
 	return fopen(path, mode);
 }
 
+bool lockFile(FILE* file)
+{
+	int rc;
+
+	do rc = flock(fileno(file), LOCK_EX);
+	while (rc != 0 && errno == EINTR);
+
+	return rc == 0;
+}
+
+static const void* mapDescriptor(int fd, size_t* size)
+{
+	struct stat st;
+	void* result = nullptr;
+
+	if (fstat(fd, &st) == 0 && st.st_size > 0 && uint64_t(st.st_size) <= SIZE_MAX)
+	{
+		result = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (result == MAP_FAILED)
+			result = nullptr;
+		else
+			*size = st.st_size;
+	}
+
+	return result;
+}
+
+const void* mapFile(const char* path, size_t* size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+
+	const void* result = mapDescriptor(fd, size);
+
+	// the mapping keeps the file referenced so we don't need the descriptor anymore
+	close(fd);
+
+	return result;
+}
+
+const void* mapFile(FILE* file, size_t* size)
+{
+	return mapDescriptor(fileno(file), size);
+}
+
+void unmapFile(const void* data, size_t size)
+{
+	munmap(const_cast<void*>(data), size);
+}
+
+void setBackgroundPriority()
+{
+	setpriority(PRIO_PROCESS, 0, 19);
+
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	// IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE
+	syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+}
+
+void setBackgroundThreadPriority()
+{
+#if defined(__linux__)
+	// Linux applies both priorities to individual threads, so the thread id only affects the calling thread
+	pid_t tid = pid_t(syscall(SYS_gettid));
+
+	setpriority(PRIO_PROCESS, tid, 19);
+
+#ifdef SYS_ioprio_set
+	syscall(SYS_ioprio_set, 1, tid, 3 << 13);
+#endif
+#elif defined(__APPLE__)
+	// lowers both CPU and I/O priority
+	pthread_set_qos_class_self_np(QOS_CLASS_BACKGROUND, 0);
+#endif
+}
+
 #ifdef __linux__
-static void addWatchRec(int fd, const char* path, const char* relpath, std::vector<std::string>& paths)
+
+// Directories that were created or moved need to be watched and their contents reported; changes to files report the file
+const uint32_t kInotifyWatchMask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+// Large enough to decode thousands of events with one read
+const size_t kInotifyBufferSize = 256 * 1024;
+
+// Maximum number of roots serviced after one wait
+const int kInotifyEventCount = 16;
+
+struct InotifyDirectory
 {
-	DIR* dir = opendir(path);
+	std::string relpath;
 
-	if (!dir)
-		return;
+	// files are reported when the directory is moved away or removed, and when they disappear while the events are lost
+	std::unordered_set<std::string> files;
+
+	unsigned int generation;
+};
 
-    int wd = inotify_add_watch(fd, path, IN_CLOSE_WRITE | IN_MOVED_TO);
+// Every root uses its own inotify instance, so a queue overflow only requires rescanning the root that lost the events
+struct InotifyRoot
+{
+	std::string path;
+	std::function<void (const char* name)> callback;
+	std::function<bool (const char* name)> directoryFilter;
 
-    if (wd >= 0)
-    {
-		if (paths.size() <= size_t(wd))
-			paths.resize(wd + 1);
+	int fd;
+	std::unordered_map<int, InotifyDirectory> directories;
 
-		paths[wd] = relpath;
-    }
+	// subtrees that are polled because we ran out of inotify watches
+	std::unordered_set<std::string> polled;
 
-	std::string buf, relbuf;
+	// files modified after this time may have been lost if the event queue overflows
+	uint64_t lastReadTimeStamp;
+
+	// incremented for every rescan to find directories that are no longer there
+	unsigned int generation;
+};
+
+// All roots are serviced by a single thread; roots are only accessed by that thread once they are registered
+struct InotifyWatcher
+{
+	int epoll;
+
+	// protects the root list
+	std::mutex mutex;
+
+	std::vector<std::unique_ptr<InotifyRoot>> roots;
+};
+
+struct InotifyDirectoryChange
+{
+	std::string relpath;
+	bool added;
+};
+
+static bool listDirectoryNames(const char* path, std::vector<std::string>& files, std::vector<std::string>& directories)
+{
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR* dir = fd < 0 ? nullptr : fdopendir(fd);
+
+	if (!dir)
+	{
+		if (fd >= 0) close(fd);
+		return false;
+	}
 
 	while (dirent* entry = readdir(dir))
 	{
 		const dirent& data = *entry;
 
-		if (traverseFileNeeded(data.d_name) && data.d_type == DT_DIR)
+		if (!traverseFileNeeded(data.d_name))
+			continue;
+
+		int type = data.d_type;
+
+		// only entries of unknown type need to be stat'ed, since the file attributes aren't needed
+		if (type == DT_UNKNOWN)
 		{
-			joinPaths(relbuf, relpath, data.d_name);
-			joinPaths(buf, path, data.d_name);
+			struct stat st;
 
-			addWatchRec(fd, buf.c_str(), relbuf.c_str(), paths);
+			if (fstatat(fd, data.d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+				type = IFTODT(st.st_mode);
 		}
-    }
 
-    closedir(dir);
+		if (type == DT_DIR)
+			directories.push_back(data.d_name);
+		else if (type == DT_REG)
+			files.push_back(data.d_name);
+	}
+
+	closedir(dir);
+
+	return true;
 }
 
-static bool watchDirectoryInotify(const char* path, const std::function<void (const char* name)>& callback)
+static bool addWatchRec(InotifyRoot* root, const char* path, const char* relpath, uint64_t reportSince, std::vector<std::string>& changes)
 {
-    int fd = inotify_init();
-    if (fd < 0)
-		return false;
+	if (*relpath && !root->directoryFilter(relpath))
+		return true;
+
+	int wd = inotify_add_watch(root->fd, path, kInotifyWatchMask);
+
+	if (wd < 0)
+	{
+		if (errno != ENOSPC)
+			return false;
+
+		// fs.inotify.max_user_watches is exhausted; poll the rest of the subtree instead of silently missing changes
+		if (root->polled.insert(relpath).second)
+		{
+			std::string prefix = relpath;
+			std::function<void (const char* name)> callback = root->callback;
+			std::function<bool (const char* name)> directoryFilter = root->directoryFilter;
+
+			return watchDirectoryPolling(path, [=](const char* name) {
+				std::string buf;
+				joinPaths(buf, prefix.c_str(), name);
+				callback(buf.c_str());
+			}, [=](const char* name) {
+				std::string buf;
+				joinPaths(buf, prefix.c_str(), name);
+				return directoryFilter(buf.c_str());
+			}, reportSince);
+		}
+
+		return true;
+	}
 
-	std::vector<std::string> paths;
-    addWatchRec(fd, path, "", paths);
+	InotifyDirectory& dir = root->directories[wd];
+
+	// the same directory can be reachable twice through bind mounts
+	if (dir.generation == root->generation && dir.relpath != relpath)
+		return true;
 
 	std::string relbuf;
 
-    for (;;)
-    {
-        alignas(inotify_event) char buf[4096];
-        ssize_t bufsize = read(fd, buf, sizeof(buf));
+	// the directory was moved while the events were lost, so the files at the old location are gone
+	if (dir.relpath != relpath)
+	{
+		for (auto& name: dir.files)
+		{
+			joinPaths(relbuf, dir.relpath.c_str(), name.c_str());
+			changes.push_back(relbuf);
+		}
 
-        if (bufsize <= 0)
-            break;
+		dir.files.clear();
+		dir.relpath = relpath;
+	}
 
-        size_t offset = 0;
-        inotify_event* e = reinterpret_cast<inotify_event*>(buf);
+	dir.generation = root->generation;
 
-        while (offset + sizeof(inotify_event) + e->len <= size_t(bufsize))
-        {
-            if (traverseFileNeeded(e->name) && (e->mask & IN_ISDIR) == 0 && size_t(e->wd) < paths.size())
-            {
-				joinPaths(relbuf, paths[e->wd].c_str(), e->name);
+	std::unordered_set<std::string> files;
+	std::vector<std::string> directories;
 
-				callback(relbuf.c_str());
-            }
+	// initial registration only needs the names; otherwise files are reported if they could have been changed without us noticing
+	if (reportSince == ~0ull)
+	{
+		std::vector<std::string> names;
 
-            offset += sizeof(inotify_event) + e->len;
-            e = reinterpret_cast<inotify_event*>(buf + offset);
-        }
-    }
+		listDirectoryNames(path, names, directories);
+
+		files.insert(names.begin(), names.end());
+	}
+	else
+	{
+		enumerateDirectory(path, [&](const char* name, uint64_t mtime, uint64_t size) {
+			if (mtime >= reportSince || dir.files.count(name) == 0)
+			{
+				joinPaths(relbuf, relpath, name);
+				changes.push_back(relbuf);
+			}
+
+			files.insert(name);
+		}, [&](const char* name) {
+			directories.push_back(name);
+		});
+
+		for (auto& name: dir.files)
+			if (files.count(name) == 0)
+			{
+				joinPaths(relbuf, relpath, name.c_str());
+				changes.push_back(relbuf);
+			}
+	}
 
-    close(fd);
+	dir.files = std::move(files);
+
+	std::string buf;
+
+	for (auto& name: directories)
+	{
+		joinPaths(buf, path, name.c_str());
+		joinPaths(relbuf, relpath, name.c_str());
+
+		addWatchRec(root, buf.c_str(), relbuf.c_str(), reportSince, changes);
+	}
+
+	return true;
+}
+
+static void removeWatch(InotifyRoot* root, std::unordered_map<int, InotifyDirectory>::iterator it, std::vector<std::string>& changes)
+{
+	std::string relbuf;
+
+	for (auto& name: it->second.files)
+	{
+		joinPaths(relbuf, it->second.relpath.c_str(), name.c_str());
+		changes.push_back(relbuf);
+	}
+
+	inotify_rm_watch(root->fd, it->first);
+	root->directories.erase(it);
+}
+
+static void removeWatchRec(InotifyRoot* root, const std::string& relpath, std::vector<std::string>& changes)
+{
+	// directories that are moved away keep their watches; drop the ones for the old location since the new location is registered separately
+	for (auto it = root->directories.begin(); it != root->directories.end(); )
+	{
+		const std::string& path = it->second.relpath;
+
+		if (path.compare(0, relpath.size(), relpath) == 0 && (path.size() == relpath.size() || path[relpath.size()] == '/'))
+			removeWatch(root, it++, changes);
+		else
+			++it;
+	}
+}
+
+static void rescanRoot(InotifyRoot* root, std::vector<std::string>& changes)
+{
+	root->generation++;
+
+	addWatchRec(root, root->path.c_str(), "", root->lastReadTimeStamp, changes);
+
+	// directories that weren't reached were removed or moved away while the events were lost
+	for (auto it = root->directories.begin(); it != root->directories.end(); )
+	{
+		if (it->second.generation != root->generation)
+			removeWatch(root, it++, changes);
+		else
+			++it;
+	}
+}
+
+static void processInotifyEvents(InotifyRoot* root, const char* buf, size_t size, std::vector<std::string>& changes, bool& overflow)
+{
+	// directories are processed after decoding the batch, in order, since a directory can be moved away and another one moved in its place
+	std::vector<InotifyDirectoryChange> directories;
+
+	std::string relbuf;
+
+	for (size_t offset = 0; offset + sizeof(inotify_event) <= size; )
+	{
+		const inotify_event* e = reinterpret_cast<const inotify_event*>(buf + offset);
+
+		offset += sizeof(inotify_event) + e->len;
+
+		if (e->mask & IN_Q_OVERFLOW)
+		{
+			overflow = true;
+			continue;
+		}
+
+		auto it = root->directories.find(e->wd);
+
+		if (it == root->directories.end())
+			continue;
+
+		InotifyDirectory& dir = it->second;
+
+		// the directory was removed or is no longer accessible
+		if (e->mask & IN_IGNORED)
+		{
+			for (auto& name: dir.files)
+			{
+				joinPaths(relbuf, dir.relpath.c_str(), name.c_str());
+				changes.push_back(relbuf);
+			}
+
+			root->directories.erase(it);
+			continue;
+		}
+
+		if (e->len == 0 || !traverseFileNeeded(e->name))
+			continue;
+
+		joinPaths(relbuf, dir.relpath.c_str(), e->name);
+
+		if ((e->mask & IN_ISDIR) == 0)
+		{
+			if (e->mask & (IN_DELETE | IN_MOVED_FROM))
+				dir.files.erase(e->name);
+			else
+				dir.files.insert(e->name);
+
+			// new files are reported when they are closed after writing
+			if ((e->mask & IN_CREATE) == 0)
+				changes.push_back(relbuf);
+		}
+		else if (e->mask & (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM))
+			directories.push_back({ relbuf, (e->mask & IN_MOVED_FROM) == 0 });
+	}
+
+	std::string path;
+
+	// new directories are watched and their contents are reported, since files could have been added before the watch was set up
+	for (auto& d: directories)
+	{
+		if (d.added)
+		{
+			joinPaths(path, root->path.c_str(), d.relpath.c_str());
+
+			addWatchRec(root, path.c_str(), d.relpath.c_str(), 0, changes);
+		}
+		else
+			removeWatchRec(root, d.relpath, changes);
+	}
+}
+
+static void processInotifyRoot(InotifyRoot* root, char* buf, std::vector<std::string>& changes)
+{
+	uint64_t readTimeStamp = getCurrentTimeStamp(1);
+	bool overflow = false;
+
+	// drain the queue; events are decoded in batches and duplicate changes are merged before reporting them
+	for (;;)
+	{
+		ssize_t size = read(root->fd, buf, kInotifyBufferSize);
+
+		if (size <= 0)
+			break;
+
+		processInotifyEvents(root, buf, size, changes, overflow);
+	}
+
+	// we lost some events, so we need to rescan the root to find new directories and files that changed since the last time we read the queue
+	if (overflow)
+		rescanRoot(root, changes);
+
+	root->lastReadTimeStamp = readTimeStamp;
+}
+
+static void watchInotify(InotifyWatcher* watcher)
+{
+	std::unique_ptr<char[]> buf(new char[kInotifyBufferSize]);
+	std::vector<std::string> changes;
+
+	for (;;)
+	{
+		epoll_event events[kInotifyEventCount];
+		int count = epoll_wait(watcher->epoll, events, kInotifyEventCount, -1);
+
+		if (count < 0 && errno != EINTR)
+			break;
+
+		for (int i = 0; i < count; ++i)
+		{
+			InotifyRoot* root = static_cast<InotifyRoot*>(events[i].data.ptr);
+
+			processInotifyRoot(root, buf.get(), changes);
+
+			std::sort(changes.begin(), changes.end());
+			changes.erase(std::unique(changes.begin(), changes.end()), changes.end());
+
+			for (auto& c: changes)
+				root->callback(c.c_str());
+
+			changes.clear();
+		}
+	}
+}
+
+static InotifyWatcher* getInotifyWatcher()
+{
+	static std::mutex mutex;
+	static InotifyWatcher* watcher;
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	if (watcher)
+		return watcher;
+
+	int epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll < 0)
+		return nullptr;
+
+	// the watcher is shared by all projects and lives until the process exits
+	watcher = new InotifyWatcher;
+	watcher->epoll = epoll;
+
+	std::thread(watchInotify, watcher).detach();
+
+	return watcher;
+}
+
+static bool watchDirectoryInotify(const char* path, const std::function<void (const char* name)>& callback, const std::function<bool (const char* name)>& directoryFilter)
+{
+	InotifyWatcher* watcher = getInotifyWatcher();
+	if (!watcher)
+		return false;
+
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	// fs.inotify.max_user_instances is exhausted; poll the folder instead
+	if (fd < 0)
+		return errno == EMFILE && watchDirectoryPolling(path, callback, directoryFilter);
+
+	std::unique_ptr<InotifyRoot> root(new InotifyRoot { path, callback, directoryFilter, fd });
+	root->lastReadTimeStamp = getCurrentTimeStamp(1);
+	root->generation = 1;
+
+	std::vector<std::string> changes;
+
+	// the root isn't visible to the watcher thread until it's added to epoll, so it can be scanned without locking
+	if (!addWatchRec(root.get(), path, "", ~0ull, changes))
+	{
+		close(fd);
+		return false;
+	}
+
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.ptr = root.get();
+
+	std::unique_lock<std::mutex> lock(watcher->mutex);
+
+	if (epoll_ctl(watcher->epoll, EPOLL_CTL_ADD, fd, &event) < 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	watcher->roots.push_back(std::move(root));
 
 	return true;
 }
@@ -281,12 +869,17 @@ static bool watchDirectoryFSEvent(const char* path, const std::function<void (co
 
 #endif
 
-bool watchDirectory(const char* path, const std::function<void (const char* name)>& callback)
+bool watchDirectory(const char* path, const std::function<void (const char* name)>& callback, const std::function<bool (const char* name)>& directoryFilter)
 {
 #if defined(__linux__)
-	return watchDirectoryInotify(path, callback);
+	return watchDirectoryInotify(path, callback, directoryFilter);
 #elif defined(__APPLE__)
-	return watchDirectoryFSEvent(path, callback);
+	std::string rootPath = path;
+
+	// each folder uses its own event stream that needs a run loop; the stream covers the whole tree so the directory filter doesn't apply
+	std::thread([=] { watchDirectoryFSEvent(rootPath.c_str(), callback); }).detach();
+
+	return true;
 #else
 	return false;
 #endif
@@ -7,10 +7,13 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <thread>
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+#include <io.h>
+
 const size_t kMaxPathLength = 32768;
 
 static std::wstring fromUtf8(const char* path)
@@ -41,9 +44,9 @@ static uint64_t combine(uint32_t hi, uint32_t lo)
 	return (static_cast<uint64_t>(hi) << 32) | lo;
 }
 
-static bool traverseDirectoryRec(const wchar_t* path, const char* relpath, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
+bool enumerateDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback)
 {
-	std::wstring query = path + std::wstring(L"/*");
+	std::wstring query = fromUtf8(path) + std::wstring(L"/*");
 
 	WIN32_FIND_DATAW data;
 	HANDLE h = FindFirstFileExW(query.c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
@@ -51,9 +54,6 @@ static bool traverseDirectoryRec(const wchar_t* path, const char* relpath, const
 	if (h == INVALID_HANDLE_VALUE)
 		return false;
 
-	std::wstring buf;
-	std::string relbuf;
-
 	do
 	{
 		char filename[MAX_PATH];
@@ -61,27 +61,20 @@ static bool traverseDirectoryRec(const wchar_t* path, const char* relpath, const
 
 		if (traverseFileNeeded(filename))
 		{
-			joinPaths(relbuf, relpath, filename);
-
 			if (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
 			{
 				// Skip reparse points to avoid handling cycles
 			}
 			else if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
 			{
-				buf = path;
-				buf += '/';
-				buf += data.cFileName;
-
-				if (directoryFilter(relbuf.c_str()))
-					traverseDirectoryRec(buf.c_str(), relbuf.c_str(), callback, directoryFilter);
+				directoryCallback(filename);
 			}
 			else
 			{
 				uint64_t mtime = combine(data.ftLastWriteTime.dwHighDateTime, data.ftLastWriteTime.dwLowDateTime);
 				uint64_t size = combine(data.nFileSizeHigh, data.nFileSizeLow);
 
-				callback(relbuf.c_str(), mtime, size);
+				fileCallback(filename, mtime, size);
 			}
 		}
 	}
@@ -92,11 +85,6 @@ static bool traverseDirectoryRec(const wchar_t* path, const char* relpath, const
 	return true;
 }
 
-bool traverseDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
-{
-	return traverseDirectoryRec(fromUtf8(path).c_str(), "", callback, directoryFilter);
-}
-
 bool renameFile(const char* oldpath, const char* newpath)
 {
 	return !!MoveFileExW(fromUtf8(oldpath).c_str(), fromUtf8(newpath).c_str(), MOVEFILE_REPLACE_EXISTING);
@@ -121,6 +109,15 @@ bool getFileAttributes(const char* path, uint64_t* mtime, uint64_t* size)
 	return false;
 }
 
+uint64_t getCurrentTimeStamp(unsigned int secondsAgo)
+{
+	FILETIME time;
+	GetSystemTimeAsFileTime(&time);
+
+	// FILETIME uses 100 ns intervals
+	return combine(time.dwHighDateTime, time.dwLowDateTime) - uint64_t(secondsAgo) * 10000000;
+}
+
 void createDirectory(const char* path)
 {
     CreateDirectoryW(fromUtf8(path).c_str(), NULL);
@@ -162,13 +159,72 @@ FILE* openFile(const char* path, const char* mode)
 	return _wfopen(wpath.c_str(), wmode);
 }
 
-bool watchDirectory(const char* path, const std::function<void (const char* name)>& callback)
+bool lockFile(FILE* file)
 {
-	HANDLE h = CreateFileW(fromUtf8(path).c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	OVERLAPPED overlapped = {};
 
-	if (h == INVALID_HANDLE_VALUE)
-		return false;
+	return !!LockFileEx(reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(file))), LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &overlapped);
+}
+
+static const void* mapHandle(HANDLE file, size_t* size)
+{
+	LARGE_INTEGER fileSize;
+	void* result = nullptr;
+
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0 && uint64_t(fileSize.QuadPart) <= SIZE_MAX)
+	{
+		if (HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL))
+		{
+			result = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+			if (result)
+				*size = fileSize.QuadPart;
+
+			// the view keeps the mapping referenced so we don't need the handles anymore
+			CloseHandle(mapping);
+		}
+	}
+
+	return result;
+}
+
+const void* mapFile(const char* path, size_t* size)
+{
+	HANDLE file = CreateFileW(fromUtf8(path).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE)
+		return nullptr;
+
+	const void* result = mapHandle(file, size);
+
+	CloseHandle(file);
+
+	return result;
+}
+
+const void* mapFile(FILE* file, size_t* size)
+{
+	return mapHandle(reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(file))), size);
+}
 
+void unmapFile(const void* data, size_t size)
+{
+	UnmapViewOfFile(data);
+}
+
+void setBackgroundPriority()
+{
+	// lowers both CPU and I/O priority
+	SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN);
+}
+
+void setBackgroundThreadPriority()
+{
+	SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+}
+
+static void watchDirectoryChanges(HANDLE h, const std::function<void (const char* name)>& callback)
+{
 	char buf[65536];
 	DWORD bufsize = 0;
 
@@ -204,6 +260,17 @@ bool watchDirectory(const char* path, const std::function<void (const char* name
 	}
 
 	CloseHandle(h);
+}
+
+bool watchDirectory(const char* path, const std::function<void (const char* name)>& callback, const std::function<bool (const char* name)>& directoryFilter)
+{
+	// the whole tree is watched with one handle, so the directory filter doesn't apply
+	HANDLE h = CreateFileW(fromUtf8(path).c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+
+	if (h == INVALID_HANDLE_VALUE)
+		return false;
+
+	std::thread([=] { watchDirectoryChanges(h, callback); }).detach();
 
 	return true;
 }
@@ -310,7 +310,7 @@ static void buildNameBuffer(FilterEntries& names, const FilterEntries& entries,
 
         while (name > path && name[-1] != '/' && name[-1] != '\\') name--;
 
-        FilterEntry& n = names.entries[i];
+        FilterEntry& n = entryptr[i];
 
         n.offset = offset;
         n.length = path + e.length - name;
@@ -3,10 +3,11 @@
 
 class Output;
 
+// Entries use 32-bit offsets so that the file list can store them in the same layout
 struct FilterEntry
 {
-    size_t offset;
-    size_t length;
+    uint32_t offset;
+    uint32_t length;
 };
 
 struct FilterEntries
@@ -14,7 +15,7 @@ struct FilterEntries
     const char* buffer;
     size_t bufferSize;
 
-    FilterEntry* entries;
+    const FilterEntry* entries;
     unsigned int entryCount;
 };
 
@@ -15,6 +15,13 @@ unsigned int filterBuffer(Output* output, const char* string, unsigned int optio
 {
 	if (bufferSize == 0) return 0;
 
+	// filter entries use 32-bit offsets
+	if (bufferSize > UINT32_MAX)
+	{
+		output->error("Error: input is too large\n");
+		return 0;
+	}
+
 	std::vector<FilterEntry> data;
 
 	for (size_t i = 0; i < bufferSize; )
@@ -24,7 +31,7 @@ unsigned int filterBuffer(Output* output, const char* string, unsigned int optio
 
 		if (i < next)
 		{
-			FilterEntry e = {i, next - i};
+			FilterEntry e = {uint32_t(i), uint32_t(next - i)};
 			data.push_back(e);
 		}
 
@@ -1,34 +1,39 @@
 // This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
 #pragma once
 
-const char kFileFileHeaderMagic[] = "QGF0";
+const char kFileFileHeaderMagic[] = "QGF1";
 
 struct FileFileHeader
 {
 	char magic[4];
 
 	uint32_t fileCount;
-	uint32_t compressedSize;
-	uint32_t uncompressedSize;
 
-	uint32_t nameBufferOffset;
-	uint32_t nameBufferLength;
+	// file list is stored uncompressed so that it can be mapped; each entry table has an entry per file, with offsets relative to the matching buffer
+	uint32_t pathEntryOffset;
+	uint32_t nameEntryOffset;
 
 	uint32_t pathBufferOffset;
 	uint32_t pathBufferLength;
+
+	uint32_t nameBufferOffset;
+	uint32_t nameBufferLength;
 };
 
 struct FileFileEntry
 {
-	uint32_t nameOffset;
-	uint32_t pathOffset;
+	uint32_t offset;
+	uint32_t length;
 };
 
-const char kDataFileHeaderMagic[] = "QGD2";
+const char kDataFileHeaderMagic[] = "QGD6";
 
 struct DataFileHeader
 {
 	char magic[4];
+
+	// dictionary for chunk compression immediately follows the header
+	uint32_t dictionarySize;
 };
 
 struct DataChunkHeader
@@ -42,7 +47,48 @@ struct DataChunkHeader
 	uint32_t indexSize;
 	uint32_t indexHashIterations;
 
+	// extra data has the path of the last file in the chunk, followed by content hashes of the originals of duplicate files in the chunk
 	uint32_t extraSize;
+	uint32_t duplicateCount;
+
+	uint32_t flags;
+	uint32_t codec;
+
+	// padding between index and chunk data
+	uint32_t dataPadding;
+};
+
+enum DataChunkFlags
+{
+	// Chunk data is compressed using the data file dictionary
+	DC_DICTIONARY = 1 << 0,
+
+	// Chunk index contains trigrams in addition to 4-grams
+	DC_INDEX_TRIGRAMS = 1 << 1,
+
+	// Chunk data was compressed with a fast compression level; update recompresses it with the project compression level
+	DC_RECOMPRESS = 1 << 2,
+};
+
+enum DataChunkCodec
+{
+	// Chunk data is compressed using LZ4; compressedSize is the size of compressed data
+	DCC_LZ4 = 0,
+
+	// Chunk data is stored as is at a page-aligned offset so that it can be searched in place; compressedSize is equal to uncompressedSize
+	DCC_NONE = 1,
+};
+
+enum DataChunkFileFlags
+{
+	// File contents is referenced by duplicate files later in the data file
+	DF_HASDUPLICATES = 1 << 0,
+
+	// File contents is stored in an earlier file; file data contains the path of that file
+	DF_DUPLICATE = 1 << 1,
+
+	// File was removed; only used in delta segments to mark the base file as superseded, file data is empty
+	DF_REMOVED = 1 << 2,
 };
 
 struct DataChunkFileHeader
@@ -53,8 +99,61 @@ struct DataChunkFileHeader
 	uint32_t dataSize;
 
 	uint32_t startLine;
-	uint32_t reserved;
+	uint32_t flags;
+
+	uint64_t fileSize;
+	uint64_t timeStamp;
+
+	uint64_t contentHash;
+};
 
+const char kScanCacheHeaderMagic[] = "QGT0";
+
+struct ScanCacheHeader
+{
+	char magic[4];
+
+	uint32_t directoryCount;
+};
+
+struct ScanCacheDirectoryHeader
+{
+	uint64_t timeStamp;
+
+	// directory path is followed by file entries, subdirectory name offsets and the name buffer with null-terminated names
+	uint32_t pathLength;
+	uint32_t fileCount;
+	uint32_t directoryCount;
+	uint32_t nameBufferLength;
+};
+
+struct ScanCacheFileEntry
+{
+	uint64_t timeStamp;
 	uint64_t fileSize;
+
+	uint32_t nameOffset;
+	uint32_t padding;
+};
+
+const char kChangeFileHeaderMagic[] = "QGC0";
+
+struct ChangeFileHeader
+{
+	char magic[4];
+
+	// entries are sorted by path and followed by the path buffer
+	uint32_t fileCount;
+	uint32_t pathBufferLength;
+	uint32_t padding;
+};
+
+struct ChangeFileEntry
+{
+	// attributes of the file when the change was recorded; files that don't exist have zero attributes
 	uint64_t timeStamp;
+	uint64_t fileSize;
+
+	uint32_t pathOffset;
+	uint32_t pathLength;
 };
@@ -0,0 +1,207 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "gitindex.hpp"
+
+#include "fileutil.hpp"
+#include "filestream.hpp"
+
+#include <algorithm>
+#include <fstream>
+
+#include <string.h>
+
+static uint32_t readBE32(const char* data)
+{
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static uint16_t readBE16(const char* data)
+{
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+
+	return uint16_t((p[0] << 8) | p[1]);
+}
+
+static std::string getGitDirectory(const char* path)
+{
+	std::string gitPath;
+	joinPaths(gitPath, path, ".git");
+
+	// linked worktrees and submodules use a file that points to the git directory
+	std::ifstream in(gitPath.c_str());
+	std::string line;
+
+	if (in && std::getline(in, line) && line.compare(0, 8, "gitdir: ") == 0)
+	{
+		std::string target = line.substr(8);
+
+		while (!target.empty() && (target.back() == '\r' || target.back() == ' '))
+			target.pop_back();
+
+		return normalizePath(path, target.c_str());
+	}
+
+	return gitPath;
+}
+
+static size_t getObjectIdSize(const std::string& gitPath)
+{
+	std::ifstream in((gitPath + "/config").c_str());
+	std::string line;
+
+	while (std::getline(in, line))
+	{
+		line.erase(std::remove_if(line.begin(), line.end(), [](char ch) { return ch == ' ' || ch == '\t'; }), line.end());
+		std::transform(line.begin(), line.end(), line.begin(), [](char ch) { return char(tolower(ch)); });
+
+		if (line == "objectformat=sha256")
+			return 32;
+	}
+
+	return 20;
+}
+
+static bool readVarint(const char*& data, const char* end, size_t& result)
+{
+	if (data >= end)
+		return false;
+
+	unsigned char ch = *data++;
+	size_t value = ch & 127;
+
+	while (ch & 128)
+	{
+		if (data >= end)
+			return false;
+
+		ch = *data++;
+		value = ((value + 1) << 7) | (ch & 127);
+	}
+
+	result = value;
+	return true;
+}
+
+static bool parseGitIndex(const char* data, size_t size, size_t oidSize, GitIndex& index)
+{
+	const char* end = data + size;
+
+	if (size < 12 || memcmp(data, "DIRC", 4) != 0)
+		return false;
+
+	uint32_t version = readBE32(data + 4);
+	uint32_t count = readBE32(data + 8);
+
+	if (version < 2 || version > 4)
+		return false;
+
+	const char* entry = data + 12;
+	std::string path;
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		// ctime, mtime, dev, ino, mode, uid, gid, size, object id and flags
+		size_t headerSize = 40 + oidSize + 2;
+
+		if (size_t(end - entry) < headerSize)
+			return false;
+
+		uint32_t mode = readBE32(entry + 24);
+		uint16_t flags = readBE16(entry + 40 + oidSize);
+		uint16_t extendedFlags = 0;
+
+		if (flags & 0x4000)
+		{
+			if (version < 3 || size_t(end - entry) < headerSize + 2)
+				return false;
+
+			extendedFlags = readBE16(entry + headerSize);
+			headerSize += 2;
+		}
+
+		const char* name = entry + headerSize;
+
+		if (version == 4)
+		{
+			// paths are prefix-compressed relative to the previous entry; entries are not padded
+			size_t strip;
+			if (!readVarint(name, end, strip) || strip > path.size())
+				return false;
+
+			const char* nameEnd = static_cast<const char*>(memchr(name, 0, end - name));
+			if (!nameEnd)
+				return false;
+
+			path.erase(path.size() - strip);
+			path.append(name, nameEnd);
+
+			entry = nameEnd + 1;
+		}
+		else
+		{
+			const char* nameEnd = static_cast<const char*>(memchr(name, 0, end - name));
+			if (!nameEnd)
+				return false;
+
+			path.assign(name, nameEnd);
+
+			// entries are padded with 1-8 null bytes to a multiple of 8 bytes
+			size_t entrySize = (headerSize + path.size() + 8) & ~size_t(7);
+
+			if (size_t(end - entry) < entrySize)
+				return false;
+
+			entry += entrySize;
+		}
+
+		bool skipWorktree = (extendedFlags & 0x4000) != 0;
+
+		// only keep regular files; symbolic links, submodules and sparse directories are skipped
+		// files with merge conflicts have an entry for each stage instead of stage 0, and they are still in the working tree
+		if (!skipWorktree && (mode & 0170000) == 0100000 && (index.entries.empty() || index.entries.back().path != path))
+			index.entries.push_back({ path });
+	}
+
+	return true;
+}
+
+bool readGitIndex(const char* path, GitIndex& index)
+{
+	std::string gitPath = getGitDirectory(path);
+	std::string indexPath = gitPath + "/index";
+
+	FileMapping mapping(indexPath.c_str());
+	if (!mapping)
+		return false;
+
+	index.entries.clear();
+	index.directories.clear();
+
+	if (!parseGitIndex(mapping.data(), mapping.size(), getObjectIdSize(gitPath), index))
+		return false;
+
+	// the index is sorted by path bytes, which matches std::string comparison
+	assert(std::is_sorted(index.entries.begin(), index.entries.end(), [](const GitIndexEntry& l, const GitIndexEntry& r) { return l.path < r.path; }));
+
+	index.directories.insert("");
+
+	for (auto& e: index.entries)
+		for (std::string::size_type slash = e.path.find('/'); slash != std::string::npos; slash = e.path.find('/', slash + 1))
+			index.directories.insert(e.path.substr(0, slash));
+
+	return true;
+}
+
+bool isGitIndexFile(const GitIndex& index, const char* path)
+{
+	auto it = std::lower_bound(index.entries.begin(), index.entries.end(), path, [](const GitIndexEntry& l, const char* r) { return l.path < r; });
+
+	return it != index.entries.end() && it->path == path;
+}
+
+bool isGitIndexDirectory(const GitIndex& index, const char* path)
+{
+	return index.directories.count(path) > 0;
+}
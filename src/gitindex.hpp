@@ -0,0 +1,24 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+struct GitIndexEntry
+{
+	std::string path;
+};
+
+struct GitIndex
+{
+	// tracked files sorted by path, and all directories that contain tracked files
+	std::vector<GitIndexEntry> entries;
+	std::unordered_set<std::string> directories;
+};
+
+// Reads the index of the git working tree at path; only regular files are kept, with one entry per path for files with merge conflicts
+bool readGitIndex(const char* path, GitIndex& index);
+
+bool isGitIndexFile(const GitIndex& index, const char* path);
+bool isGitIndexDirectory(const GitIndex& index, const char* path);
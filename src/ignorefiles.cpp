@@ -0,0 +1,464 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "ignorefiles.hpp"
+
+#include "filestream.hpp"
+
+#include <algorithm>
+
+#include <string.h>
+
+enum RuleFlags
+{
+	RF_NEGATE = 1 << 0,
+	RF_DIRECTORY = 1 << 1,
+	RF_PATH = 1 << 2,
+	RF_LITERAL = 1 << 3,
+	RF_SUFFIX = 1 << 4,
+};
+
+static const char* matchClass(const char* p, char ch)
+{
+	assert(*p == '[');
+	p++;
+
+	bool negate = *p == '!' || *p == '^';
+	if (negate) p++;
+
+	bool matched = false;
+
+	// ] right after the opening bracket is a literal character
+	for (const char* begin = p; *p && (*p != ']' || p == begin); ++p)
+	{
+		char first = (*p == '\\' && p[1]) ? *++p : *p;
+		char last = first;
+
+		if (p[1] == '-' && p[2] && p[2] != ']')
+		{
+			p += 2;
+			last = (*p == '\\' && p[1]) ? *++p : *p;
+		}
+
+		matched |= ch >= first && ch <= last;
+	}
+
+	if (*p != ']')
+		return nullptr;
+
+	return matched != negate ? p + 1 : nullptr;
+}
+
+// Matches text against a glob pattern; * and ? don't match slashes, and ** matches any number of directories
+static bool matchGlob(const char* p, const char* t)
+{
+	while (*p)
+	{
+		if (p[0] == '*' && p[1] == '*')
+		{
+			const char* rest = p + 2;
+			while (*rest == '*') rest++;
+
+			// trailing ** matches everything inside the directory
+			if (*rest == 0)
+				return true;
+
+			// **/ matches zero or more directories
+			if (*rest == '/')
+			{
+				for (const char* s = t; s; s = strchr(s, '/'))
+				{
+					if (s != t) s++;
+
+					if (matchGlob(rest + 1, s))
+						return true;
+				}
+
+				return false;
+			}
+
+			// ** elsewhere is the same as *
+			p = rest - 1;
+		}
+
+		if (*p == '*')
+		{
+			for (const char* s = t; ; ++s)
+			{
+				if (matchGlob(p + 1, s))
+					return true;
+
+				if (*s == 0 || *s == '/')
+					return false;
+			}
+		}
+
+		if (*t == 0)
+			return false;
+
+		if (*p == '?')
+		{
+			if (*t == '/')
+				return false;
+
+			p++;
+		}
+		else if (*p == '[' && strchr(p + 1, ']'))
+		{
+			if (*t == '/')
+				return false;
+
+			p = matchClass(p, *t);
+
+			if (!p)
+				return false;
+		}
+		else
+		{
+			if (*p == '\\' && p[1])
+				p++;
+
+			if (*p != *t)
+				return false;
+
+			p++;
+		}
+
+		t++;
+	}
+
+	return *t == 0;
+}
+
+static bool isLiteral(const char* p)
+{
+	return !strpbrk(p, "*?[\\");
+}
+
+static bool parseRule(std::string line, std::string& pattern, unsigned int& flags)
+{
+	flags = 0;
+
+	if (!line.empty() && line.back() == '\r')
+		line.pop_back();
+
+	// trailing spaces are ignored unless they are escaped
+	while (!line.empty() && line.back() == ' ' && !(line.size() > 1 && line[line.size() - 2] == '\\'))
+		line.pop_back();
+
+	if (line.empty() || line[0] == '#')
+		return false;
+
+	const char* p = line.c_str();
+
+	if (*p == '!')
+	{
+		flags |= RF_NEGATE;
+		p++;
+	}
+	else if (*p == '\\' && (p[1] == '!' || p[1] == '#'))
+		p++;
+
+	pattern = p;
+
+	if (!pattern.empty() && pattern.back() == '/')
+	{
+		flags |= RF_DIRECTORY;
+		pattern.pop_back();
+	}
+
+	// patterns with a slash at the beginning or in the middle are matched against the path relative to the ignore file; other patterns match the name at any level
+	if (pattern.find('/') != std::string::npos)
+	{
+		flags |= RF_PATH;
+
+		if (pattern[0] == '/')
+			pattern.erase(0, 1);
+	}
+
+	if (pattern.empty())
+		return false;
+
+	if (isLiteral(pattern.c_str()))
+		flags |= RF_LITERAL;
+	else if (!(flags & RF_PATH) && pattern[0] == '*' && isLiteral(pattern.c_str() + 1))
+	{
+		// common patterns like *.o are matched by comparing the name suffix
+		flags |= RF_SUFFIX;
+		pattern.erase(0, 1);
+	}
+
+	return true;
+}
+
+static bool matchRule(const std::string& pattern, unsigned int flags, const char* path, const char* name, size_t nameLength)
+{
+	if (flags & RF_PATH)
+		return (flags & RF_LITERAL) ? strcmp(pattern.c_str(), path) == 0 : matchGlob(pattern.c_str(), path);
+
+	if (flags & RF_LITERAL)
+		return pattern.size() == nameLength && memcmp(pattern.c_str(), name, nameLength) == 0;
+
+	if (flags & RF_SUFFIX)
+		return pattern.size() <= nameLength && memcmp(pattern.c_str(), name + nameLength - pattern.size(), pattern.size()) == 0;
+
+	return matchGlob(pattern.c_str(), name);
+}
+
+IgnoreFiles::IgnoreFiles(const char* path, const std::function<bool (const std::string& path, bool directory)>& keep): keep(keep)
+{
+	std::shared_ptr<Level> level = std::make_shared<Level>();
+	level->path = path;
+
+	std::string gitPath;
+	joinPaths(gitPath, path, ".git/info/exclude");
+
+	parseRules(gitPath.c_str(), level->rules);
+
+	root = level;
+	exclude = level;
+}
+
+IgnoreFiles::~IgnoreFiles()
+{
+}
+
+void IgnoreFiles::parseRules(const char* path, std::vector<Rule>& rules)
+{
+	FileMapping mapping(path);
+	if (!mapping)
+		return;
+
+	const char* data = mapping.data();
+	const char* end = data + mapping.size();
+
+	while (data < end)
+	{
+		const char* line = std::find(data, end, '\n');
+
+		Rule rule;
+		if (parseRule(std::string(data, line), rule.pattern, rule.flags))
+			rules.push_back(rule);
+
+		data = (line == end) ? line : line + 1;
+	}
+}
+
+std::shared_ptr<IgnoreFiles::Level> IgnoreFiles::getParentLevel(const std::string& path)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	// kept directories that are ignored get their level when their parent is enumerated
+	auto self = levels.find(path);
+
+	if (self != levels.end())
+		return self->second;
+
+	// the parent directories were enumerated before this one, so the closest one with ignore files already has its level here; the root level covers the rest
+	for (size_t slash = path.find_last_of("/\\"); slash != std::string::npos && slash > 0; slash = path.find_last_of("/\\", slash - 1))
+	{
+		auto it = levels.find(path.substr(0, slash));
+
+		if (it != levels.end())
+			return it->second;
+	}
+
+	return root;
+}
+
+std::shared_ptr<IgnoreFiles::Level> IgnoreFiles::getPathLevel(const std::string& path)
+{
+	auto it = pathLevels.find(path);
+	if (it != pathLevels.end())
+		return it->second;
+
+	std::shared_ptr<Level> level = exclude;
+
+	// nested directories are matched against the rules of their parent first; the contents of ignored directories are ignored as well
+	if (path.size() > exclude->path.size())
+	{
+		size_t slash = path.find_last_of("/\\");
+		assert(slash != std::string::npos);
+
+		level = getPathLevel(path.substr(0, std::max(slash, exclude->path.size())));
+
+		if (level && isIgnored(level.get(), path, slash + 1, true))
+			level.reset();
+	}
+
+	if (level)
+	{
+		std::vector<Rule> rules;
+		std::string buf;
+
+		joinPaths(buf, path.c_str(), ".gitignore");
+		parseRules(buf.c_str(), rules);
+
+		joinPaths(buf, path.c_str(), ".ignore");
+		parseRules(buf.c_str(), rules);
+
+		if (!rules.empty())
+		{
+			std::shared_ptr<Level> child = std::make_shared<Level>();
+			child->path = path;
+			child->rules = std::move(rules);
+			child->parent = std::move(level);
+
+			level = std::move(child);
+		}
+	}
+
+	pathLevels[path] = level;
+
+	return level;
+}
+
+bool IgnoreFiles::isPathIgnored(const std::string& path, bool directory)
+{
+	size_t slash = path.find_last_of("/\\");
+
+	if (slash == std::string::npos || path.size() <= exclude->path.size())
+		return false;
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	std::shared_ptr<Level> level = getPathLevel(path.substr(0, std::max(slash, exclude->path.size())));
+
+	return !level || isIgnored(level.get(), path, slash + 1, directory);
+}
+
+void IgnoreFiles::reset()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	pathLevels.clear();
+}
+
+bool IgnoreFiles::isIgnored(const Level* level, const std::string& path, size_t nameOffset, bool directory)
+{
+	const char* name = path.c_str() + nameOffset;
+	size_t nameLength = path.size() - nameOffset;
+
+	if (level->ignored)
+		return true;
+
+	// the last matching rule in the innermost ignore file decides
+	for (; level; level = level->parent.get())
+	{
+		size_t offset = level->path.size() + (level->path.empty() || level->path.back() == '/' || level->path.back() == '\\' ? 0 : 1);
+		assert(offset <= nameOffset);
+
+		for (auto it = level->rules.rbegin(); it != level->rules.rend(); ++it)
+		{
+			if ((it->flags & RF_DIRECTORY) && !directory)
+				continue;
+
+			if (matchRule(it->pattern, it->flags, path.c_str() + offset, name, nameLength))
+				return (it->flags & RF_NEGATE) == 0;
+		}
+	}
+
+	return false;
+}
+
+bool IgnoreFiles::enumerate(const EnumerateDirectoryFunction& base, const char* path,
+	const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback)
+{
+	std::shared_ptr<Level> level = getParentLevel(path);
+
+	// the ignore files have to be read before the entries are filtered, and the listing order is arbitrary; the listing also tells
+	// us which ignore files exist, so directories without them (most of them, and all cached ones) don't need to be probed
+	struct Entry
+	{
+		size_t nameOffset;
+		uint64_t mtime;
+		uint64_t size;
+		bool directory;
+	};
+
+	std::vector<Entry> entries;
+	std::vector<char> names;
+	bool hasGitIgnore = false, hasIgnore = false;
+
+	bool result = base(path, [&](const char* name, uint64_t mtime, uint64_t size) {
+		hasGitIgnore |= strcmp(name, ".gitignore") == 0;
+		hasIgnore |= strcmp(name, ".ignore") == 0;
+
+		entries.push_back({ names.size(), mtime, size, false });
+		names.insert(names.end(), name, name + strlen(name) + 1);
+	}, [&](const char* name) {
+		entries.push_back({ names.size(), 0, 0, true });
+		names.insert(names.end(), name, name + strlen(name) + 1);
+	});
+
+	if (!result)
+		return false;
+
+	std::vector<Rule> rules;
+	std::string buf;
+
+	// rules don't matter inside ignored directories
+	if (level->ignored)
+		hasGitIgnore = hasIgnore = false;
+
+	if (hasGitIgnore)
+	{
+		joinPaths(buf, path, ".gitignore");
+		parseRules(buf.c_str(), rules);
+	}
+
+	if (hasIgnore)
+	{
+		joinPaths(buf, path, ".ignore");
+		parseRules(buf.c_str(), rules);
+	}
+
+	if (!rules.empty())
+	{
+		std::shared_ptr<Level> child = std::make_shared<Level>();
+		child->path = path;
+		child->rules = std::move(rules);
+		child->parent = std::move(level);
+
+		level = std::move(child);
+
+		// nested directories are only enumerated after the callbacks, so the rules will be there when they are
+		std::unique_lock<std::mutex> lock(mutex);
+
+		if (root->path == path)
+			root = level;
+		else
+			levels[path] = level;
+	}
+
+	for (auto& e: entries)
+	{
+		const char* name = &names[e.nameOffset];
+
+		joinPaths(buf, path, name);
+
+		if (isIgnored(level.get(), buf, buf.size() - strlen(name), e.directory))
+		{
+			if (!keep || !keep(buf, e.directory))
+				continue;
+
+			if (e.directory)
+			{
+				std::shared_ptr<Level> child = std::make_shared<Level>();
+				child->path = buf;
+				child->parent = level;
+				child->ignored = true;
+
+				std::unique_lock<std::mutex> lock(mutex);
+
+				levels[buf] = child;
+			}
+		}
+
+		if (e.directory)
+			directoryCallback(name);
+		else
+			fileCallback(name, e.mtime, e.size);
+	}
+
+	return true;
+}
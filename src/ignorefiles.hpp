@@ -0,0 +1,64 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include "fileutil.hpp"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Filters directory listings using .gitignore and .ignore files found during the scan, as well as .git/info/exclude of the scanned folder
+// Ignored directories are not reported so the scan doesn't descend into them; the same object can be used from multiple scan threads
+// Paths reported outside of the scan, e.g. by watchers, are checked one at a time against the ignore files of all their parent directories
+class IgnoreFiles
+{
+public:
+	// entries accepted by keep are reported even if they are ignored, e.g. files tracked by git; the rest of the contents of kept directories stay ignored
+	IgnoreFiles(const char* path, const std::function<bool (const std::string& path, bool directory)>& keep = nullptr);
+	~IgnoreFiles();
+
+	bool enumerate(const EnumerateDirectoryFunction& base, const char* path,
+		const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback);
+
+	// the path must be inside the folder; ignore files of the parent directories are read on first use and cached until reset
+	bool isPathIgnored(const std::string& path, bool directory);
+	void reset();
+
+private:
+	struct Rule
+	{
+		std::string pattern;
+		unsigned int flags;
+	};
+
+	// rules of all ignore files in one directory; rules of nested directories take precedence over the parent rules
+	struct Level
+	{
+		std::string path;
+		std::vector<Rule> rules;
+		std::shared_ptr<Level> parent;
+
+		// everything in an ignored directory is ignored, which only matters for kept directories
+		bool ignored;
+	};
+
+	std::shared_ptr<Level> root;
+	std::shared_ptr<Level> exclude;
+
+	std::function<bool (const std::string& path, bool directory)> keep;
+
+	// levels of enumerated directories that have ignore files and of kept directories that are ignored; other directories use the level of the closest parent
+	std::mutex mutex;
+	std::unordered_map<std::string, std::shared_ptr<Level>> levels;
+
+	// levels of directories checked by isPathIgnored, or null if the directory itself is ignored
+	std::unordered_map<std::string, std::shared_ptr<Level>> pathLevels;
+
+	std::shared_ptr<Level> getParentLevel(const std::string& path);
+	std::shared_ptr<Level> getPathLevel(const std::string& path);
+
+	static void parseRules(const char* path, std::vector<Rule>& rules);
+	static bool isIgnored(const Level* level, const std::string& path, size_t nameOffset, bool directory);
+};
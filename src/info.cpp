@@ -11,9 +11,12 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 #include <type_traits>
 #include <algorithm>
 
+#include <math.h>
+
 template <typename T> struct Statistics
 {
 	unsigned int count;
@@ -60,6 +63,7 @@ struct ProjectInfo
 	unsigned long long indexTotalSize;
 	Statistics<unsigned int> indexHashIterations;
 	Statistics<double> indexFilled;
+	Statistics<double> indexFalsePositiveRate;
 
 	unsigned long long lineCount;
 	unsigned int lineMaxSize;
@@ -69,6 +73,14 @@ struct ProjectInfo
 	unsigned int filePartCount;
 	unsigned long long fileTotalSize;
 
+	unsigned int duplicateCount;
+	unsigned long long duplicateTotalSize;
+
+	unsigned int dictionarySize;
+	unsigned int dictionaryChunkCount;
+
+	unsigned int uncompressedChunkCount;
+
 	std::string lastFile;
 	uint64_t lastFileSize;
 	uint64_t lastFileTimeStamp;
@@ -150,6 +162,9 @@ static void processChunkIndex(Output* output, ProjectInfo& info, const DataChunk
 
 	info.indexFilled.update(filledRatio);
 
+	// a random ngram passes the filter if all bits it hashes to are set
+	info.indexFalsePositiveRate.update(pow(filledRatio, header.indexHashIterations));
+
 	info.indexTotalSize += header.indexSize;
 
 	info.indexChunkCount++;
@@ -176,7 +191,16 @@ static void processChunkData(Output* output, ProjectInfo& info, const DataChunkH
 
 		std::string path(data + f.nameOffset, f.nameLength);
 
-		processFilePart(output, info, path.c_str(), f.fileSize, f.timeStamp, data + f.dataOffset, f.dataSize, f.startLine);
+		if (f.flags & DF_DUPLICATE)
+		{
+			// duplicate file data is just the path to the original file
+			processFilePart(output, info, path.c_str(), f.fileSize, f.timeStamp, nullptr, 0, f.startLine);
+
+			info.duplicateCount++;
+			info.duplicateTotalSize += f.fileSize;
+		}
+		else
+			processFilePart(output, info, path.c_str(), f.fileSize, f.timeStamp, data + f.dataOffset, f.dataSize, f.startLine);
 	}
 }
 
@@ -196,6 +220,16 @@ static bool processFile(Output* output, ProjectInfo& info, const char* path)
 		return false;
 	}
 
+	std::vector<char> dictionary(header.dictionarySize);
+
+	if (!read(in, dictionary.data(), dictionary.size()))
+	{
+		output->error("Error reading data file %s: malformed header\n", path);
+		return false;
+	}
+
+	info.dictionarySize = dictionary.size();
+
 	DataChunkHeader chunk;
 
 	while (read(in, chunk))
@@ -215,6 +249,8 @@ static bool processFile(Output* output, ProjectInfo& info, const char* path)
 			processChunkIndex(output, info, chunk, index.get());
 		}
 
+		in.skip(chunk.dataPadding);
+
 		std::unique_ptr<char[]> data(new (std::nothrow) char[chunk.compressedSize + chunk.uncompressedSize]);
 
 		if (!data || !read(in, data.get(), chunk.compressedSize))
@@ -225,7 +261,19 @@ static bool processFile(Output* output, ProjectInfo& info, const char* path)
 
 		char* uncompressed = data.get() + chunk.compressedSize;
 
-		decompress(uncompressed, chunk.uncompressedSize, data.get(), chunk.compressedSize);
+		if (chunk.codec == DCC_NONE)
+		{
+			uncompressed = data.get();
+			info.uncompressedChunkCount++;
+		}
+		else if (chunk.flags & DC_DICTIONARY)
+		{
+			decompress(uncompressed, chunk.uncompressedSize, data.get(), chunk.compressedSize, dictionary.data(), dictionary.size());
+			info.dictionaryChunkCount++;
+		}
+		else
+			decompress(uncompressed, chunk.uncompressedSize, data.get(), chunk.compressedSize);
+
 		processChunkData(output, info, chunk, uncompressed);
 	}
 
@@ -279,6 +327,7 @@ void printProjectInfo(Output* output, const char* path)
 
 		output->print("Files: %s (%s file parts)\n", FI(info.fileCount), FI(info.filePartCount));
 		output->print("File data: %s bytes\n", FI(info.fileTotalSize));
+		output->print("Duplicate files: %s (%s bytes)\n", FI(info.duplicateCount), FI(info.duplicateTotalSize));
 		output->print("Lines: %s (longest line: %s bytes in %s)\n", FI(info.lineCount), FI(info.lineMaxSize), info.lineMaxSizeFile.c_str());
 
 		output->print("Chunks (data): %s (%s bytes, [%s..%s] (avg %s) bytes per chunk%s)\n",
@@ -295,11 +344,26 @@ void printProjectInfo(Output* output, const char* path)
 			info.chunkCompressedSize.total == 0 ? 1.0 : static_cast<double>(info.chunkSize.total) / static_cast<double>(info.chunkCompressedSize.total),
 			info.chunkCompressionRatio.min, info.chunkCompressionRatio.max, info.chunkCompressionRatio.average());
 
+		output->print("Dictionary: %s bytes (used by %s chunks)\n", FI(info.dictionarySize), FI(info.dictionaryChunkCount));
+		output->print("Uncompressed chunks: %s\n", FI(info.uncompressedChunkCount));
+
 		output->print("Index: %s chunks (%s bytes, hash iterations [%d..%d] (avg %.1f), filled ratio [%.1f%%..%.1f%%] (avg %.1f%%))\n",
 			FI(info.indexChunkCount), FI(info.indexTotalSize),
 			info.indexHashIterations.min, info.indexHashIterations.max, info.indexHashIterations.average(),
 			info.indexFilled.min * 100, info.indexFilled.max * 100, info.indexFilled.average() * 100);
 
+		output->print("Index false positive rate (estimated): [%.2f%%..%.2f%%] (avg %.2f%%)\n",
+			info.indexFalsePositiveRate.min * 100, info.indexFalsePositiveRate.max * 100, info.indexFalsePositiveRate.average() * 100);
+
+		std::string deltaPath = replaceExtension(path, ".qgs");
+		uint64_t deltaTime, deltaSize;
+
+		ProjectInfo delta = {};
+
+		if (getFileAttributes(deltaPath.c_str(), &deltaTime, &deltaSize) && processFile(output, delta, deltaPath.c_str()))
+			output->print("Delta segment: %s files, %s bytes in %s chunks (%s bytes compressed)\n",
+				FI(delta.fileCount), FI(delta.fileTotalSize), FI(delta.chunkCount), FI(delta.chunkCompressedSize.total));
+
 	#undef FI
 	}
 }
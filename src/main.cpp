@@ -357,8 +357,11 @@ void printHelp(Output* output, bool extended)
         output->print(
 "\n"
 "Advanced commands:\n"
-"  qgrep build <project-list>\n"
+"  qgrep build <project-list> [fast]\n"
 "  qgrep change <project-list> <file-list>\n"
+"  qgrep update <project-list> changes\n"
+"  qgrep update <project-list> fast\n"
+"  qgrep compact <project-list>\n"
 "  qgrep files <project-list>\n"
 "  qgrep files <project-list> <search-options> <query>\n"
 "  qgrep filter <search-options> <query>\n"
@@ -407,15 +410,34 @@ void mainImpl(Output* output, int argc, const char** argv, const char* input, si
 		{
 			std::vector<std::string> paths = getProjectPaths(argv[2]);
 
+			// with 'fast', chunks are compressed quickly and recompressed on the next update
+			bool fast = argc > 3 && strcmp(argv[3], "fast") == 0;
+
 			for (size_t i = 0; i < paths.size(); ++i)
-				buildProject(output, paths[i].c_str());
+				buildProject(output, paths[i].c_str(), fast);
 		}
 		else if (argc > 2 && strcmp(argv[1], "update") == 0)
 		{
 			std::vector<std::string> paths = getProjectPaths(argv[2]);
 
+			// with 'changes', only the files from the change list are updated instead of rescanning the project
+			bool changes = argc > 3 && strcmp(argv[3], "changes") == 0;
+			bool fast = argc > 3 && strcmp(argv[3], "fast") == 0;
+
+			for (size_t i = 0; i < paths.size(); ++i)
+			{
+				if (changes)
+					updateProjectChanges(output, paths[i].c_str());
+				else
+					updateProject(output, paths[i].c_str(), fast);
+			}
+		}
+		else if (argc > 2 && strcmp(argv[1], "compact") == 0)
+		{
+			std::vector<std::string> paths = getProjectPaths(argv[2]);
+
 			for (size_t i = 0; i < paths.size(); ++i)
-				updateProject(output, paths[i].c_str());
+				compactProject(output, paths[i].c_str());
 		}
 		else if (argc > 3 && strcmp(argv[1], "search") == 0)
 		{
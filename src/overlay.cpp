@@ -0,0 +1,155 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "overlay.hpp"
+
+#include "bloom.hpp"
+#include "casefold.hpp"
+#include "constants.hpp"
+#include "fileutil.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+struct OverlayEntry
+{
+	std::shared_ptr<const OverlayFile> file;
+
+	// position in the recently used list
+	std::list<std::string>::iterator use;
+};
+
+struct Overlay
+{
+	std::atomic<bool> enabled;
+
+	std::mutex mutex;
+	std::unordered_map<std::string, OverlayEntry> files;
+	size_t totalSize;
+
+	// paths of cached files, most recently used first; once the overlay is full the least recently used files are evicted
+	std::list<std::string> uses;
+
+	// incremented on every invalidation so that contents read before the file changed are not cached
+	uint64_t generation;
+};
+
+static Overlay overlay;
+
+static size_t getOverlayFileSize(const OverlayFile& file)
+{
+	return file.size + file.ngrams.size() * sizeof(unsigned int);
+}
+
+static void removeOverlayFile(std::unordered_map<std::string, OverlayEntry>::iterator it)
+{
+	overlay.totalSize -= getOverlayFileSize(*it->second.file);
+	overlay.uses.erase(it->second.use);
+	overlay.files.erase(it);
+}
+
+static void collectNgrams(std::vector<unsigned int>& ngrams, const char* data, size_t size)
+{
+	// this matches the ngrams that are stored in the chunk index
+	for (size_t i = 2; i < size; ++i)
+	{
+		char b = data[i - 2], c = data[i - 1], d = data[i];
+
+		if (b != '\n' && c != '\n' && d != '\n')
+		{
+			unsigned int t = trigram(casefold(b), casefold(c), casefold(d));
+			if (t != 0)
+				ngrams.push_back(t);
+
+			char a = (i >= 3) ? data[i - 3] : '\n';
+
+			if (a != '\n')
+			{
+				unsigned int n = ngram(casefold(a), casefold(b), casefold(c), casefold(d));
+				if (n != 0)
+					ngrams.push_back(n);
+			}
+		}
+	}
+
+	std::sort(ngrams.begin(), ngrams.end());
+	ngrams.erase(std::unique(ngrams.begin(), ngrams.end()), ngrams.end());
+	ngrams.shrink_to_fit();
+}
+
+void enableOverlay()
+{
+	overlay.enabled = true;
+}
+
+bool isOverlayEnabled()
+{
+	return overlay.enabled;
+}
+
+std::shared_ptr<const OverlayFile> getOverlayFile(const std::string& path, uint64_t* generation)
+{
+	std::unique_lock<std::mutex> lock(overlay.mutex);
+
+	*generation = overlay.generation;
+
+	auto it = overlay.files.find(path);
+	if (it == overlay.files.end())
+		return std::shared_ptr<const OverlayFile>();
+
+	overlay.uses.splice(overlay.uses.begin(), overlay.uses, it->second.use);
+
+	return it->second.file;
+}
+
+std::shared_ptr<const OverlayFile> addOverlayFile(const std::string& path, uint64_t generation, std::unique_ptr<char[]> data, size_t size, uint64_t timeStamp, uint64_t fileSize)
+{
+	std::shared_ptr<OverlayFile> file = std::make_shared<OverlayFile>();
+	file->data = std::move(data);
+	file->size = size;
+	file->timeStamp = timeStamp;
+	file->fileSize = fileSize;
+
+	collectNgrams(file->ngrams, file->data.get(), file->size);
+
+	std::unique_lock<std::mutex> lock(overlay.mutex);
+
+	size_t entrySize = getOverlayFileSize(*file);
+
+	// files modified within the time stamp granularity can change again without changing the attributes
+	bool racy = timeStamp >= getCurrentTimeStamp(1);
+
+	if (overlay.generation == generation && !racy && entrySize <= kOverlayMaxSize)
+	{
+		auto it = overlay.files.find(path);
+
+		if (it != overlay.files.end())
+			removeOverlayFile(it);
+
+		while (overlay.totalSize + entrySize > kOverlayMaxSize)
+			removeOverlayFile(overlay.files.find(overlay.uses.back()));
+
+		overlay.uses.push_front(path);
+		overlay.files[path] = { file, overlay.uses.begin() };
+		overlay.totalSize += entrySize;
+	}
+
+	return file;
+}
+
+void invalidateOverlayFiles(const std::vector<std::string>& paths)
+{
+	std::unique_lock<std::mutex> lock(overlay.mutex);
+
+	overlay.generation++;
+
+	for (auto& p: paths)
+	{
+		auto it = overlay.files.find(p);
+
+		if (it != overlay.files.end())
+			removeOverlayFile(it);
+	}
+}
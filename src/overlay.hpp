@@ -0,0 +1,32 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Contents of a changed file that is kept in memory while qgrep runs in interactive mode, so that searches don't need to read changed files from disk
+struct OverlayFile
+{
+	// contents with normalized line endings
+	std::unique_ptr<char[]> data;
+	size_t size;
+
+	// file attributes at the time the contents was read; the contents is only used while the attributes match
+	uint64_t timeStamp;
+	uint64_t fileSize;
+
+	// sorted case-folded ngrams and trigrams of the contents, used to skip files that can't match
+	std::vector<unsigned int> ngrams;
+};
+
+void enableOverlay();
+bool isOverlayEnabled();
+
+// Returns the cached file contents and the generation that needs to be passed to addOverlayFile if the file isn't cached
+std::shared_ptr<const OverlayFile> getOverlayFile(const std::string& path, uint64_t* generation);
+
+// Caches the file contents unless the file was invalidated since the given generation or the file was modified too recently; evicts least recently used files when the overlay is full
+std::shared_ptr<const OverlayFile> addOverlayFile(const std::string& path, uint64_t generation, std::unique_ptr<char[]> data, size_t size, uint64_t timeStamp, uint64_t fileSize);
+
+void invalidateOverlayFiles(const std::vector<std::string>& paths);
@@ -0,0 +1,238 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "pathfilter.hpp"
+
+#include "regex.hpp"
+
+#include <algorithm>
+
+#include <ctype.h>
+#include <string.h>
+
+static char toLowerAscii(char ch)
+{
+	return (ch >= 'A' && ch <= 'Z') ? ch - 'A' + 'a' : ch;
+}
+
+static bool isLiteralChar(char ch)
+{
+	// only ASCII characters are matched literally since case folding of other characters is more involved
+	return ch >= ' ' && ch < 127 && !strchr("\\.^$|?*+()[]{}", ch);
+}
+
+static void parseLiteral(const char*& p, std::string& result)
+{
+	for (;;)
+	{
+		if (isLiteralChar(*p))
+			result += toLowerAscii(*p++);
+		else if (p[0] == '\\' && p[1] > ' ' && p[1] < 127 && !isalnum(static_cast<unsigned char>(p[1])))
+		{
+			result += p[1];
+			p += 2;
+		}
+		else
+			break;
+	}
+}
+
+// Recognizes ^literal and literal$ patterns, including the forms with a group of alternatives (e.g. \.(cpp|h)$)
+static bool parseLiteralRule(const std::string& pattern, std::vector<std::string>& prefixes, std::vector<std::string>& suffixes)
+{
+	const char* p = pattern.c_str();
+
+	bool anchorStart = *p == '^';
+	if (anchorStart) p++;
+
+	std::string head;
+	parseLiteral(p, head);
+
+	std::vector<std::string> literals;
+
+	if (*p == '(')
+	{
+		p++;
+
+		for (;;)
+		{
+			std::string alt = head;
+			parseLiteral(p, alt);
+			literals.push_back(alt);
+
+			if (*p == '|')
+				p++;
+			else if (*p == ')')
+			{
+				p++;
+				break;
+			}
+			else
+				return false;
+		}
+
+		std::string tail;
+		parseLiteral(p, tail);
+
+		for (auto& l: literals)
+			l += tail;
+	}
+	else
+		literals.push_back(head);
+
+	bool anchorEnd = *p == '$';
+	if (anchorEnd) p++;
+
+	// patterns anchored on both ends and unanchored patterns need a regular expression
+	if (*p || anchorStart == anchorEnd)
+		return false;
+
+	for (auto& l: literals)
+		if (l.empty())
+			return false;
+
+	(anchorStart ? prefixes : suffixes).insert((anchorStart ? prefixes : suffixes).end(), literals.begin(), literals.end());
+
+	return true;
+}
+
+static bool equalsLowerAscii(const char* data, const std::string& literal)
+{
+	for (size_t i = 0; i < literal.size(); ++i)
+		if (toLowerAscii(data[i]) != literal[i])
+			return false;
+
+	return true;
+}
+
+PathFilter::PathFilter()
+{
+}
+
+PathFilter::~PathFilter()
+{
+}
+
+void PathFilter::addRule(std::vector<Rule>& rules, const std::vector<std::string>& list)
+{
+	Rule rule;
+
+	for (auto& p: list)
+		if (!parseLiteralRule(p, rule.prefixes, rule.suffixes))
+		{
+			rule.patterns.push_back(patterns.size());
+			patterns.push_back(p);
+		}
+
+	rules.push_back(rule);
+}
+
+void PathFilter::addInclude(const std::vector<std::string>& patterns)
+{
+	addRule(includes, patterns);
+}
+
+void PathFilter::addExclude(const std::vector<std::string>& patterns)
+{
+	addRule(excludes, patterns);
+}
+
+void PathFilter::compile()
+{
+	if (!patterns.empty())
+		set.reset(createRegexSet(patterns, RO_IGNORECASE));
+}
+
+bool PathFilter::matchLiterals(const Rule& rule, const char* path, size_t length) const
+{
+	for (auto& p: rule.prefixes)
+		if (p.size() <= length && equalsLowerAscii(path, p))
+			return true;
+
+	for (auto& s: rule.suffixes)
+		if (s.size() <= length && equalsLowerAscii(path + length - s.size(), s))
+			return true;
+
+	return false;
+}
+
+bool PathFilter::matchPatterns(const Rule& rule, const std::vector<int>& matches) const
+{
+	for (int p: rule.patterns)
+		if (std::find(matches.begin(), matches.end(), p) != matches.end())
+			return true;
+
+	return false;
+}
+
+void PathFilter::matchSet(const char* path, size_t length, std::vector<int>& matches) const
+{
+	if (set)
+		set->match(path, length, matches);
+	else
+		matches.clear();
+}
+
+bool PathFilter::isFileAcceptable(const char* path, size_t length) const
+{
+	bool patternsNeeded = false;
+
+	for (auto& rule: excludes)
+	{
+		if (matchLiterals(rule, path, length))
+			return false;
+
+		patternsNeeded |= !rule.patterns.empty();
+	}
+
+	for (auto& rule: includes)
+	{
+		if (!matchLiterals(rule, path, length))
+		{
+			if (rule.patterns.empty())
+				return false;
+
+			patternsNeeded = true;
+		}
+	}
+
+	if (!patternsNeeded)
+		return true;
+
+	std::vector<int> matches;
+	matchSet(path, length, matches);
+
+	for (auto& rule: excludes)
+		if (matchPatterns(rule, matches))
+			return false;
+
+	for (auto& rule: includes)
+		if (!matchLiterals(rule, path, length) && !matchPatterns(rule, matches))
+			return false;
+
+	return true;
+}
+
+bool PathFilter::isDirectoryAcceptable(const char* path, size_t length) const
+{
+	bool patternsNeeded = false;
+
+	for (auto& rule: excludes)
+	{
+		if (matchLiterals(rule, path, length))
+			return false;
+
+		patternsNeeded |= !rule.patterns.empty();
+	}
+
+	if (!patternsNeeded)
+		return true;
+
+	std::vector<int> matches;
+	matchSet(path, length, matches);
+
+	for (auto& rule: excludes)
+		if (matchPatterns(rule, matches))
+			return false;
+
+	return true;
+}
@@ -0,0 +1,49 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class RegexSet;
+
+// Matches paths against a list of include and exclude rules; each rule is a list of case-insensitive regular expressions, and the rule matches if any of them matches
+// Rules that only check a literal path prefix or suffix (e.g. ^folder/ or \.(cpp|h)$) are matched without running regular expressions
+class PathFilter
+{
+public:
+	PathFilter();
+	~PathFilter();
+
+	void addInclude(const std::vector<std::string>& patterns);
+	void addExclude(const std::vector<std::string>& patterns);
+
+	void compile();
+
+	// Path is accepted if it matches all include rules and doesn't match any exclude rules
+	bool isFileAcceptable(const char* path, size_t length) const;
+
+	// Directory is accepted if it doesn't match any exclude rules
+	bool isDirectoryAcceptable(const char* path, size_t length) const;
+
+private:
+	struct Rule
+	{
+		std::vector<std::string> prefixes;
+		std::vector<std::string> suffixes;
+		std::vector<int> patterns;
+	};
+
+	std::vector<Rule> includes;
+	std::vector<Rule> excludes;
+
+	std::vector<std::string> patterns;
+	std::unique_ptr<RegexSet> set;
+
+	void addRule(std::vector<Rule>& rules, const std::vector<std::string>& list);
+
+	bool matchLiterals(const Rule& rule, const char* path, size_t length) const;
+	bool matchPatterns(const Rule& rule, const std::vector<int>& matches) const;
+
+	void matchSet(const char* path, size_t length, std::vector<int>& matches) const;
+};
@@ -0,0 +1,342 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "pollwatch.hpp"
+
+#include "fileutil.hpp"
+#include "constants.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+typedef std::chrono::steady_clock::time_point PollTime;
+
+struct PollDirectory;
+
+struct PollRoot
+{
+	std::string path;
+	std::function<void (const char* name)> callback;
+	std::function<bool (const char* name)> directoryFilter;
+
+	// all directories of the folder by relative path
+	std::unordered_map<std::string, std::shared_ptr<PollDirectory>> directories;
+};
+
+struct PollFile
+{
+	std::string name;
+	uint64_t timeStamp;
+	uint64_t fileSize;
+};
+
+struct PollDirectory
+{
+	PollRoot* root;
+	std::string relpath;
+
+	// sorted by name
+	std::vector<PollFile> files;
+	std::vector<std::string> directories;
+
+	// directories that change are polled often; the interval doubles every time the directory doesn't change
+	std::chrono::seconds interval;
+	PollTime next;
+
+	bool removed;
+};
+
+struct PollEntry
+{
+	PollTime time;
+	std::shared_ptr<PollDirectory> directory;
+
+	bool operator<(const PollEntry& other) const
+	{
+		// std::priority_queue keeps the largest element on top
+		return time > other.time;
+	}
+};
+
+typedef std::vector<std::pair<PollRoot*, std::string>> PollChanges;
+
+struct PollWatcher
+{
+	// protects everything below; the lock is held while registering new folders and while polling a batch of directories
+	std::mutex mutex;
+
+	std::vector<std::unique_ptr<PollRoot>> roots;
+
+	// directories in the order in which they need to be polled; entries that don't match the directory schedule are stale
+	std::priority_queue<PollEntry> queue;
+};
+
+static void scheduleDirectory(PollWatcher* watcher, const std::shared_ptr<PollDirectory>& dir, PollTime time)
+{
+	dir->next = time;
+	watcher->queue.push({ time, dir });
+}
+
+static bool listDirectory(PollDirectory* dir, std::vector<PollFile>& files, std::vector<std::string>& directories)
+{
+	std::string path;
+	joinPaths(path, dir->root->path.c_str(), dir->relpath.c_str());
+
+	// directory listing stats all files, so in-place modifications are detected along with added and removed files
+	bool result = enumerateDirectory(path.c_str(), [&](const char* name, uint64_t mtime, uint64_t size) {
+		files.push_back({ name, mtime, size });
+	}, [&](const char* name) {
+		directories.push_back(name);
+	});
+
+	std::sort(files.begin(), files.end(), [](const PollFile& l, const PollFile& r) { return l.name < r.name; });
+	std::sort(directories.begin(), directories.end());
+
+	return result;
+}
+
+static void reportFile(PollDirectory* dir, const std::string& name, PollChanges& changes)
+{
+	std::string relpath;
+	joinPaths(relpath, dir->relpath.c_str(), name.c_str());
+
+	changes.emplace_back(dir->root, relpath);
+}
+
+static void addDirectoryRec(PollWatcher* watcher, PollRoot* root, const std::string& relpath, uint64_t reportSince, PollChanges& changes)
+{
+	if (!relpath.empty() && !root->directoryFilter(relpath.c_str()))
+		return;
+
+	std::shared_ptr<PollDirectory> dir = std::make_shared<PollDirectory>();
+	dir->root = root;
+	dir->relpath = relpath;
+	dir->interval = std::chrono::seconds(kWatchPollMinInterval);
+	dir->removed = false;
+
+	if (!listDirectory(dir.get(), dir->files, dir->directories))
+		return;
+
+	for (auto& f: dir->files)
+		if (f.timeStamp >= reportSince)
+			reportFile(dir.get(), f.name, changes);
+
+	root->directories[relpath] = dir;
+	scheduleDirectory(watcher, dir, std::chrono::steady_clock::now() + dir->interval);
+
+	std::string buf;
+
+	for (auto& d: dir->directories)
+	{
+		joinPaths(buf, relpath.c_str(), d.c_str());
+		addDirectoryRec(watcher, root, buf, reportSince, changes);
+	}
+}
+
+static void removeDirectoryRec(PollWatcher* watcher, PollRoot* root, const std::string& relpath, PollChanges& changes)
+{
+	auto it = root->directories.find(relpath);
+	if (it == root->directories.end())
+		return;
+
+	std::shared_ptr<PollDirectory> dir = it->second;
+
+	// the directory stays in the queue until its turn comes
+	dir->removed = true;
+	root->directories.erase(it);
+
+	for (auto& f: dir->files)
+		reportFile(dir.get(), f.name, changes);
+
+	std::string buf;
+
+	for (auto& d: dir->directories)
+	{
+		joinPaths(buf, relpath.c_str(), d.c_str());
+		removeDirectoryRec(watcher, root, buf, changes);
+	}
+}
+
+static bool pollDirectory(PollWatcher* watcher, PollDirectory* dir, PollChanges& changes)
+{
+	std::vector<PollFile> files;
+	std::vector<std::string> directories;
+
+	if (!listDirectory(dir, files, directories))
+	{
+		removeDirectoryRec(watcher, dir->root, dir->relpath, changes);
+		return true;
+	}
+
+	size_t changeCount = changes.size();
+
+	// both lists are sorted so we can find added, removed and modified files in one pass
+	size_t oldIt = 0, newIt = 0;
+
+	while (oldIt < dir->files.size() || newIt < files.size())
+	{
+		if (newIt == files.size() || (oldIt < dir->files.size() && dir->files[oldIt].name < files[newIt].name))
+			reportFile(dir, dir->files[oldIt++].name, changes);
+		else if (oldIt == dir->files.size() || files[newIt].name < dir->files[oldIt].name)
+			reportFile(dir, files[newIt++].name, changes);
+		else
+		{
+			if (dir->files[oldIt].timeStamp != files[newIt].timeStamp || dir->files[oldIt].fileSize != files[newIt].fileSize)
+				reportFile(dir, files[newIt].name, changes);
+
+			oldIt++;
+			newIt++;
+		}
+	}
+
+	std::vector<std::string> added, removed;
+
+	std::set_difference(directories.begin(), directories.end(), dir->directories.begin(), dir->directories.end(), std::back_inserter(added));
+	std::set_difference(dir->directories.begin(), dir->directories.end(), directories.begin(), directories.end(), std::back_inserter(removed));
+
+	std::string buf;
+
+	for (auto& d: removed)
+	{
+		joinPaths(buf, dir->relpath.c_str(), d.c_str());
+		removeDirectoryRec(watcher, dir->root, buf, changes);
+	}
+
+	// files in new directories are all reported since they weren't a part of the folder before
+	for (auto& d: added)
+	{
+		joinPaths(buf, dir->relpath.c_str(), d.c_str());
+		addDirectoryRec(watcher, dir->root, buf, 0, changes);
+	}
+
+	dir->files = std::move(files);
+	dir->directories = std::move(directories);
+
+	return changes.size() != changeCount || !added.empty() || !removed.empty();
+}
+
+static void watchPolling(PollWatcher* watcher)
+{
+	// the rate limit is enforced in small steps so that changes are noticed quickly
+	const int kStepsPerSecond = 10;
+	const size_t kDirectoriesPerStep = std::max(kWatchPollRate / kStepsPerSecond, 1);
+
+	PollChanges changes;
+
+	for (;;)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1000 / kStepsPerSecond));
+
+		{
+			std::unique_lock<std::mutex> lock(watcher->mutex);
+
+			PollTime now = std::chrono::steady_clock::now();
+
+			size_t polled = 0;
+
+			while (polled < kDirectoriesPerStep && !watcher->queue.empty() && watcher->queue.top().time <= now)
+			{
+				PollEntry entry = watcher->queue.top();
+				watcher->queue.pop();
+
+				std::shared_ptr<PollDirectory> dir = entry.directory;
+
+				if (dir->removed || dir->next != entry.time)
+					continue;
+
+				polled++;
+
+				bool changed = pollDirectory(watcher, dir.get(), changes);
+
+				if (dir->removed)
+					continue;
+
+				if (changed)
+				{
+					dir->interval = std::chrono::seconds(kWatchPollMinInterval);
+
+					// recently active subtrees are likely to change again soon, so nested directories are checked sooner as well
+					std::string buf;
+
+					for (auto& d: dir->directories)
+					{
+						joinPaths(buf, dir->relpath.c_str(), d.c_str());
+
+						auto it = dir->root->directories.find(buf);
+
+						if (it != dir->root->directories.end() && it->second->next > now + dir->interval)
+						{
+							it->second->interval = dir->interval;
+							scheduleDirectory(watcher, it->second, now + dir->interval);
+						}
+					}
+				}
+				else
+					dir->interval = std::min(dir->interval * 2, std::chrono::seconds(kWatchPollMaxInterval));
+
+				scheduleDirectory(watcher, dir, now + dir->interval);
+			}
+		}
+
+		std::sort(changes.begin(), changes.end());
+		changes.erase(std::unique(changes.begin(), changes.end()), changes.end());
+
+		for (auto& c: changes)
+			c.first->callback(c.second.c_str());
+
+		changes.clear();
+	}
+}
+
+static PollWatcher* getPollWatcher()
+{
+	static std::mutex mutex;
+	static PollWatcher* watcher;
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	if (!watcher)
+	{
+		// the watcher is shared by all projects and lives until the process exits
+		watcher = new PollWatcher;
+
+		std::thread(watchPolling, watcher).detach();
+	}
+
+	return watcher;
+}
+
+bool watchDirectoryPolling(const char* path, const std::function<void (const char* name)>& callback, const std::function<bool (const char* name)>& directoryFilter, uint64_t reportSince)
+{
+	PollWatcher* watcher = getPollWatcher();
+
+	PollChanges changes;
+
+	{
+		std::unique_lock<std::mutex> lock(watcher->mutex);
+
+		PollRoot* root = new PollRoot { path, callback, directoryFilter };
+		watcher->roots.emplace_back(root);
+
+		addDirectoryRec(watcher, root, "", reportSince, changes);
+
+		// the root couldn't be listed so nothing was scheduled for it; the poll thread must not keep a dead entry
+		if (root->directories.empty())
+		{
+			watcher->roots.pop_back();
+			return false;
+		}
+	}
+
+	for (auto& c: changes)
+		c.first->callback(c.second.c_str());
+
+	return true;
+}
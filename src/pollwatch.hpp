@@ -0,0 +1,9 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <functional>
+
+// Starts watching the folder by periodically listing its directories, for file systems that don't support change notifications
+// Files modified after reportSince are reported right away; the callback is called with paths relative to the folder from a shared polling thread
+// Directories rejected by the filter are not polled; the filter is called with paths relative to the folder from the same thread
+bool watchDirectoryPolling(const char* path, const std::function<void (const char* name)>& callback, const std::function<bool (const char* name)>& directoryFilter, uint64_t reportSince = ~0ull);
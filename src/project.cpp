@@ -6,6 +6,10 @@
 #include "fileutil.hpp"
 #include "stringutil.hpp"
 #include "regex.hpp"
+#include "pathfilter.hpp"
+#include "gitindex.hpp"
+#include "scancache.hpp"
+#include "ignorefiles.hpp"
 
 #include <fstream>
 #include <memory>
@@ -14,6 +18,8 @@
 #include <map>
 #include <string>
 
+#include <stdlib.h>
+
 static std::string getHomePath()
 {
     char* qghome = getenv("QGREP_HOME");
@@ -157,29 +163,124 @@ static std::shared_ptr<Regex> createRegexCached(const std::string& query, std::m
 	return p.first->second;
 }
 
-static std::shared_ptr<Regex> createOrRegexCached(const std::vector<std::string>& list, std::map<std::string, std::shared_ptr<Regex>>& regexCache)
+static std::unique_ptr<ProjectGroup> buildGroup(std::unique_ptr<ProjectGroup> group, const std::vector<std::string>& include, const std::vector<std::string>& exclude)
 {
-	if (list.empty()) return std::shared_ptr<Regex>();
-	
-	std::string re = "(" + list[0] + ")";
+	group->include = include;
+	group->exclude = exclude;
+
+	return group;
+}
+
+static void buildGroupFiltersRec(ProjectGroup* group)
+{
+	group->filter.reset(new PathFilter());
 
-	for (size_t i = 1; i < list.size(); ++i)
-		re += "|(" + list[i] + ")";
+	for (ProjectGroup* g = group; g; g = g->parent)
+	{
+		if (!g->include.empty())
+			group->filter->addInclude(g->include);
 
-	return createRegexCached(re, regexCache);
+		if (!g->exclude.empty())
+			group->filter->addExclude(g->exclude);
+	}
+
+	group->filter->compile();
+
+	for (auto& child: group->groups)
+		buildGroupFiltersRec(child.get());
 }
 
-static std::unique_ptr<ProjectGroup> buildGroup(std::unique_ptr<ProjectGroup> group, const std::vector<std::string>& include, const std::vector<std::string>& exclude,
-	std::map<std::string, std::shared_ptr<Regex>>& regexCache)
+static void buildGroupFolderFiltersRec(ProjectGroup* group, bool ignoreFiles)
 {
-	group->include = createOrRegexCached(include, regexCache);
-	group->exclude = createOrRegexCached(exclude, regexCache);
+	if (ignoreFiles)
+		for (auto& path: group->paths)
+			group->ignoreFiles[path] = std::make_shared<IgnoreFiles>(path.c_str());
 
-	return group;
+	for (auto& path: group->gitPaths)
+	{
+		std::shared_ptr<GitIndex> index = std::make_shared<GitIndex>();
+
+		if (!readGitIndex(path.c_str(), *index))
+			index.reset();
+
+		group->ignoreFiles[path] = std::make_shared<IgnoreFiles>(path.c_str());
+		group->gitIndexes[path] = index;
+	}
+
+	for (auto& child: group->groups)
+		buildGroupFolderFiltersRec(child.get(), ignoreFiles);
+}
+
+static bool parseBoolOption(const std::string& value)
+{
+	if (value.empty() || value == "on" || value == "true")
+		return true;
+	else if (value == "off" || value == "false")
+		return false;
+	else
+		throw std::runtime_error("Invalid option value " + value);
+}
+
+static ProjectCompression parseCompressionOption(const std::string& value)
+{
+	if (value == "lz4")
+		return PC_LZ4;
+	else if (value == "none")
+		return PC_NONE;
+	else
+		throw std::runtime_error("Invalid compression " + value);
+}
+
+static int parseLevelOption(const std::string& value)
+{
+	char* end = nullptr;
+	long result = strtol(value.c_str(), &end, 10);
+
+	if (value.empty() || *end || result < -64 || result > 12)
+		throw std::runtime_error("Invalid compression level " + value + ", expected a number between -64 and 12");
+
+	return int(result);
+}
+
+static double parseRateOption(const std::string& value)
+{
+	char* end = nullptr;
+	double result = strtod(value.c_str(), &end);
+
+	if (value.empty() || *end || !(result > 0 && result < 1))
+		throw std::runtime_error("Invalid rate " + value + ", expected a number between 0 and 1");
+
+	return result;
+}
+
+static void parseOption(ProjectOptions& options, const std::string& option)
+{
+	std::string::size_type space = option.find_first_of(" \t");
+	std::string name = option.substr(0, space);
+	std::string value = (space == std::string::npos) ? "" : trim(option.substr(space));
+
+	if (name.empty())
+		throw std::runtime_error("No option specified");
+	else if (name == "dictionary")
+		options.dictionary = parseBoolOption(value);
+	else if (name == "compression")
+		options.compression = parseCompressionOption(value);
+	else if (name == "compressionlevel")
+		options.compressionLevel = parseLevelOption(value);
+	else if (name == "indexfpr")
+		options.indexFalsePositiveRate = parseRateOption(value);
+	else if (name == "scancache")
+		options.scanCache = parseBoolOption(value);
+	else if (name == "ignorefiles")
+		options.ignoreFiles = parseBoolOption(value);
+	else if (name == "watchpoll")
+		options.watchPolling = parseBoolOption(value);
+	else
+		throw std::runtime_error("Unknown option " + name);
 }
 
 static std::unique_ptr<ProjectGroup> parseGroup(std::ifstream& in, const char* file, unsigned int& lineId, ProjectGroup* parent,
-	std::map<std::string, std::shared_ptr<Regex>>& regexCache, const char* pathBase)
+	std::map<std::string, std::shared_ptr<Regex>>& regexCache, const char* pathBase, ProjectOptions& options)
 {
 	std::string line, suffix;
 	std::vector<std::string> include, exclude;
@@ -200,6 +301,11 @@ static std::unique_ptr<ProjectGroup> parseGroup(std::ifstream& in, const char* f
 			if (suffix.empty()) throw std::runtime_error("No path specified");
 			result->paths.push_back(normalizePath(pathBase, suffix.c_str()));
 		}
+		else if (extractSuffix(line, "git", suffix))
+		{
+			if (suffix.empty()) throw std::runtime_error("No path specified");
+			result->gitPaths.push_back(normalizePath(pathBase, suffix.c_str()));
+		}
 		else if (extractSuffix(line, "file", suffix))
 		{
 			if (suffix.empty()) throw std::runtime_error("No path specified");
@@ -216,11 +322,16 @@ static std::unique_ptr<ProjectGroup> parseGroup(std::ifstream& in, const char* f
 			exclude.push_back(suffix);
 		}
 		else if (extractSuffix(line, "group", suffix))
-			result->groups.push_back(parseGroup(in, file, lineId, result.get(), regexCache, pathBase));
+			result->groups.push_back(parseGroup(in, file, lineId, result.get(), regexCache, pathBase, options));
+		else if (extractSuffix(line, "option", suffix))
+		{
+			if (parent) throw std::runtime_error("Options can not be specified inside groups");
+			parseOption(options, suffix);
+		}
 		else if (extractSuffix(line, "endgroup", suffix))
 		{
 			if (!parent) throw std::runtime_error("Mismatched endgroup");
-			return buildGroup(std::move(result), include, exclude, regexCache);
+			return buildGroup(std::move(result), include, exclude);
 		}
 		else
 		{
@@ -235,10 +346,10 @@ static std::unique_ptr<ProjectGroup> parseGroup(std::ifstream& in, const char* f
 	}
 
 	if (parent) throw std::runtime_error("End of file while looking for endgroup");
-	return buildGroup(std::move(result), include, exclude, regexCache);
+	return buildGroup(std::move(result), include, exclude);
 }
 
-std::unique_ptr<ProjectGroup> parseProject(Output* output, const char* file)
+std::unique_ptr<ProjectGroup> parseProject(Output* output, const char* file, ProjectOptions* options)
 {
 	std::ifstream in(file);
 	if (!in)
@@ -252,10 +363,20 @@ std::unique_ptr<ProjectGroup> parseProject(Output* output, const char* file)
 
 	unsigned int line = 0;
 	std::map<std::string, std::shared_ptr<Regex>> regexCache;
+	ProjectOptions projectOptions;
 
 	try
 	{
-		return parseGroup(in, file, line, 0, regexCache, pathBase.c_str());
+		std::unique_ptr<ProjectGroup> result = parseGroup(in, file, line, 0, regexCache, pathBase.c_str(), projectOptions);
+
+		buildGroupFiltersRec(result.get());
+
+		buildGroupFolderFiltersRec(result.get(), projectOptions.ignoreFiles);
+
+		if (options)
+			*options = projectOptions;
+
+		return result;
 	}
 	catch (const std::exception& e)
 	{
@@ -266,18 +387,7 @@ std::unique_ptr<ProjectGroup> parseProject(Output* output, const char* file)
 
 bool isFileAcceptable(ProjectGroup* group, const char* path)
 {
-	size_t length = strlen(path);
-
-	for (; group; group = group->parent)
-	{
-		if (group->include && !group->include->search(path, length))
-			return false;
-
-		if (group->exclude && group->exclude->search(path, length))
-			return false;
-	}
-
-	return true;
+	return group->filter->isFileAcceptable(path, strlen(path));
 }
 
 // It can help enumeration times massively to be able to stop traversing
@@ -286,18 +396,82 @@ bool isFileAcceptable(ProjectGroup* group, const char* path)
 // names during traversal.
 bool isDirectoryAcceptable(ProjectGroup* group, const char* path)
 {
-	size_t length = strlen(path);
+	return group->filter->isDirectoryAcceptable(path, strlen(path));
+}
+
+static const char* getFolderRelativePath(const std::string& folder, const std::string& path)
+{
+	if (path.size() <= folder.size() || path.compare(0, folder.size(), folder) != 0)
+		return nullptr;
 
-	for (; group; group = group->parent)
-	{
-		if (group->exclude && group->exclude->search(path, length))
-			return false;
-	}
+	// folder paths are normalized so only the root folder ends with a slash
+	if (folder.back() == '/' || folder.back() == '\\')
+		return path.c_str() + folder.size();
+
+	return (path[folder.size()] == '/' || path[folder.size()] == '\\') ? path.c_str() + folder.size() + 1 : nullptr;
+}
+
+static bool isGitPathTracked(const GitIndex& index, const char* path, bool directory)
+{
+	return directory ? isGitIndexDirectory(index, path) : isGitIndexFile(index, path);
+}
+
+static const GitIndex* getGitIndex(ProjectGroup* group, const std::string& folder)
+{
+	auto it = group->gitIndexes.find(folder);
+
+	return it != group->gitIndexes.end() ? it->second.get() : nullptr;
+}
+
+bool isPathIgnored(ProjectGroup* group, const std::string& folder, const std::string& path, bool directory)
+{
+	auto it = group->ignoreFiles.find(folder);
+
+	if (it == group->ignoreFiles.end() || !it->second->isPathIgnored(path, directory))
+		return false;
+
+	// tracked files and directories with tracked files are never ignored in git folders, same as in git
+	const GitIndex* index = getGitIndex(group, folder);
+	const char* relpath = getFolderRelativePath(folder, path);
+
+	return !index || !relpath || !isGitPathTracked(*index, relpath, directory);
+}
+
+void resetIgnoreFiles(ProjectGroup* group)
+{
+	for (auto& p: group->ignoreFiles)
+		p.second->reset();
+
+	for (auto& child: group->groups)
+		resetIgnoreFiles(child.get());
+}
+
+bool isFileInProject(ProjectGroup* group, const std::string& path)
+{
+	for (auto& file: group->files)
+		if (file == path)
+			return true;
+
+	// include/exclude rules are matched against folder-relative paths, same as during the scan
+	for (auto& folder: group->paths)
+		if (const char* relpath = getFolderRelativePath(folder, path))
+			if (isFileAcceptable(group, relpath) && !isPathIgnored(group, folder, path, false))
+				return true;
+
+	// git folders that don't have an index are skipped by the scan
+	for (auto& folder: group->gitPaths)
+		if (const char* relpath = getFolderRelativePath(folder, path))
+			if (getGitIndex(group, folder) && isFileAcceptable(group, relpath) && !isPathIgnored(group, folder, path, false))
+				return true;
 
-	return true;
+	for (auto& child: group->groups)
+		if (isFileInProject(child.get(), path))
+			return true;
+
+	return false;
 }
 
-static void getProjectGroupFilesRec(Output* output, ProjectGroup* group, std::vector<FileInfo>& files)
+static void getProjectGroupFilesRec(Output* output, ProjectGroup* group, std::vector<FileInfo>& files, const ProjectOptions& options, const EnumerateDirectoryFunction& enumerate)
 {
 	for (auto& path: group->files)
 	{
@@ -311,30 +485,88 @@ static void getProjectGroupFilesRec(Output* output, ProjectGroup* group, std::ve
 
 	for (auto& folder: group->paths)
 	{
-		std::string buf;
+		// each scan thread collects its own results so that we don't need to synchronize
+		std::vector<std::vector<FileInfo>> workerFiles(kScanWorkerCount);
+
+		// ignored directories are pruned during enumeration so that the scan never descends into them
+		IgnoreFiles ignore(folder.c_str());
 
-		bool result = traverseDirectory(folder.c_str(), [&](const char* path, uint64_t mtime, uint64_t size) {
+		EnumerateDirectoryFunction ignoreEnumerate = [&](const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback) {
+			return ignore.enumerate(enumerate, path, fileCallback, directoryCallback);
+		};
+
+		bool result = traverseDirectoryParallel(folder.c_str(), kScanWorkerCount, [&](unsigned int worker, const char* path, uint64_t mtime, uint64_t size) {
 			if (isFileAcceptable(group, path))
 			{
+				std::string buf;
 				joinPaths(buf, folder.c_str(), path);
-				files.push_back({ buf, mtime, size });
+				workerFiles[worker].push_back({ std::move(buf), mtime, size });
 			}
 			}, [&](const char* path) {
 				return isDirectoryAcceptable(group, path);
-			});
+			}, options.ignoreFiles ? ignoreEnumerate : enumerate);
 
 		if (!result) output->error("Error reading folder %s\n", folder.c_str());
+
+		for (auto& wf: workerFiles)
+			files.insert(files.end(), std::make_move_iterator(wf.begin()), std::make_move_iterator(wf.end()));
+	}
+
+	for (auto& folder: group->gitPaths)
+	{
+		const GitIndex* index = getGitIndex(group, folder);
+
+		if (!index)
+		{
+			output->error("Error reading git index for folder %s\n", folder.c_str());
+			continue;
+		}
+
+		std::vector<std::vector<FileInfo>> workerFiles(kScanWorkerCount);
+
+		// tracked files and untracked files that git doesn't ignore are included; ignored directories are only scanned for tracked files,
+		// so build outputs and dependencies are skipped
+		IgnoreFiles ignore(folder.c_str(), [&](const std::string& path, bool directory) {
+			const char* relpath = getFolderRelativePath(folder, path);
+
+			return relpath && isGitPathTracked(*index, relpath, directory);
+		});
+
+		EnumerateDirectoryFunction ignoreEnumerate = [&](const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback) {
+			return ignore.enumerate(enumerate, path, fileCallback, directoryCallback);
+		};
+
+		bool result = traverseDirectoryParallel(folder.c_str(), kScanWorkerCount, [&](unsigned int worker, const char* path, uint64_t mtime, uint64_t size) {
+			if (isFileAcceptable(group, path))
+			{
+				std::string buf;
+				joinPaths(buf, folder.c_str(), path);
+				workerFiles[worker].push_back({ std::move(buf), mtime, size });
+			}
+			}, [&](const char* path) {
+				return isDirectoryAcceptable(group, path);
+			}, ignoreEnumerate);
+
+		if (!result) output->error("Error reading folder %s\n", folder.c_str());
+
+		for (auto& wf: workerFiles)
+			files.insert(files.end(), std::make_move_iterator(wf.begin()), std::make_move_iterator(wf.end()));
 	}
 
 	for (auto& child: group->groups)
-		getProjectGroupFilesRec(output, child.get(), files);
+		getProjectGroupFilesRec(output, child.get(), files, options, enumerate);
 }
 
-std::vector<FileInfo> getProjectGroupFiles(Output* output, ProjectGroup* group)
+std::vector<FileInfo> getProjectGroupFiles(Output* output, ProjectGroup* group, const ProjectOptions& options, ScanCache* cache)
 {
 	std::vector<FileInfo> files;
-	
-	getProjectGroupFilesRec(output, group, files);
+
+	if (cache)
+		getProjectGroupFilesRec(output, group, files, options, [&](const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback) {
+			return scanCacheEnumerateDirectory(cache, path, fileCallback, directoryCallback);
+		});
+	else
+		getProjectGroupFilesRec(output, group, files, options, enumerateDirectory);
 
 	std::sort(files.begin(), files.end(), [](const FileInfo& l, const FileInfo& r) { return l.path < r.path; });
 	files.erase(std::unique(files.begin(), files.end(), [](const FileInfo& l, const FileInfo& r) { return l.path == r.path; }), files.end());
@@ -1,12 +1,17 @@
 // This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
 #pragma once
 
+#include "constants.hpp"
+
 #include <string>
 #include <vector>
 #include <memory>
+#include <unordered_map>
 
 class Output;
-class Regex;
+class PathFilter;
+class IgnoreFiles;
+struct GitIndex;
 
 std::string getProjectPath(const char* name);
 std::string getProjectName(const char* path);
@@ -19,15 +24,67 @@ struct ProjectGroup
 	ProjectGroup* parent;
 
 	std::vector<std::string> paths;
+	std::vector<std::string> gitPaths;
 	std::vector<std::string> files;
-	std::shared_ptr<Regex> include;
-	std::shared_ptr<Regex> exclude;
+	std::vector<std::string> include;
+	std::vector<std::string> exclude;
+
+	// include/exclude rules of this group and all its parents
+	std::shared_ptr<PathFilter> filter;
+
+	// ignore files by folder path; git folders always use them, path folders only if the ignorefiles option is set
+	std::unordered_map<std::string, std::shared_ptr<IgnoreFiles>> ignoreFiles;
+
+	// index of each git folder as of parsing the project, or null if it couldn't be read
+	std::unordered_map<std::string, std::shared_ptr<GitIndex>> gitIndexes;
 
 	std::vector<std::unique_ptr<ProjectGroup>> groups;
 };
 
-std::unique_ptr<ProjectGroup> parseProject(Output* output, const char* file);
+enum ProjectCompression
+{
+	PC_LZ4,
+	PC_NONE,
+};
+
+struct ProjectOptions
+{
+	// compress chunks using a dictionary trained on project contents
+	bool dictionary;
+
+	// chunk data compression; uncompressed chunks take more space but are faster to search
+	ProjectCompression compression;
+
+	// LZ4 compression level, see kFileDataCompressionLevel
+	int compressionLevel;
+
+	// target false positive rate of chunk index; smaller rates make index larger but skip more chunks during search
+	double indexFalsePositiveRate;
+
+	// skip enumerating directories that didn't change since the last update; files modified in place are only detected via change list
+	bool scanCache;
+
+	// skip files and directories matched by .gitignore/.ignore files in path folders
+	bool ignoreFiles;
+
+	// watch folders by polling directory listings instead of using file system notifications, e.g. for network shares
+	bool watchPolling;
+
+	ProjectOptions(): dictionary(false), compression(PC_LZ4), compressionLevel(kFileDataCompressionLevel), indexFalsePositiveRate(kIndexFalsePositiveRate), scanCache(false), ignoreFiles(false), watchPolling(false)
+	{
+	}
+};
+
+std::unique_ptr<ProjectGroup> parseProject(Output* output, const char* file, ProjectOptions* options = nullptr);
 bool isFileAcceptable(ProjectGroup* group, const char* path);
+bool isDirectoryAcceptable(ProjectGroup* group, const char* path);
+
+// Checks files and directories of the group folders that are reported outside of the scan, e.g. by watchers and change lists
+bool isPathIgnored(ProjectGroup* group, const std::string& folder, const std::string& path, bool directory);
+void resetIgnoreFiles(ProjectGroup* group);
+
+// Checks if the scan would find the file in one of the project folders without scanning them; the file doesn't need to exist
+bool isFileInProject(ProjectGroup* group, const std::string& path);
 
 struct FileInfo
 {
@@ -36,4 +93,6 @@ struct FileInfo
 	uint64_t fileSize;
 };
 
-std::vector<FileInfo> getProjectGroupFiles(Output* output, ProjectGroup* group);
+struct ScanCache;
+
+std::vector<FileInfo> getProjectGroupFiles(Output* output, ProjectGroup* group, const ProjectOptions& options, ScanCache* cache = nullptr);
@@ -5,6 +5,7 @@
 #include "casefold.hpp"
 
 #include "re2/re2.h"
+#include "re2/set.h"
 #include "re2/prefilter.h"
 #include "re2/prefilter_tree.h"
 
@@ -375,6 +376,49 @@ private:
 	}
 };
 
+class RE2RegexSet: public RegexSet
+{
+public:
+	RE2RegexSet(const std::vector<std::string>& patterns, unsigned int options): set(getOptions(options), RE2::UNANCHORED)
+	{
+		for (auto& p: patterns)
+		{
+			std::string error;
+
+			if (set.Add(p, &error) < 0)
+				throw std::runtime_error("Error parsing regular expression " + p + ": " + error);
+		}
+
+		if (!set.Compile())
+			throw std::runtime_error("Error compiling regular expression set");
+	}
+
+	virtual void match(const char* data, size_t size, std::vector<int>& matches)
+	{
+		matches.clear();
+
+		set.Match(re2::StringPiece(data, size), &matches);
+	}
+
+private:
+	RE2::Set set;
+
+	static RE2::Options getOptions(unsigned int options)
+	{
+		RE2::Options opts;
+		opts.set_posix_syntax(true);
+		opts.set_perl_classes(true);
+		opts.set_word_boundary(true);
+		opts.set_one_line(false);
+		opts.set_never_nl(true);
+		opts.set_literal((options & RO_LITERAL) != 0);
+		opts.set_case_sensitive((options & RO_IGNORECASE) == 0);
+		opts.set_log_errors(false);
+
+		return opts;
+	}
+};
+
 RegexMatch::RegexMatch(): data(0), size(0)
 {
 }
@@ -392,3 +436,8 @@ Regex* createRegex(const char* pattern, unsigned int options)
 {
 	return new RE2Regex(pattern, options);
 }
+
+RegexSet* createRegexSet(const std::vector<std::string>& patterns, unsigned int options)
+{
+	return new RE2RegexSet(patterns, options);
+}
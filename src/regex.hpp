@@ -36,4 +36,14 @@ public:
 	virtual bool prefilterMatch(const std::vector<int>& matches) = 0;
 };
 
-Regex* createRegex(const char* pattern, unsigned int options);
\ No newline at end of file
+class RegexSet
+{
+public:
+	virtual ~RegexSet() {}
+
+	// Finds indices of all patterns that match the string
+	virtual void match(const char* data, size_t size, std::vector<int>& matches) = 0;
+};
+
+Regex* createRegex(const char* pattern, unsigned int options);
+RegexSet* createRegexSet(const std::vector<std::string>& patterns, unsigned int options);
\ No newline at end of file
@@ -0,0 +1,362 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "scancache.hpp"
+
+#include "fileutil.hpp"
+#include "filestream.hpp"
+#include "format.hpp"
+#include "output.hpp"
+#include "project.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <string.h>
+
+struct ScanCacheDirectory
+{
+	uint64_t timeStamp;
+
+	std::vector<ScanCacheFileEntry> files;
+	std::vector<uint32_t> directories;
+	std::vector<char> names;
+
+	bool visited;
+};
+
+struct ScanCache
+{
+	std::unordered_map<std::string, ScanCacheDirectory> directories;
+
+	// directories that were not in the cache; the map can't be modified during the scan since it's accessed from multiple threads
+	std::mutex addedMutex;
+	std::vector<std::pair<std::string, ScanCacheDirectory>> added;
+
+	// directories modified after this time may be modified again without changing the timestamp
+	uint64_t racyTimeStamp;
+};
+
+static bool readDirectory(const char*& data, const char* end, std::string& path, ScanCacheDirectory& result)
+{
+	ScanCacheDirectoryHeader header;
+
+	if (size_t(end - data) < sizeof(header))
+		return false;
+
+	memcpy(&header, data, sizeof(header));
+	data += sizeof(header);
+
+	size_t size = header.pathLength + header.fileCount * sizeof(ScanCacheFileEntry) + header.directoryCount * sizeof(uint32_t) + header.nameBufferLength;
+
+	if (size_t(end - data) < size)
+		return false;
+
+	path.assign(data, header.pathLength);
+	data += header.pathLength;
+
+	result.timeStamp = header.timeStamp;
+	result.visited = false;
+
+	result.files.resize(header.fileCount);
+	memcpy(result.files.data(), data, header.fileCount * sizeof(ScanCacheFileEntry));
+	data += header.fileCount * sizeof(ScanCacheFileEntry);
+
+	result.directories.resize(header.directoryCount);
+	memcpy(result.directories.data(), data, header.directoryCount * sizeof(uint32_t));
+	data += header.directoryCount * sizeof(uint32_t);
+
+	result.names.assign(data, data + header.nameBufferLength);
+	data += header.nameBufferLength;
+
+	// make sure all names are in bounds and terminated
+	if (!result.names.empty() && result.names.back() != 0)
+		return false;
+
+	for (auto& f: result.files)
+		if (f.nameOffset >= result.names.size())
+			return false;
+
+	for (auto& d: result.directories)
+		if (d >= result.names.size())
+			return false;
+
+	return true;
+}
+
+static void readCache(ScanCache* cache, const char* path)
+{
+	FileMapping mapping(path);
+	if (!mapping)
+		return;
+
+	const char* data = mapping.data();
+	const char* end = data + mapping.size();
+
+	ScanCacheHeader header;
+
+	if (mapping.size() < sizeof(header))
+		return;
+
+	memcpy(&header, data, sizeof(header));
+	data += sizeof(header);
+
+	if (memcmp(header.magic, kScanCacheHeaderMagic, strlen(kScanCacheHeaderMagic)) != 0)
+		return;
+
+	std::string dirpath;
+
+	for (unsigned int i = 0; i < header.directoryCount; ++i)
+	{
+		ScanCacheDirectory dir;
+
+		if (!readDirectory(data, end, dirpath, dir))
+		{
+			// the cache is corrupted, fall back to a full scan
+			cache->directories.clear();
+			return;
+		}
+
+		cache->directories[dirpath] = std::move(dir);
+	}
+}
+
+static void writeDirectory(FileStream& out, const std::string& path, const ScanCacheDirectory& dir)
+{
+	ScanCacheDirectoryHeader header = {};
+	header.timeStamp = dir.timeStamp;
+	header.pathLength = path.size();
+	header.fileCount = dir.files.size();
+	header.directoryCount = dir.directories.size();
+	header.nameBufferLength = dir.names.size();
+
+	out.write(&header, sizeof(header));
+	out.write(path.data(), path.size());
+	out.write(dir.files.data(), dir.files.size() * sizeof(ScanCacheFileEntry));
+	out.write(dir.directories.data(), dir.directories.size() * sizeof(uint32_t));
+	out.write(dir.names.data(), dir.names.size());
+}
+
+ScanCache* scanCacheStart(const char* path, bool rescan)
+{
+	ScanCache* cache = new ScanCache;
+	cache->racyTimeStamp = getCurrentTimeStamp(1);
+
+	if (!rescan)
+		readCache(cache, replaceExtension(path, ".qgt").c_str());
+
+	return cache;
+}
+
+bool scanCacheFinish(Output* output, ScanCache* cache, const char* path)
+{
+	std::string targetPath = replaceExtension(path, ".qgt");
+	std::string tempPath = targetPath + "_";
+
+	bool result = false;
+
+	{
+		FileStream out(tempPath.c_str(), "wb");
+
+		if (out)
+		{
+			unsigned int count = cache->added.size();
+
+			for (auto& d: cache->directories)
+				count += d.second.visited;
+
+			ScanCacheHeader header = {};
+			memcpy(header.magic, kScanCacheHeaderMagic, strlen(kScanCacheHeaderMagic));
+			header.directoryCount = count;
+
+			out.write(&header, sizeof(header));
+
+			// directories that were not visited during the scan are no longer a part of the project
+			for (auto& d: cache->directories)
+				if (d.second.visited)
+					writeDirectory(out, d.first, d.second);
+
+			for (auto& d: cache->added)
+				writeDirectory(out, d.first, d.second);
+
+			result = true;
+		}
+	}
+
+	delete cache;
+
+	if (!result || !renameFile(tempPath.c_str(), targetPath.c_str()))
+	{
+		output->error("Error saving scan cache %s\n", targetPath.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool scanCacheEnumerateDirectory(ScanCache* cache, const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback)
+{
+	uint64_t timeStamp, size;
+	if (!getFileAttributes(path, &timeStamp, &size))
+		return false;
+
+	auto it = cache->directories.find(path);
+
+	// the directory contents only changes if the directory timestamp changes; each directory is only visited once per scan so we can mark it without a lock
+	if (it != cache->directories.end() && it->second.timeStamp == timeStamp)
+	{
+		ScanCacheDirectory& dir = it->second;
+
+		dir.visited = true;
+
+		for (auto& f: dir.files)
+			fileCallback(&dir.names[f.nameOffset], f.timeStamp, f.fileSize);
+
+		for (auto& d: dir.directories)
+			directoryCallback(&dir.names[d]);
+
+		return true;
+	}
+
+	ScanCacheDirectory dir;
+	dir.timeStamp = timeStamp < cache->racyTimeStamp ? timeStamp : 0;
+	dir.visited = true;
+
+	bool result = enumerateDirectory(path, [&](const char* name, uint64_t mtime, uint64_t size) {
+		ScanCacheFileEntry entry = { mtime, size, uint32_t(dir.names.size()) };
+		dir.files.push_back(entry);
+		dir.names.insert(dir.names.end(), name, name + strlen(name) + 1);
+
+		fileCallback(name, mtime, size);
+	}, [&](const char* name) {
+		dir.directories.push_back(dir.names.size());
+		dir.names.insert(dir.names.end(), name, name + strlen(name) + 1);
+
+		directoryCallback(name);
+	});
+
+	if (!result)
+		return false;
+
+	if (it != cache->directories.end())
+	{
+		it->second = std::move(dir);
+	}
+	else
+	{
+		std::unique_lock<std::mutex> lock(cache->addedMutex);
+
+		cache->added.emplace_back(path, std::move(dir));
+	}
+
+	return true;
+}
+
+static void updateCachedFile(ScanCache* cache, const FileInfo& file)
+{
+	std::string::size_type slash = file.path.find_last_of('/');
+	if (slash == std::string::npos)
+		return;
+
+	std::string dirpath = file.path.substr(0, slash);
+	const char* name = file.path.c_str() + slash + 1;
+
+	ScanCacheDirectory* dir = nullptr;
+
+	auto it = cache->directories.find(dirpath);
+
+	if (it != cache->directories.end())
+		dir = &it->second;
+	else
+	{
+		for (auto& d: cache->added)
+			if (d.first == dirpath)
+				dir = &d.second;
+	}
+
+	if (!dir)
+		return;
+
+	for (auto& f: dir->files)
+		if (strcmp(&dir->names[f.nameOffset], name) == 0)
+		{
+			f.timeStamp = file.timeStamp;
+			f.fileSize = file.fileSize;
+		}
+}
+
+void scanCacheInvalidateFiles(Output* output, const char* path, const std::vector<std::string>& files)
+{
+	std::string targetPath = replaceExtension(path, ".qgi");
+
+	FileStream out(targetPath.c_str(), "ab");
+	if (!out)
+	{
+		output->error("Error saving scan cache %s\n", targetPath.c_str());
+		return;
+	}
+
+	for (auto& f: files)
+	{
+		out.write(f.data(), f.size());
+		out.write("\n", 1);
+	}
+}
+
+static std::vector<std::string> readInvalidatedFiles(const char* path)
+{
+	std::vector<std::string> result;
+
+	FileMapping mapping(replaceExtension(path, ".qgi").c_str());
+
+	if (mapping)
+	{
+		const char* data = mapping.data();
+		const char* end = data + mapping.size();
+
+		while (data < end)
+		{
+			const char* line = std::find(data, end, '\n');
+
+			result.emplace_back(data, line);
+			data = (line == end) ? line : line + 1;
+		}
+	}
+
+	return result;
+}
+
+std::vector<FileInfo> scanProjectFiles(Output* output, const char* path, ProjectGroup* group, const ProjectOptions& options, bool rescan, const std::vector<std::string>& changes)
+{
+	if (!options.scanCache)
+	{
+		// the cache can't be trusted after files were modified while it was disabled
+		removeFile(replaceExtension(path, ".qgt").c_str());
+		removeFile(replaceExtension(path, ".qgi").c_str());
+
+		return getProjectGroupFiles(output, group, options);
+	}
+
+	ScanCache* cache = scanCacheStart(path, rescan);
+
+	std::vector<FileInfo> files = getProjectGroupFiles(output, group, options, cache);
+
+	// files that were modified in place don't change the directory timestamp; the change list and the invalidation list track them
+	std::vector<std::string> modified = readInvalidatedFiles(path);
+	modified.insert(modified.end(), changes.begin(), changes.end());
+
+	for (auto& m: modified)
+	{
+		auto it = std::lower_bound(files.begin(), files.end(), m, [](const FileInfo& l, const std::string& r) { return l.path < r; });
+
+		if (it != files.end() && it->path == m && getFileAttributes(m.c_str(), &it->timeStamp, &it->fileSize))
+			updateCachedFile(cache, *it);
+	}
+
+	if (scanCacheFinish(output, cache, path))
+		removeFile(replaceExtension(path, ".qgi").c_str());
+
+	return files;
+}
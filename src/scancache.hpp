@@ -0,0 +1,28 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+class Output;
+
+struct ScanCache;
+struct ProjectGroup;
+struct ProjectOptions;
+struct FileInfo;
+
+// Loads the directory cache of the project; with rescan, existing cache contents is ignored and all directories are enumerated
+ScanCache* scanCacheStart(const char* path, bool rescan);
+
+// Saves the directories enumerated since the cache was started and destroys the cache
+bool scanCacheFinish(Output* output, ScanCache* cache, const char* path);
+
+// Same as enumerateDirectory, but reuses the cached directory contents if the directory modification time did not change
+bool scanCacheEnumerateDirectory(ScanCache* cache, const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback);
+
+// Marks files as modified so that the next scan refreshes their metadata even if their directory didn't change
+void scanCacheInvalidateFiles(Output* output, const char* path, const std::vector<std::string>& files);
+
+// Returns all project files, using the directory cache if it's enabled in project options
+std::vector<FileInfo> scanProjectFiles(Output* output, const char* path, ProjectGroup* group, const ProjectOptions& options, bool rescan, const std::vector<std::string>& changes);
@@ -17,13 +17,147 @@
 #include "highlight.hpp"
 #include "compression.hpp"
 #include "changes.hpp"
+#include "overlay.hpp"
+#include "project.hpp"
 
 #include <algorithm>
 #include <memory>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+
+struct DuplicateMatch
+{
+	unsigned int line;
+	size_t matchOffset;
+	size_t matchLength;
+
+	std::string text;
+	std::string preparedText;
+};
+
+// Duplicate files reuse the matches from the original file; since the original file is stored in one of the earlier
+// chunks, the duplicate has to wait for all chunks that can contain the original file to be processed
+class DuplicateTable
+{
+public:
+	// chunks list the content hashes of the originals their duplicates reference, so the matches are only kept while they can be used
+	void addReference(uint64_t contentHash)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		references[contentHash]++;
+	}
+
+	unsigned int addChunk(const char* lastFile, size_t lastFileLength, const char* duplicateHashes, size_t duplicateCount)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		chunkLastFiles.push_back(std::string(lastFile, lastFileLength));
+		chunkDuplicateHashes.push_back(std::vector<uint64_t>(duplicateCount));
+
+		// hashes follow the path in extra data so they aren't aligned
+		if (duplicateCount)
+			memcpy(chunkDuplicateHashes.back().data(), duplicateHashes, duplicateCount * sizeof(uint64_t));
+		chunkProcessed.push_back(false);
+
+		return chunkLastFiles.size() - 1;
+	}
+
+	void finishChunk(unsigned int chunk)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		assert(chunk < chunkProcessed.size());
+		chunkProcessed[chunk] = true;
+
+		// the last chunk that references the original is done, so its matches are no longer needed
+		for (uint64_t hash: chunkDuplicateHashes[chunk])
+		{
+			auto it = references.find(hash);
+
+			if (it != references.end() && --it->second == 0)
+			{
+				references.erase(it);
+
+				auto begin = matches.lower_bound(std::make_pair(hash, std::string()));
+				auto end = begin;
+
+				while (end != matches.end() && end->first.first == hash)
+					++end;
+
+				matches.erase(begin, end);
+			}
+		}
+
+		chunkDuplicateHashes[chunk].clear();
+
+		chunkProcessedChanged.notify_all();
+	}
+
+	void addMatches(uint64_t contentHash, const std::string& path, std::vector<DuplicateMatch>& fileMatches)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		if (fileMatches.empty() || references.count(contentHash) == 0)
+			return;
+
+		std::vector<DuplicateMatch>& result = matches[std::make_pair(contentHash, path)];
+		result.insert(result.end(), std::make_move_iterator(fileMatches.begin()), std::make_move_iterator(fileMatches.end()));
+	}
+
+	std::vector<DuplicateMatch> getMatches(unsigned int chunk, uint64_t contentHash, const std::string& path)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		// chunks are sorted by the last file path, so the first chunk that can contain the file is the first chunk with last file >= path
+		size_t first = std::lower_bound(chunkLastFiles.begin(), chunkLastFiles.begin() + chunk, path) - chunkLastFiles.begin();
+
+		for (size_t i = first; i < chunk; ++i)
+			chunkProcessedChanged.wait(lock, [&]() { return chunkProcessed[i]; });
+
+		auto it = matches.find(std::make_pair(contentHash, path));
+
+		return it == matches.end() ? std::vector<DuplicateMatch>() : it->second;
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable chunkProcessedChanged;
+
+	std::vector<std::string> chunkLastFiles;
+	std::vector<std::vector<uint64_t>> chunkDuplicateHashes;
+	std::vector<bool> chunkProcessed;
+
+	std::unordered_map<uint64_t, unsigned int> references;
+	std::map<std::pair<uint64_t, std::string>, std::vector<DuplicateMatch>> matches;
+};
+
+struct DeltaFilePart
+{
+	const char* data;
+	size_t size;
+	unsigned int startLine;
+
+	uint64_t timeStamp;
+	uint64_t fileSize;
+};
+
+// Delta segment contains files that changed after the base data file was built; it's small so it's kept in memory in its entirety
+struct DeltaSegment
+{
+	std::vector<std::unique_ptr<char[]>> chunks;
+
+	// removed files don't have any parts
+	std::map<std::string, std::vector<DeltaFilePart>> files;
+};
+
+class NgramRegex;
 
 struct SearchOutput
 {
-	SearchOutput(Output* output, unsigned int options, unsigned int limit): options(options), limit(limit), output(output, kMaxBufferedOutput, kBufferedOutputFlushThreshold, limit)
+	SearchOutput(Output* output, unsigned int options, unsigned int limit): options(options), limit(limit), output(output, kMaxBufferedOutput, kBufferedOutputFlushThreshold, limit), ngregex(nullptr)
 	{
 	}
 
@@ -35,6 +169,10 @@ struct SearchOutput
 	unsigned int options;
 	unsigned int limit;
 	OrderedOutput output;
+	DuplicateTable duplicates;
+	std::vector<char> dictionary;
+	DeltaSegment delta;
+	const NgramRegex* ngregex;
 };
 
 struct HighlightBuffer
@@ -147,7 +285,7 @@ static void processMatch(Regex* re, SearchOutput* output, OrderedOutput::Chunk*
 }
 
 static void processFileData(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf,
-	const char* path, size_t pathLength, const char* data, size_t size, unsigned int startLine)
+	const char* path, size_t pathLength, const char* data, size_t size, unsigned int startLine, std::vector<DuplicateMatch>* duplicateMatches = nullptr)
 {
 	const char* range = re->rangePrepare(data, size);
 
@@ -167,8 +305,17 @@ static void processFileData(Regex* re, SearchOutput* output, OrderedOutput::Chun
 		// print match
 		const char* lbeg = findLineStart(begin, match.data);
 		const char* lend = findLineEnd(match.data + match.size, end);
-		processMatch(re, output, outputChunk, hlbuf, path, pathLength, (lbeg - range) + data, lend - lbeg, line, lbeg, match.data - lbeg, match.size);
-		
+
+		if (duplicateMatches)
+		{
+			DuplicateMatch dm = { line, size_t(match.data - lbeg), match.size, std::string((lbeg - range) + data, lend - lbeg), std::string(lbeg, lend - lbeg) };
+			duplicateMatches->push_back(std::move(dm));
+		}
+
+		// output chunk is null if we only need to remember the matches for duplicate files
+		if (outputChunk)
+			processMatch(re, output, outputChunk, hlbuf, path, pathLength, (lbeg - range) + data, lend - lbeg, line, lbeg, match.data - lbeg, match.size);
+
 		// early-out for big matches
 		if (output->isLimitReached(outputChunk)) break;
 
@@ -215,32 +362,94 @@ static size_t normalizeEOL(char* data, size_t size)
 	return result;
 }
 
-static void processChangedFile(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf, const std::string& path, Regex* includeRe, Regex* excludeRe)
+static bool readChangedFile(const std::string& path, std::unique_ptr<char[]>& data, size_t& size)
 {
-	if (ignorePath(path.c_str(), path.size(), includeRe, excludeRe))
-		return;
-
 	std::unique_ptr<FILE, int(*)(FILE*)> file(openFile(path.c_str(), "rb"), fclose);
 	if (!file)
-		return;
+		return false;
 
 	fseek(file.get(), 0, SEEK_END);
 	size_t length = ftell(file.get());
 	fseek(file.get(), 0, SEEK_SET);
 
-	std::unique_ptr<char[]> data(new (std::nothrow) char[length]);
+	data.reset(new (std::nothrow) char[length]);
 	if (!data)
-		return;
+		return false;
 
 	if (fread(data.get(), 1, length, file.get()) != length)
-		return;
+		return false;
 
 	if (ferror(file.get()) != 0)
+		return false;
+
+	size = normalizeEOL(data.get(), length);
+
+	return true;
+}
+
+static bool matchOverlayFile(const NgramRegex* ngregex, const OverlayFile& file);
+
+static void processOverlayFile(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf, const std::string& path)
+{
+	uint64_t generation;
+	std::shared_ptr<const OverlayFile> file = getOverlayFile(path, &generation);
+
+	uint64_t timeStamp, fileSize;
+	if (!getFileAttributes(path.c_str(), &timeStamp, &fileSize))
+		return;
+
+	// the watcher invalidates files when they change, but it can miss changes (e.g. when polling), so the attributes are checked as well
+	if (!file || file->timeStamp != timeStamp || file->fileSize != fileSize)
+	{
+		std::unique_ptr<char[]> data;
+		size_t size;
+
+		if (!readChangedFile(path, data, size))
+			return;
+
+		file = addOverlayFile(path, generation, std::move(data), size, timeStamp, fileSize);
+	}
+
+	if (output->ngregex && !matchOverlayFile(output->ngregex, *file))
+		return;
+
+	processFileData(re, output, outputChunk, hlbuf, path.c_str(), path.size(), file->data.get(), file->size, 0);
+}
+
+static void processChangedFile(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf, const std::string& path, Regex* includeRe, Regex* excludeRe)
+{
+	if (ignorePath(path.c_str(), path.size(), includeRe, excludeRe))
+		return;
+
+	auto delta = output->delta.files.find(path);
+
+	if (delta != output->delta.files.end())
+	{
+		for (auto& part: delta->second)
+		{
+			// early-out for big matches
+			if (output->isLimitReached(outputChunk))
+				break;
+
+			processFileData(re, output, outputChunk, hlbuf, path.c_str(), path.size(), part.data, part.size, part.startLine);
+		}
+
 		return;
+	}
 
-	size_t nlength = normalizeEOL(data.get(), length);
+	if (isOverlayEnabled())
+	{
+		processOverlayFile(re, output, outputChunk, hlbuf, path);
+		return;
+	}
+
+	std::unique_ptr<char[]> data;
+	size_t size;
+
+	if (!readChangedFile(path, data, size))
+		return;
 
-	processFileData(re, output, outputChunk, hlbuf, path.c_str(), path.size(), data.get(), nlength, 0);
+	processFileData(re, output, outputChunk, hlbuf, path.c_str(), path.size(), data.get(), size, 0);
 }
 
 static void processChunkFile(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf,
@@ -252,11 +461,53 @@ static void processChunkFile(Regex* re, SearchOutput* output, OrderedOutput::Chu
 	processFileData(re, output, outputChunk, hlbuf, path, pathLength, data, size, startLine);
 }
 
-static void processChunk(Regex* re, SearchOutput* output, unsigned int chunkIndex, const DataChunkHeader& chunk, char* buffer, Regex* includeRe, Regex* excludeRe, const std::string* changes, size_t changeBegin, size_t changeEnd)
+static void processOriginalFile(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf,
+	const char* path, size_t pathLength, const char* data, size_t size, unsigned int startLine, uint64_t contentHash, Regex* includeRe, Regex* excludeRe, bool changed)
+{
+	std::vector<DuplicateMatch> matches;
+
+	// the matches are needed for duplicate files even if the original file itself is changed or filtered out
+	bool ignored = changed || ignorePath(path, pathLength, includeRe, excludeRe);
+
+	processFileData(re, output, ignored ? nullptr : outputChunk, hlbuf, path, pathLength, data, size, startLine, &matches);
+
+	output->duplicates.addMatches(contentHash, std::string(path, pathLength), matches);
+}
+
+static void processDuplicateFile(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf, unsigned int fileChunkIndex,
+	const char* path, size_t pathLength, const char* original, size_t originalLength, uint64_t contentHash, Regex* includeRe, Regex* excludeRe)
+{
+	if (ignorePath(path, pathLength, includeRe, excludeRe))
+		return;
+
+	std::vector<DuplicateMatch> matches = output->duplicates.getMatches(fileChunkIndex, contentHash, std::string(original, originalLength));
+
+	for (auto& m: matches)
+	{
+		processMatch(re, output, outputChunk, hlbuf, path, pathLength, m.text.c_str(), m.text.size(), m.line, m.preparedText.c_str(), m.matchOffset, m.matchLength);
+
+		// early-out for big matches
+		if (output->isLimitReached(outputChunk)) break;
+	}
+}
+
+static const char* decompressChunk(SearchOutput* output, const DataChunkHeader& chunk, const char* source, char* buffer)
 {
-	char* data = buffer + chunk.compressedSize;
+	// uncompressed chunks are searched in place
+	if (chunk.codec == DCC_NONE)
+		return source;
+
+	if (chunk.flags & DC_DICTIONARY)
+		decompress(buffer, chunk.uncompressedSize, source, chunk.compressedSize, output->dictionary.data(), output->dictionary.size());
+	else
+		decompress(buffer, chunk.uncompressedSize, source, chunk.compressedSize);
+
+	return buffer;
+}
 
-	decompress(data, chunk.uncompressedSize, buffer, chunk.compressedSize);
+static void processChunk(Regex* re, SearchOutput* output, unsigned int chunkIndex, unsigned int fileChunkIndex, const DataChunkHeader& chunk, const char* source, char* buffer, Regex* includeRe, Regex* excludeRe, const std::string* changes, size_t changeBegin, size_t changeEnd)
+{
+	const char* data = decompressChunk(output, chunk, source, buffer);
 
 	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
 
@@ -280,16 +531,34 @@ static void processChunk(Regex* re, SearchOutput* output, unsigned int chunkInde
 			changeIndex++;
 		}
 
-		if (changeIndex < changeEnd && comparePath(changes[changeIndex], data + f.nameOffset, f.nameLength) == 0)
+		bool changed = changeIndex < changeEnd && comparePath(changes[changeIndex], data + f.nameOffset, f.nameLength) == 0;
+
+		// This is a suffix of a file that started in the last chunk. This means if it was present in the change lists it has to be right before
+		// our change range (due to how getNextChange works), and this means we should have processed the changed file in the previous chunk - so
+		// here we should just skip it.
+		bool changedSuffix = !changed && f.startLine > 0 && changeIndex > 0 && comparePath(changes[changeIndex-1], data + f.nameOffset, f.nameLength) == 0;
+
+		if (f.flags & DF_HASDUPLICATES)
+		{
+			processOriginalFile(re, output, outputChunk, hlbuf, data + f.nameOffset, f.nameLength, data + f.dataOffset, f.dataSize, f.startLine, f.contentHash, includeRe, excludeRe, changed || changedSuffix);
+		}
+
+		if (changed)
 		{
 			processChangedFile(re, output, outputChunk, hlbuf, changes[changeIndex], includeRe, excludeRe);
 			changeIndex++;
 		}
-		else if (f.startLine > 0 && changeIndex > 0 && comparePath(changes[changeIndex-1], data + f.nameOffset, f.nameLength) == 0)
+		else if (changedSuffix)
+		{
+			// skip the file, see above
+		}
+		else if (f.flags & DF_HASDUPLICATES)
 		{
-			// This is a suffix of a file that started in the last chunk. This means if it was present in the change lists it has to be right before
-			// our change range (due to how getNextChange works), and this means we should have processed the changed file in the previous chunk - so
-			// here we should just skip it.
+			// the file was processed above
+		}
+		else if (f.flags & DF_DUPLICATE)
+		{
+			processDuplicateFile(re, output, outputChunk, hlbuf, fileChunkIndex, data + f.nameOffset, f.nameLength, data + f.dataOffset, f.dataSize, f.contentHash, includeRe, excludeRe);
 		}
 		else
 		{
@@ -304,6 +573,28 @@ static void processChunk(Regex* re, SearchOutput* output, unsigned int chunkInde
 	}
 
 	output->output.end(outputChunk);
+
+	output->duplicates.finishChunk(fileChunkIndex);
+}
+
+static void processChangedFiles(Regex* re, SearchOutput* output, unsigned int chunkIndex, unsigned int fileChunkIndex, Regex* includeRe, Regex* excludeRe, const std::string* changes, size_t changeBegin, size_t changeEnd)
+{
+	OrderedOutput::Chunk* outputChunk = output->output.begin(chunkIndex);
+
+	HighlightBuffer hlbuf;
+
+	for (size_t i = changeBegin; i < changeEnd; ++i)
+	{
+		// early-out for big matches
+		if (output->isLimitReached(outputChunk))
+			break;
+
+		processChangedFile(re, output, outputChunk, hlbuf, changes[i], includeRe, excludeRe);
+	}
+
+	output->output.end(outputChunk);
+
+	output->duplicates.finishChunk(fileChunkIndex);
 }
 
 unsigned int getRegexOptions(unsigned int options)
@@ -319,6 +610,13 @@ NgramString ngramExtract(const std::string& string)
 {
 	NgramString result;
 
+	// strings that are too short to have any 4-grams are filtered using trigrams
+	if (string.length() == 3)
+	{
+		result.push_back(trigram(casefold(string[0]), casefold(string[1]), casefold(string[2])));
+		return result;
+	}
+
 	for (size_t i = 3; i < string.length(); ++i)
 	{
 		char a = string[i - 3], b = string[i - 2], c = string[i - 1], d = string[i];
@@ -338,6 +636,15 @@ bool ngramExists(const std::vector<unsigned char>& index, unsigned int iteration
 	return true;
 }
 
+bool ngramExists(const std::vector<unsigned int>& ngrams, const NgramString& search)
+{
+	for (size_t i = 0; i < search.size(); ++i)
+		if (!std::binary_search(ngrams.begin(), ngrams.end(), search[i]))
+			return false;
+
+	return true;
+}
+
 class NgramRegex
 {
 public:
@@ -348,17 +655,35 @@ public:
 		std::vector<std::string> atomstr = re->prefilterPrepare();
 
 		for (size_t i = 0; i < atomstr.size(); ++i)
+		{
 			atoms.push_back(ngramExtract(atomstr[i]));
+			shortAtoms.push_back(atomstr[i].length() < 4);
+		}
 	}
 
-	bool match(const std::vector<unsigned char>& index, unsigned int iterations) const
+	bool match(const std::vector<unsigned char>& index, unsigned int iterations, bool trigrams) const
 	{
 		if (atoms.empty()) return true;
 
 		std::vector<int> matched;
 
+		// indices without trigrams can't filter short atoms so we have to assume they match
 		for (size_t i = 0; i < atoms.size(); ++i)
-			if (ngramExists(index, iterations, atoms[i]))
+			if ((shortAtoms[i] && !trigrams) || ngramExists(index, iterations, atoms[i]))
+				matched.push_back(i);
+
+		return re->prefilterMatch(matched);
+	}
+
+	// ngrams are an exact sorted set, so unlike the chunk index there are no false positives
+	bool match(const std::vector<unsigned int>& ngrams) const
+	{
+		if (atoms.empty()) return true;
+
+		std::vector<int> matched;
+
+		for (size_t i = 0; i < atoms.size(); ++i)
+			if (ngramExists(ngrams, atoms[i]))
 				matched.push_back(i);
 
 		return re->prefilterMatch(matched);
@@ -371,9 +696,15 @@ public:
 
 private:
 	std::vector<NgramString> atoms;
+	std::vector<bool> shortAtoms;
 	Regex* re;
 };
 
+static bool matchOverlayFile(const NgramRegex* ngregex, const OverlayFile& file)
+{
+	return ngregex->match(file.ngrams);
+}
+
 size_t getNextChange(const std::vector<std::string>& changes, size_t changeIt, const char* data, size_t size)
 {
 	while (changeIt < changes.size() && comparePath(changes[changeIt], data, size) <= 0)
@@ -401,6 +732,94 @@ template <typename T> static bool readVector(FileStream& in, std::vector<T>& dat
 	return true;
 }
 
+static bool readDeltaSegment(Output* output, const char* path, DeltaSegment& delta)
+{
+	// delta segment is optional
+	FileStream in(path, "rb");
+	if (!in)
+		return true;
+
+	DataFileHeader header;
+	std::vector<char> dictionary;
+
+	if (!read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0 || !readVector(in, dictionary, header.dictionarySize))
+	{
+		output->error("Error reading data file %s: file format is out of date, update the project to fix\n", path);
+		return false;
+	}
+
+	DataChunkHeader chunk;
+
+	while (read(in, chunk))
+	{
+		in.skip(chunk.extraSize);
+		in.skip(chunk.indexSize);
+		in.skip(chunk.dataPadding);
+
+		std::unique_ptr<char[]> data(new (std::nothrow) char[chunk.compressedSize + chunk.uncompressedSize]);
+
+		if (!data || !read(in, data.get(), chunk.compressedSize))
+		{
+			output->error("Error reading data file %s: malformed chunk\n", path);
+			return false;
+		}
+
+		char* uncompressed = data.get() + chunk.compressedSize;
+		if (chunk.codec == DCC_NONE)
+			uncompressed = data.get();
+		else if (chunk.flags & DC_DICTIONARY)
+			decompress(uncompressed, chunk.uncompressedSize, data.get(), chunk.compressedSize, dictionary.data(), dictionary.size());
+		else
+			decompress(uncompressed, chunk.uncompressedSize, data.get(), chunk.compressedSize);
+
+		const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(uncompressed);
+
+		for (size_t i = 0; i < chunk.fileCount; ++i)
+		{
+			const DataChunkFileHeader& f = files[i];
+			std::vector<DeltaFilePart>& parts = delta.files[std::string(uncompressed + f.nameOffset, f.nameLength)];
+
+			if ((f.flags & DF_REMOVED) == 0)
+				parts.push_back({ uncompressed + f.dataOffset, f.dataSize, f.startLine, f.timeStamp, f.fileSize });
+		}
+
+		delta.chunks.push_back(std::move(data));
+	}
+
+	return true;
+}
+
+static bool readDuplicateReferences(FileStream& in, DuplicateTable& duplicates)
+{
+	uint64_t start = in.tell();
+
+	DataChunkHeader chunk;
+	std::vector<uint64_t> hashes;
+
+	// chunk headers are read without touching the compressed data so that matches of the originals can be released after the last reference
+	while (read(in, chunk))
+	{
+		if (chunk.extraSize < chunk.duplicateCount * sizeof(uint64_t))
+			return false;
+
+		in.skip(chunk.extraSize - chunk.duplicateCount * sizeof(uint64_t));
+
+		if (!readVector(in, hashes, chunk.duplicateCount))
+			return false;
+
+		for (uint64_t h: hashes)
+			duplicates.addReference(h);
+
+		in.skip(chunk.indexSize);
+		in.skip(chunk.dataPadding);
+		in.skip(chunk.compressedSize);
+	}
+
+	in.seek(start);
+
+	return true;
+}
+
 unsigned int searchProject(Output* output_, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude)
 {
 	SearchOutput output(output_, options, limit);
@@ -409,8 +828,37 @@ unsigned int searchProject(Output* output_, const char* file, const char* string
 	std::unique_ptr<Regex> excludeRe(exclude ? createRegex(exclude, RO_IGNORECASE) : 0);
 	NgramRegex ngregex((options & SO_BRUTEFORCE) ? nullptr : regex.get());
 
-	std::vector<std::string> changes = readChanges(file);
+	output.ngregex = &ngregex;
+
+	std::vector<std::string> changes;
 	size_t changeIt = 0;
+
+	if (!readDeltaSegment(output_, replaceExtension(file, ".qgs").c_str(), output.delta))
+		return 0;
+
+	// files from the delta segment supersede the files in the data file; the change list supersedes both since it's more recent
+	for (auto& c: readChangedFiles(output_, file))
+	{
+		auto delta = output.delta.files.find(c.path);
+
+		if (delta != output.delta.files.end())
+		{
+			// the delta segment already has the version of the file that was recorded in the change list, so the file doesn't need to be read;
+			// files that were modified right before the delta segment was written are stored with a zero time stamp and are always read
+			if (!delta->second.empty() && delta->second[0].timeStamp == c.timeStamp && delta->second[0].fileSize == c.fileSize)
+				continue;
+
+			output.delta.files.erase(delta);
+		}
+
+		changes.push_back(c.path);
+	}
+
+	for (auto& f: output.delta.files)
+		changes.push_back(f.first);
+
+	std::sort(changes.begin(), changes.end());
+	changes.erase(std::unique(changes.begin(), changes.end()), changes.end());
 	
 	std::string dataPath = replaceExtension(file, ".qgd");
 	FileStream in(dataPath.c_str(), "rb");
@@ -427,16 +875,31 @@ unsigned int searchProject(Output* output_, const char* file, const char* string
 		return 0;
 	}
 
+	if (!readVector(in, output.dictionary, header.dictionarySize))
+	{
+		output_->error("Error reading data file %s: malformed header\n", dataPath.c_str());
+		return 0;
+	}
+
+	if (!readDuplicateReferences(in, output.duplicates))
+	{
+		output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
+		return 0;
+	}
+
 	{
 		unsigned int chunkIndex = 0;
 
 		// Assume 50% compression ratio (it's usually much better)
-		BlockPool chunkPool(kChunkSize * 3 / 2);
+		BlockPool chunkPool(kChunkMaxSize * 3 / 2);
 
 		std::vector<char> extra;
 		std::vector<unsigned char> index;
 		DataChunkHeader chunk;
 
+		// uncompressed chunks are searched directly in the mapped file; the mapping has to outlive the work queue
+		std::unique_ptr<FileMapping> mapping;
+
 		WorkQueue queue(WorkQueue::getIdealWorkerCount(), kMaxQueuedChunkData);
 
 		while (!output.isLimitReached() && read(in, chunk))
@@ -447,9 +910,13 @@ unsigned int searchProject(Output* output_, const char* file, const char* string
 				return 0;
 			}
 
-			size_t changeNext = getNextChange(changes, changeIt, extra.data(), extra.size());
+			size_t lastFileLength = chunk.extraSize - chunk.duplicateCount * sizeof(uint64_t);
+
+			size_t changeNext = getNextChange(changes, changeIt, extra.data(), lastFileLength);
 
-			if (ngregex.empty() || chunk.indexSize == 0 || changeNext != changeIt)
+			unsigned int fileChunkIndex = output.duplicates.addChunk(extra.data(), lastFileLength, extra.data() + lastFileLength, chunk.duplicateCount);
+
+			if (ngregex.empty() || chunk.indexSize == 0)
 			{
 				in.skip(chunk.indexSize);
 			}
@@ -461,24 +928,66 @@ unsigned int searchProject(Output* output_, const char* file, const char* string
 					return 0;
 				}
 
-				if (!ngregex.match(index, chunk.indexHashIterations))
+				if (!ngregex.match(index, chunk.indexHashIterations, (chunk.flags & DC_INDEX_TRIGRAMS) != 0))
 				{
-					in.skip(chunk.compressedSize);
+					in.skip(chunk.dataPadding + chunk.compressedSize);
+
+					// chunk contents can't match, but the changed files that belong to the chunk still need to be searched
+					if (changeNext != changeIt)
+					{
+						queue.push([=, &regex, &output, &includeRe, &excludeRe, &changes]() {
+							processChangedFiles(regex.get(), &output, chunkIndex, fileChunkIndex, includeRe.get(), excludeRe.get(), changes.data(), changeIt, changeNext);
+						}, 0);
+
+						chunkIndex++;
+						changeIt = changeNext;
+					}
+					else
+					{
+						output.duplicates.finishChunk(fileChunkIndex);
+					}
+
 					continue;
 				}
 			}
 
-			std::shared_ptr<char> data = chunkPool.allocate(chunk.compressedSize + chunk.uncompressedSize, std::nothrow);
+			in.skip(chunk.dataPadding);
+
+			// the path could be replaced by a concurrent update, so the mapping has to use the file we're reading
+			if (chunk.codec == DCC_NONE && !mapping)
+				mapping.reset(new FileMapping(in));
+
+			uint64_t dataOffset = in.tell();
+
+			std::shared_ptr<char> data;
+			const char* source = nullptr;
+			size_t dataSize = 0;
 
-			if (!data || !read(in, data.get(), chunk.compressedSize))
+			if (chunk.codec == DCC_NONE && *mapping && dataOffset + chunk.compressedSize <= mapping->size())
 			{
-				output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
-				return 0;
+				source = mapping->data() + dataOffset;
+				dataSize = chunk.uncompressedSize;
+
+				in.skip(chunk.compressedSize);
+			}
+			else
+			{
+				dataSize = (chunk.codec == DCC_NONE) ? chunk.compressedSize : chunk.compressedSize + chunk.uncompressedSize;
+				data = chunkPool.allocate(dataSize, std::nothrow);
+
+				if (!data || !read(in, data.get(), chunk.compressedSize))
+				{
+					output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
+					return 0;
+				}
+
+				source = data.get();
 			}
 
 			queue.push([=, &regex, &output, &includeRe, &excludeRe, &changes]() {
-				processChunk(regex.get(), &output, chunkIndex, chunk, data.get(), includeRe.get(), excludeRe.get(), changes.data(), changeIt, changeNext);
-			}, chunk.compressedSize + chunk.uncompressedSize);
+				processChunk(regex.get(), &output, chunkIndex, fileChunkIndex, chunk, source, data ? data.get() + chunk.compressedSize : nullptr,
+					includeRe.get(), excludeRe.get(), changes.data(), changeIt, changeNext);
+			}, dataSize);
 
 			chunkIndex++;
 			changeIt = changeNext;
@@ -10,11 +10,20 @@
 #include "project.hpp"
 #include "files.hpp"
 #include "compression.hpp"
+#include "changes.hpp"
+#include "constants.hpp"
+#include "workqueue.hpp"
+#include "scancache.hpp"
 
 #include <memory>
 #include <vector>
 #include <string>
 #include <chrono>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <deque>
+#include <future>
 
 #include <string.h>
 
@@ -26,6 +35,52 @@ struct UpdateStatistics
 	unsigned int chunksPreserved;
 };
 
+struct UpdateChunk
+{
+	DataChunkHeader header;
+	uint64_t dataOffset;
+
+	std::unique_ptr<char[]> index;
+	std::unique_ptr<char[]> extra;
+
+	// compressed data followed by uncompressed data; the file table is always decompressed, the rest is only decompressed if the chunk is rebuilt
+	std::unique_ptr<char[]> data;
+	size_t uncompressedOffset;
+	size_t compressedRead;
+
+	// valid if the chunk is being decompressed on a worker thread
+	std::future<void> decompressed;
+
+	// content hashes of the files that changed the time stamp but not the size, or 0 if the file wasn't hashed
+	std::vector<const FileInfo*> touchedFiles;
+	std::vector<uint64_t> touchedHashes;
+};
+
+struct UpdateOriginalPart
+{
+	DataChunkHeader header;
+	uint64_t chunkOffset;
+
+	uint32_t dataOffset;
+	uint32_t dataSize;
+};
+
+struct UpdateOriginal
+{
+	std::string path;
+	std::vector<UpdateOriginalPart> parts;
+};
+
+// Current original files in the data file, so that duplicates can be stored with the contents from the data file instead of reading both files again
+struct UpdateOriginals
+{
+	std::unordered_map<uint64_t, UpdateOriginal> files;
+
+	// the chunk that was decompressed last; duplicates of the same original are usually close to each other
+	uint64_t chunkOffset;
+	std::vector<char> chunkData;
+};
+
 struct UpdateFileIterator
 {
 	const FileInfo& operator*() const
@@ -92,30 +147,306 @@ static bool isChunkCurrent(UpdateFileIterator& fileit, const DataChunkHeader& ch
 	return true;
 }
 
-static void processChunkData(Output* output, BuildContext* builder, UpdateFileIterator& fileit, UpdateStatistics& stats,
-	const DataChunkHeader& chunk, char* buffer, std::unique_ptr<char[]>& compressed, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra)
+static bool isFileUnchanged(const FileInfo& info, const DataChunkFileHeader& file, const UpdateChunk& chunk, size_t index)
 {
-	const char* data = buffer;
+	// files that were touched without changing the contents, e.g. by switching branches, don't need to be read again
+	uint64_t hash = index < chunk.touchedHashes.size() ? chunk.touchedHashes[index] : 0;
 
-	// decompress the file table part of the chunk; this allows us to skip full chunk decompression if chunk is fully up-to-date
-	decompressPartial(buffer, chunk.uncompressedSize, compressed.get(), chunk.compressedSize, chunk.fileTableSize);
+	return info.fileSize == file.fileSize && hash != 0 && hash == file.contentHash;
+}
 
-	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
+static bool updateChunkTimeStamps(UpdateFileIterator& fileit, const UpdateChunk& chunk, DataChunkFileHeader* files, const char* data, bool firstFileIsSuffix)
+{
+	// if all files in the chunk are current or unchanged, the chunk contents and index can be reused after updating the time stamps in the file table
+	size_t back = firstFileIsSuffix ? 1 : 0;
+	if (fileit.index < back || fileit.index - back + chunk.header.fileCount > fileit.files.size()) return false;
+
+	for (size_t i = 0; i < chunk.header.fileCount; ++i)
+	{
+		const DataChunkFileHeader& f = files[i];
+		const FileInfo& info = fileit.files[fileit.index - back + i];
+
+		if (comparePath(info, f, data) != 0 || (!isFileCurrent(info, f, data) && !isFileUnchanged(info, f, chunk, i)))
+			return false;
+	}
+
+	for (size_t i = 0; i < chunk.header.fileCount; ++i)
+		files[i].timeStamp = fileit.files[fileit.index - back + i].timeStamp;
+
+	return true;
+}
+
+static bool isChunkPreservable(const DataChunkHeader& chunk, bool dictionaryPreserved, bool recompress)
+{
+	// chunks compressed with a dictionary can only be preserved if the new data file has the same dictionary
+	if ((chunk.flags & DC_DICTIONARY) && !dictionaryPreserved)
+		return false;
+
+	// chunks from fast builds are recompressed with the project compression level unless this update is fast as well
+	if ((chunk.flags & DC_RECOMPRESS) && recompress)
+		return false;
+
+	return true;
+}
+
+static size_t findFileAfter(const std::vector<FileInfo>& files, const DataChunkFileHeader& file, const char* data)
+{
+	auto it = std::upper_bound(files.begin(), files.end(), file, [&](const DataChunkFileHeader& f, const FileInfo& info) { return comparePath(info, f, data) > 0; });
+
+	return it - files.begin();
+}
+
+static bool readChunk(FileStream& in, UpdateChunk& chunk, const std::vector<char>& dictionary)
+{
+	const DataChunkHeader& header = chunk.header;
+
+	chunk.extra.reset(new (std::nothrow) char[header.extraSize]);
+	chunk.index.reset(new (std::nothrow) char[header.indexSize]);
+
+	chunk.uncompressedOffset = (header.compressedSize + 7) & ~7; // make sure uncompressed data is aligned
+	chunk.data.reset(new (std::nothrow) char[chunk.uncompressedOffset + header.uncompressedSize]);
+
+	if (!chunk.extra || !chunk.index || !chunk.data || !read(in, chunk.extra.get(), header.extraSize) || !read(in, chunk.index.get(), header.indexSize))
+		return false;
+
+	in.skip(header.dataPadding);
+
+	chunk.dataOffset = in.tell();
+
+	// file table is stored at the beginning of chunk data, so we start by reading the part of the data that's sufficient to get the file table
+	char* compressed = chunk.data.get();
+	char* uncompressed = chunk.data.get() + chunk.uncompressedOffset;
+
+	const char* chunkDictionary = (header.flags & DC_DICTIONARY) ? dictionary.data() : nullptr;
+	size_t chunkDictionarySize = (header.flags & DC_DICTIONARY) ? dictionary.size() : 0;
+
+	chunk.compressedRead = std::min(size_t(header.compressedSize), header.codec == DCC_NONE ? size_t(header.fileTableSize) : getCompressedPrefixBound(header.fileTableSize));
+
+	if (!read(in, compressed, chunk.compressedRead))
+		return false;
+
+	if (header.codec == DCC_NONE)
+	{
+		memcpy(uncompressed, compressed, chunk.compressedRead);
+
+		if (chunk.compressedRead >= header.fileTableSize)
+			return true;
+	}
+	else if (decompressPartial(uncompressed, header.uncompressedSize, compressed, chunk.compressedRead, header.fileTableSize, chunkDictionary, chunkDictionarySize))
+		return true;
+
+	// the prefix wasn't enough to decompress the file table, so we need to read the entire chunk
+	if (chunk.compressedRead == header.compressedSize || !read(in, compressed + chunk.compressedRead, header.compressedSize - chunk.compressedRead))
+		return false;
+
+	chunk.compressedRead = header.compressedSize;
+
+	if (header.codec == DCC_NONE)
+		memcpy(uncompressed, compressed, header.uncompressedSize);
+	else if (!decompressPartial(uncompressed, header.uncompressedSize, compressed, header.compressedSize, header.fileTableSize, chunkDictionary, chunkDictionarySize))
+		return false;
+
+	return true;
+}
+
+static void decompressChunkData(const DataChunkHeader& header, char* uncompressed, const char* compressed, const std::vector<char>& dictionary)
+{
+	if (header.codec == DCC_NONE)
+		memcpy(uncompressed, compressed, header.uncompressedSize);
+	else if (header.flags & DC_DICTIONARY)
+		decompress(uncompressed, header.uncompressedSize, compressed, header.compressedSize, dictionary.data(), dictionary.size());
+	else
+		decompress(uncompressed, header.uncompressedSize, compressed, header.compressedSize);
+}
+
+static void decompressChunk(UpdateChunk& chunk, const std::vector<char>& dictionary)
+{
+	const DataChunkHeader& header = chunk.header;
+
+	for (size_t i = 0; i < chunk.touchedFiles.size(); ++i)
+		if (chunk.touchedFiles[i])
+			chunk.touchedHashes[i] = buildHashFile(chunk.touchedFiles[i]->path.c_str());
+
+	assert(chunk.compressedRead == header.compressedSize);
+
+	// decompress the chunk completely. this decompresses the file table redundantly but the performance cost of that is negligible
+	decompressChunkData(header, chunk.data.get() + chunk.uncompressedOffset, chunk.data.get(), dictionary);
+}
+
+static void addOriginalPart(UpdateOriginals& originals, const UpdateChunk& chunk, const DataChunkFileHeader& f, const char* data)
+{
+	if (!(f.flags & DF_HASDUPLICATES) || (f.flags & DF_DUPLICATE))
+		return;
+
+	UpdateOriginal& original = originals.files[f.contentHash];
+
+	// the first part of the file starts the contents, the parts in the next chunks extend it
+	if (f.startLine == 0)
+	{
+		original.path.assign(data + f.nameOffset, f.nameLength);
+		original.parts.clear();
+	}
+	else if (original.path.compare(0, std::string::npos, data + f.nameOffset, f.nameLength) != 0)
+		return;
+
+	original.parts.push_back({ chunk.header, chunk.dataOffset, f.dataOffset, f.dataSize });
+}
+
+static bool readOriginalContents(FileStream& in, UpdateOriginals& originals, const UpdateOriginal& original, const std::vector<char>& dictionary, std::vector<char>& result)
+{
+	uint64_t offset = in.tell();
+	bool ok = true;
+
+	for (auto& part: original.parts)
+	{
+		if (originals.chunkOffset != part.chunkOffset)
+		{
+			std::vector<char> compressed(part.header.compressedSize);
+
+			in.seek(part.chunkOffset);
+
+			if (!read(in, compressed.data(), compressed.size()))
+			{
+				ok = false;
+				break;
+			}
+
+			originals.chunkData.resize(part.header.uncompressedSize);
+			decompressChunkData(part.header, originals.chunkData.data(), compressed.data(), dictionary);
+
+			originals.chunkOffset = part.chunkOffset;
+		}
+
+		if (part.dataOffset > originals.chunkData.size() || part.dataSize > originals.chunkData.size() - part.dataOffset)
+		{
+			ok = false;
+			break;
+		}
+
+		result.insert(result.end(), originals.chunkData.begin() + part.dataOffset, originals.chunkData.begin() + part.dataOffset + part.dataSize);
+	}
+
+	in.seek(offset);
+
+	return ok;
+}
+
+static void appendDuplicateFile(BuildContext* builder, FileStream& in, UpdateOriginals& originals, const FileInfo& info, const DataChunkFileHeader& f, const char* data, const std::vector<char>& dictionary)
+{
+	auto original = originals.files.find(f.contentHash);
+	std::vector<char> contents;
+
+	// the duplicate is current, so if its original is current as well the reference can be stored again with the original contents from the data file
+	if (original != originals.files.end() && original->second.path.compare(0, std::string::npos, data + f.dataOffset, f.dataSize) == 0 &&
+		readOriginalContents(in, originals, original->second, dictionary, contents))
+		buildAppendDuplicateFile(builder, info.path.c_str(), info.timeStamp, info.fileSize, f.contentHash, original->second.path.c_str(), std::move(contents));
+	else
+		buildAppendFile(builder, info.path.c_str(), info.timeStamp, info.fileSize);
+}
+
+static bool prefetchChunk(FileStream& in, UpdateChunk& chunk, const std::vector<FileInfo>& files, size_t& nextFile, const std::vector<char>& dictionary, bool dictionaryPreserved, bool recompress, WorkQueue& queue)
+{
+	const DataChunkHeader& header = chunk.header;
+
+	if (header.fileCount == 0 || !readChunk(in, chunk, dictionary))
+		return false;
+
+	const char* data = chunk.data.get() + chunk.uncompressedOffset;
+	const DataChunkFileHeader* fileTable = reinterpret_cast<const DataChunkFileHeader*>(data);
+
+	// predict whether the chunk will be preserved; when the chunk is processed, the file iterator will point to the first file after the previous chunk
+	UpdateFileIterator fileit = {files, nextFile};
+
+	bool chunkCurrent = isChunkPreservable(header, dictionaryPreserved, recompress) && isChunkCurrent(fileit, header, fileTable, data, fileTable[0].startLine > 0);
+
+	nextFile = findFileAfter(files, fileTable[header.fileCount - 1], data);
+
+	if (chunkCurrent)
+	{
+		// chunk data is copied directly from the data file so we don't need to read it
+		in.skip(header.compressedSize - chunk.compressedRead);
+		return true;
+	}
+
+	if (chunk.compressedRead < header.compressedSize && !read(in, chunk.data.get() + chunk.compressedRead, header.compressedSize - chunk.compressedRead))
+		return false;
+
+	chunk.compressedRead = header.compressedSize;
+
+	// find files that were touched without changing the size; they will be hashed along with chunk decompression
+	chunk.touchedFiles.resize(header.fileCount);
+	chunk.touchedHashes.resize(header.fileCount);
+
+	for (size_t i = 0; i < header.fileCount; ++i)
+	{
+		const DataChunkFileHeader& f = fileTable[i];
+		size_t index = findFileAfter(files, f, data);
+
+		if (index > 0 && comparePath(files[index - 1], f, data) == 0 && files[index - 1].fileSize == f.fileSize && files[index - 1].timeStamp != f.timeStamp)
+			chunk.touchedFiles[i] = &files[index - 1];
+	}
+
+	// decompress stale chunks on worker threads while the preceding chunks are being processed
+	std::shared_ptr<std::promise<void>> promise = std::make_shared<std::promise<void>>();
+	chunk.decompressed = promise->get_future();
+
+	UpdateChunk* target = &chunk;
+	const std::vector<char>* chunkDictionary = &dictionary;
+
+	queue.push([=]() { decompressChunk(*target, *chunkDictionary); promise->set_value(); }, header.compressedSize + header.uncompressedSize);
+
+	return true;
+}
+
+static bool processChunk(BuildContext* builder, UpdateFileIterator& fileit, UpdateStatistics& stats, FileStream& in, UpdateChunk& chunk, UpdateOriginals& originals, const std::vector<char>& dictionary, bool dictionaryPreserved, bool recompress)
+{
+	const DataChunkHeader& header = chunk.header;
+	char* data = chunk.data.get() + chunk.uncompressedOffset;
+	DataChunkFileHeader* files = reinterpret_cast<DataChunkFileHeader*>(data);
 
 	// if chunk is fully up-to-date, we can try adding it directly and skipping chunk recompression
-	assert(chunk.fileCount > 0);
+	assert(header.fileCount > 0);
 
 	bool firstFileIsSuffix = files[0].startLine > 0;
 
-	if (isChunkCurrent(fileit, chunk, files, data, firstFileIsSuffix) && buildAppendChunk(builder, chunk, compressed, index, extra, firstFileIsSuffix))
+	if (isChunkPreservable(header, dictionaryPreserved, recompress) && isChunkCurrent(fileit, header, files, data, firstFileIsSuffix) && buildAppendChunk(builder, header, data, chunk.dataOffset, chunk.index, chunk.extra))
 	{
-		fileit += chunk.fileCount - firstFileIsSuffix;
+		for (size_t i = 0; i < header.fileCount; ++i)
+			addOriginalPart(originals, chunk, files[i], data);
+
+		fileit += header.fileCount - firstFileIsSuffix;
 		stats.chunksPreserved++;
-		return;
+		return true;
 	}
 
-	// decompress the chunk completely. this decompresses the file table redundantly but the performance cost of that is negligible
-	decompress(buffer, chunk.uncompressedSize, compressed.get(), chunk.compressedSize);
+	if (chunk.decompressed.valid())
+		chunk.decompressed.get();
+	else
+	{
+		// the chunk was expected to be preserved so the data wasn't read; this can happen if the chunk can't be added as is
+		uint64_t offset = in.tell();
+
+		in.seek(chunk.dataOffset);
+
+		if (!read(in, chunk.data.get(), header.compressedSize))
+			return false;
+
+		in.seek(offset);
+
+		chunk.compressedRead = header.compressedSize;
+
+		decompressChunk(chunk, dictionary);
+	}
+
+	// if the files were only touched, we can keep the chunk contents and index and just recompress the chunk with the new file table
+	if (updateChunkTimeStamps(fileit, chunk, files, data, firstFileIsSuffix) && buildAppendChunkData(builder, header, data, chunk.index, chunk.extra))
+	{
+		for (size_t i = 0; i < header.fileCount; ++i)
+			addOriginalPart(originals, chunk, files[i], data);
+
+		fileit += header.fileCount - firstFileIsSuffix;
+		return true;
+	}
 
 	// as a special case, first file in the chunk can be a part of an existing file
 	bool skipFirstFile = false;
@@ -126,14 +457,15 @@ static void processChunkData(Output* output, BuildContext* builder, UpdateFileIt
 		const DataChunkFileHeader& f = files[0];
 		const FileInfo* prev = &fileit.files[fileit.index - 1];
 
-		if (comparePath(*prev, f, data) == 0 && isFileCurrent(*prev, f, data))
+		if (comparePath(*prev, f, data) == 0 && (isFileCurrent(*prev, f, data) || isFileUnchanged(*prev, f, chunk, 0)))
 		{
-			buildAppendFilePart(builder, prev->path.c_str(), f.startLine, data + f.dataOffset, f.dataSize, prev->timeStamp, prev->fileSize);
+			buildAppendFilePart(builder, prev->path.c_str(), f.startLine, data + f.dataOffset, f.dataSize, prev->timeStamp, prev->fileSize, f.contentHash, f.flags);
+			addOriginalPart(originals, chunk, f, data);
 			skipFirstFile = true;
 		}
 	}
 
-	for (size_t i = skipFirstFile; i < chunk.fileCount; ++i)
+	for (size_t i = skipFirstFile; i < header.fileCount; ++i)
 	{
 		const DataChunkFileHeader& f = files[i];
 
@@ -148,10 +480,18 @@ static void processChunkData(Output* output, BuildContext* builder, UpdateFileIt
 		// check if file exists
 		if (fileit && comparePath(*fileit, f, data) == 0)
 		{
+			bool current = isFileCurrent(*fileit, f, data) || isFileUnchanged(*fileit, f, chunk, i);
+
 			// check if we can reuse the data from qgrep db
-			if (isFileCurrent(*fileit, f, data))
+			if (current && (f.flags & DF_DUPLICATE))
+			{
+				// duplicate files don't store the contents; touched duplicates were hashed already, so they don't need to be read again either
+				appendDuplicateFile(builder, in, originals, *fileit, f, data, dictionary);
+			}
+			else if (current)
 			{
-				buildAppendFilePart(builder, fileit->path.c_str(), f.startLine, data + f.dataOffset, f.dataSize, fileit->timeStamp, fileit->fileSize);
+				buildAppendFilePart(builder, fileit->path.c_str(), f.startLine, data + f.dataOffset, f.dataSize, fileit->timeStamp, fileit->fileSize, f.contentHash, f.flags);
+				addOriginalPart(originals, chunk, f, data);
 			}
 			else
 			{
@@ -166,77 +506,100 @@ static void processChunkData(Output* output, BuildContext* builder, UpdateFileIt
 			stats.filesRemoved++;
 		}
 	}
+
+	return true;
 }
 
-static bool processFile(Output* output, BuildContext* builder, UpdateFileIterator& fileit, UpdateStatistics& stats, const char* path)
+static bool openFile(Output* output, FileStream& in, const char* path, std::vector<char>& dictionary)
 {
-	FileStream in(path, "rb");
-	if (!in) return true;
+	if (!in.open(path, "rb")) return false;
 
 	DataFileHeader header;
 	if (!read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0)
 	{
 		output->error("Warning: data file %s has an out of date format, rebuilding\n", path);
-		return true;
+		return false;
 	}
 
-	DataChunkHeader chunk;
+	dictionary.resize(header.dictionarySize);
 
-	while (read(in, chunk))
+	if (!read(in, dictionary.data(), dictionary.size()))
 	{
-		std::unique_ptr<char[]> extra(new (std::nothrow) char[chunk.extraSize]);
-		std::unique_ptr<char[]> index(new (std::nothrow) char[chunk.indexSize]);
+		output->error("Warning: data file %s has a malformed header, rebuilding\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+static bool processFile(Output* output, BuildContext* builder, UpdateFileIterator& fileit, UpdateStatistics& stats, FileStream& in, const char* path,
+	const std::vector<char>& dictionary, bool dictionaryPreserved, bool recompress)
+{
+	// chunks are read ahead so that the chunks that need to be rebuilt can be decompressed in parallel; chunks are still processed in order
+	std::deque<std::unique_ptr<UpdateChunk>> chunks;
+	size_t readAheadCount = WorkQueue::getIdealWorkerCount() * 2;
+
+	// declared after the chunks so that all pending decompression finishes before the chunks are destroyed
+	WorkQueue queue(WorkQueue::getIdealWorkerCount(), kMaxQueuedChunkData);
+
+	size_t nextFile = fileit.index;
+
+	UpdateOriginals originals;
+	originals.chunkOffset = ~0ull;
 
-		size_t uncompressedOffset = (chunk.compressedSize + 7) & ~7; // make sure uncompressed data is aligned
+	for (;;)
+	{
+		std::unique_ptr<UpdateChunk> chunk(new UpdateChunk());
 
-		std::unique_ptr<char[]> data(new (std::nothrow) char[uncompressedOffset + chunk.uncompressedSize]);
+		bool chunkRead = read(in, chunk->header);
 
-		if (!extra || !index || !data || !read(in, extra.get(), chunk.extraSize) || !read(in, index.get(), chunk.indexSize) || !read(in, data.get(), chunk.compressedSize))
+		if (chunkRead)
 		{
-			output->error("Error reading data file %s: malformed chunk\n", path);
-			return false;
+			if (!prefetchChunk(in, *chunk, fileit.files, nextFile, dictionary, dictionaryPreserved, recompress, queue))
+			{
+				output->error("Error reading data file %s: malformed chunk\n", path);
+				return false;
+			}
+
+			chunks.push_back(std::move(chunk));
 		}
 
-		char* uncompressed = data.get() + uncompressedOffset;
+		while (chunks.size() > (chunkRead ? readAheadCount : 0))
+		{
+			if (!processChunk(builder, fileit, stats, in, *chunks.front(), originals, dictionary, dictionaryPreserved, recompress))
+			{
+				output->error("Error reading data file %s: malformed chunk\n", path);
+				return false;
+			}
+
+			chunks.pop_front();
+		}
 
-		processChunkData(output, builder, fileit, stats, chunk, uncompressed, data, index, extra);
+		if (!chunkRead)
+			break;
 	}
 
 	return true;
 }
 
-static void printStatistics(Output* output, const UpdateStatistics& stats, unsigned int totalChunks, double time)
+static void printFileStatistics(Output* output, const UpdateStatistics& stats)
 {
 	if (stats.filesAdded) output->print("+%d ", stats.filesAdded);
 	if (stats.filesRemoved) output->print("-%d ", stats.filesRemoved);
 	if (stats.filesChanged) output->print("*%d ", stats.filesChanged);
 
-	output->print("%s; %d/%d chunks updated in %.2f sec\n",
-		(stats.filesAdded || stats.filesRemoved || stats.filesChanged) ? "files" : "No changes",
-		totalChunks - stats.chunksPreserved, totalChunks, time);
+	output->print("%s; ", (stats.filesAdded || stats.filesRemoved || stats.filesChanged) ? "files" : "No changes");
 }
 
-bool updateProject(Output* output, const char* path)
+static void printStatistics(Output* output, const UpdateStatistics& stats, unsigned int totalChunks, double time)
 {
-	auto start = std::chrono::high_resolution_clock::now();
-
-    output->print("Updating %s:\n", path);
-
-	std::unique_ptr<ProjectGroup> group = parseProject(output, path);
-	if (!group)
-		return false;
-
-	removeFile(replaceExtension(path, ".qgc").c_str());
-
-	output->print("Scanning project...\r");
-
-	std::vector<FileInfo> files = getProjectGroupFiles(output, group.get());
+	printFileStatistics(output, stats);
 
-	output->print("Building file table...\r");
+	output->print("%d/%d chunks updated in %.2f sec\n", totalChunks - stats.chunksPreserved, totalChunks, time);
+}
 
-	if (!buildFiles(output, path, files))
-		return false;
-	
+static bool updateProjectFiles(Output* output, const char* path, const ProjectOptions& options, const std::vector<FileInfo>& files, bool fast, std::chrono::high_resolution_clock::time_point start)
+{
 	std::string targetPath = replaceExtension(path, ".qgd");
 	std::string tempPath = targetPath + "_";
 
@@ -244,14 +607,32 @@ bool updateProject(Output* output, const char* path)
 	unsigned int totalChunks = 0;
 
 	{
-		BuildContext* builder = buildStart(output, tempPath.c_str(), files.size());
+		FileStream in;
+		std::vector<char> dictionary;
+
+		bool existing = openFile(output, in, targetPath.c_str(), dictionary);
+
+		// keep using the existing dictionary so that chunks compressed with it can be preserved; the dictionary is only retrained on build
+		bool useDictionary = options.dictionary && options.compression == PC_LZ4;
+		bool dictionaryPreserved = useDictionary && !dictionary.empty();
+
+		BuildContext* builder = buildStart(output, tempPath.c_str(), options, files.size(),
+			dictionaryPreserved ? dictionary : useDictionary ? buildPrepareDictionary(output, files) : std::vector<char>());
 		if (!builder)
 			return false;
 
+		// fast updates leave recompression of new chunks to the next regular update
+		if (fast)
+			buildSetCompressionLevel(builder, kFastDataCompressionLevel);
+
+		// chunks that are up-to-date are copied from the existing database directly
+		if (existing && !buildOpenSource(builder, targetPath.c_str()))
+			output->error("Warning: can't read data file %s, rebuilding all chunks\n", targetPath.c_str());
+
 		UpdateFileIterator fileit = {files, 0};
 
 		// update contents using existing database (if any)
-		if (!processFile(output, builder, fileit, stats, targetPath.c_str()))
+		if (existing && !processFile(output, builder, fileit, stats, in, targetPath.c_str(), dictionary, dictionaryPreserved, !fast))
 		{
 			buildFinish(builder);
 			return false;
@@ -265,7 +646,8 @@ bool updateProject(Output* output, const char* path)
 			stats.filesAdded++;
 		}
 
-		totalChunks = buildFinish(builder);
+		if (!buildFinish(builder, &totalChunks))
+			return false;
 	}
 
 	output->print("\n");
@@ -280,5 +662,718 @@ bool updateProject(Output* output, const char* path)
 		return false;
 	}
 
+	// the new data file has all changes from the delta segment
+	removeFile(replaceExtension(path, ".qgs").c_str());
+
+	return true;
+}
+
+static bool updateProjectAll(Output* output, const char* path, bool fast)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+    output->print("Updating %s:\n", path);
+
+	ProjectOptions options;
+	std::unique_ptr<ProjectGroup> group = parseProject(output, path, &options);
+	if (!group)
+		return false;
+
+	// with the scan cache, changed files need to be rescanned even if their directory didn't change
+	std::vector<std::string> changes = options.scanCache ? readChanges(output, path) : std::vector<std::string>();
+
+	removeFile(replaceExtension(path, ".qgc").c_str());
+
+	output->print("Scanning project...\r");
+
+	std::vector<FileInfo> files = scanProjectFiles(output, path, group.get(), options, false, changes);
+
+	output->print("Building file table...\r");
+
+	if (!buildFiles(output, path, files))
+		return false;
+
+	return updateProjectFiles(output, path, options, files, fast, start);
+}
+
+bool updateProject(Output* output, const char* path, bool fast)
+{
+	// update, compact and the watch updater all replace database files, so they need to be serialized across processes
+	FileLock lock(replaceExtension(path, ".qgl").c_str());
+	if (!lock)
+	{
+		output->error("Error locking project %s\n", path);
+		return false;
+	}
+
+	return updateProjectAll(output, path, fast);
+}
+
+static void processChunkFiles(std::vector<FileInfo>& result, std::vector<std::string>* removed, const char* data, size_t fileCount)
+{
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
+
+	for (unsigned int i = 0; i < fileCount; ++i)
+	{
+		const DataChunkFileHeader& file = files[i];
+
+		if (file.startLine == 0 && (file.flags & DF_REMOVED))
+		{
+			if (removed)
+				removed->push_back(std::string(data + file.nameOffset, file.nameLength));
+		}
+		else if (file.startLine == 0)
+			result.push_back({ std::string(data + file.nameOffset, file.nameLength), file.timeStamp, file.fileSize });
+	}
+}
+
+static bool readDataFile(Output* output, const char* path, bool contents, const std::function<void (const DataChunkHeader& chunk, const char* data)>& callback, std::vector<char>* dictionary = nullptr)
+{
+	FileStream in(path, "rb");
+	if (!in)
+	{
+		output->error("Error reading data file %s\n", path);
+		return false;
+	}
+
+	DataFileHeader header;
+	if (!read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0)
+	{
+		output->error("Error reading data file %s: file format is out of date, update the project to fix\n", path);
+		return false;
+	}
+
+	std::vector<char> fileDictionary(header.dictionarySize);
+
+	if (!read(in, fileDictionary.data(), fileDictionary.size()))
+	{
+		output->error("Error reading data file %s: malformed header\n", path);
+		return false;
+	}
+
+	DataChunkHeader chunk;
+
+	while (read(in, chunk))
+	{
+		in.skip(chunk.extraSize);
+		in.skip(chunk.indexSize);
+		in.skip(chunk.dataPadding);
+
+		std::unique_ptr<char[]> data(new (std::nothrow) char[chunk.compressedSize + chunk.uncompressedSize]);
+
+		if (!data || !read(in, data.get(), chunk.compressedSize))
+		{
+			output->error("Error reading data file %s: malformed chunk\n", path);
+			return false;
+		}
+
+		// only decompress the file table unless the contents is needed
+		size_t targetSize = contents ? chunk.uncompressedSize : chunk.fileTableSize;
+
+		char* uncompressed = data.get() + chunk.compressedSize;
+		if (chunk.codec == DCC_NONE)
+			uncompressed = data.get();
+		else if (chunk.flags & DC_DICTIONARY)
+			decompressPartial(uncompressed, chunk.uncompressedSize, data.get(), chunk.compressedSize, targetSize, fileDictionary.data(), fileDictionary.size());
+		else
+			decompressPartial(uncompressed, chunk.uncompressedSize, data.get(), chunk.compressedSize, targetSize);
+
+		callback(chunk, uncompressed);
+	}
+
+	if (dictionary)
+		dictionary->swap(fileDictionary);
+
+	return true;
+}
+
+static bool readDataFileList(Output* output, const char* path, std::vector<FileInfo>& result, std::vector<std::string>* removed)
+{
+	return readDataFile(output, path, false, [&](const DataChunkHeader& chunk, const char* data) { processChunkFiles(result, removed, data, chunk.fileCount); });
+}
+
+static const FileInfo* findFile(const std::vector<FileInfo>& files, const std::string& path)
+{
+	auto it = std::lower_bound(files.begin(), files.end(), path, [](const FileInfo& l, const std::string& r) { return l.path < r; });
+
+	return (it != files.end() && it->path == path) ? &*it : nullptr;
+}
+
+static bool readDeltaFileList(Output* output, const char* path, std::vector<FileInfo>& files, std::vector<std::string>& removed)
+{
+	std::string deltaPath = replaceExtension(path, ".qgs");
+
+	// delta segment is optional
+	uint64_t mtime, size;
+	if (!getFileAttributes(deltaPath.c_str(), &mtime, &size))
+		return true;
+
+	return readDataFileList(output, deltaPath.c_str(), files, &removed);
+}
+
+static std::vector<FileInfo> mergeDeltaFiles(const std::vector<FileInfo>& baseFiles, const std::vector<FileInfo>& deltaFiles, const std::vector<std::string>& deltaRemoved)
+{
+	std::vector<FileInfo> result;
+	result.reserve(baseFiles.size() + deltaFiles.size());
+
+	size_t deltaIt = 0;
+
+	for (auto& f: baseFiles)
+	{
+		// files from the delta segment supersede the base files with the same path
+		while (deltaIt < deltaFiles.size() && deltaFiles[deltaIt].path < f.path)
+			result.push_back(deltaFiles[deltaIt++]);
+
+		if (deltaIt < deltaFiles.size() && deltaFiles[deltaIt].path == f.path)
+			result.push_back(deltaFiles[deltaIt++]);
+		else if (!std::binary_search(deltaRemoved.begin(), deltaRemoved.end(), f.path))
+			result.push_back(f);
+	}
+
+	result.insert(result.end(), deltaFiles.begin() + deltaIt, deltaFiles.end());
+
+	return result;
+}
+
+bool getDataFileList(Output* output, const char* path, std::vector<FileInfo>& result)
+{
+	std::vector<FileInfo> baseFiles;
+	if (!readDataFileList(output, replaceExtension(path, ".qgd").c_str(), baseFiles, nullptr))
+		return false;
+
+	std::vector<FileInfo> deltaFiles;
+	std::vector<std::string> deltaRemoved;
+	if (!readDeltaFileList(output, path, deltaFiles, deltaRemoved))
+		return false;
+
+	result = mergeDeltaFiles(baseFiles, deltaFiles, deltaRemoved);
+	return true;
+}
+
+bool getDataChunkKeys(Output* output, const char* path, std::vector<std::string>& result)
+{
+	std::string dataPath = replaceExtension(path, ".qgd");
+
+	FileStream in(dataPath.c_str(), "rb");
+	if (!in)
+	{
+		output->error("Error reading data file %s\n", dataPath.c_str());
+		return false;
+	}
+
+	DataFileHeader header;
+	if (!read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0)
+	{
+		output->error("Error reading data file %s: file format is out of date, update the project to fix\n", dataPath.c_str());
+		return false;
+	}
+
+	in.skip(header.dictionarySize);
+
+	DataChunkHeader chunk;
+	std::string key;
+
+	// extra chunk data has the path of the last file in the chunk, so the keys are read without touching the compressed data
+	while (read(in, chunk))
+	{
+		if (chunk.extraSize < chunk.duplicateCount * sizeof(uint64_t))
+		{
+			output->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
+			return false;
+		}
+
+		key.resize(chunk.extraSize - chunk.duplicateCount * sizeof(uint64_t));
+
+		if (!read(in, &key[0], key.size()))
+		{
+			output->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
+			return false;
+		}
+
+		result.push_back(key);
+
+		in.skip(chunk.duplicateCount * sizeof(uint64_t));
+		in.skip(chunk.indexSize);
+		in.skip(chunk.dataPadding);
+		in.skip(chunk.compressedSize);
+	}
+
+	return true;
+}
+
+static bool getDuplicateReferences(Output* output, const char* path, std::unordered_map<uint64_t, unsigned int>& result)
+{
+	FileStream in(path, "rb");
+	if (!in)
+	{
+		output->error("Error reading data file %s\n", path);
+		return false;
+	}
+
+	DataFileHeader header;
+	if (!read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0)
+	{
+		output->error("Error reading data file %s: file format is out of date, update the project to fix\n", path);
+		return false;
+	}
+
+	in.skip(header.dictionarySize);
+
+	DataChunkHeader chunk;
+	std::vector<uint64_t> hashes;
+
+	// extra chunk data lists the originals referenced by the duplicates in the chunk, so the references are counted without touching the compressed data
+	while (read(in, chunk))
+	{
+		if (chunk.extraSize < chunk.duplicateCount * sizeof(uint64_t))
+		{
+			output->error("Error reading data file %s: malformed chunk\n", path);
+			return false;
+		}
+
+		hashes.resize(chunk.duplicateCount);
+
+		in.skip(chunk.extraSize - chunk.duplicateCount * sizeof(uint64_t));
+
+		if (!read(in, hashes.data(), hashes.size() * sizeof(uint64_t)))
+		{
+			output->error("Error reading data file %s: malformed chunk\n", path);
+			return false;
+		}
+
+		for (uint64_t h: hashes)
+			result[h]++;
+
+		in.skip(chunk.indexSize);
+		in.skip(chunk.dataPadding);
+		in.skip(chunk.compressedSize);
+	}
+
+	return true;
+}
+
+static std::vector<FileInfo> mergeChangedFiles(ProjectGroup* group, const std::vector<FileInfo>& packFiles, const std::vector<std::string>& changes, UpdateStatistics& stats)
+{
+	std::vector<FileInfo> result;
+	result.reserve(packFiles.size() + changes.size());
+
+	size_t packIt = 0;
+
+	for (auto& path: changes)
+	{
+		// files that weren't changed are assumed to be current
+		while (packIt < packFiles.size() && packFiles[packIt].path < path)
+			result.push_back(packFiles[packIt++]);
+
+		const FileInfo* existing = (packIt < packFiles.size() && packFiles[packIt].path == path) ? &packFiles[packIt++] : nullptr;
+
+		// changed files are either modified or added if they are still on disk and the scan would find them, and removed otherwise
+		uint64_t mtime, size;
+
+		if (isFileInProject(group, path) && getFileAttributes(path.c_str(), &mtime, &size))
+		{
+			result.push_back({ path, mtime, size });
+
+			if (!existing)
+				stats.filesAdded++;
+			else if (existing->timeStamp != mtime || existing->fileSize != size)
+				stats.filesChanged++;
+		}
+		else if (existing)
+		{
+			stats.filesRemoved++;
+		}
+	}
+
+	result.insert(result.end(), packFiles.begin() + packIt, packFiles.end());
+
+	return result;
+}
+
+static uint64_t getTotalFileSize(const std::vector<FileInfo>& files)
+{
+	uint64_t result = 0;
+
+	for (auto& f: files)
+		result += f.fileSize;
+
+	return result;
+}
+
+static bool writeDeltaSegment(Output* output, const char* path, const ProjectOptions& options, const std::vector<FileInfo>& files, const std::vector<std::string>& removed, unsigned int& totalChunks)
+{
+	std::string targetPath = replaceExtension(path, ".qgs");
+	std::string tempPath = targetPath + "_";
+
+	// delta segments are small and short-lived so they don't use the dictionary
+	ProjectOptions deltaOptions = options;
+	deltaOptions.dictionary = false;
+
+	{
+		BuildContext* builder = buildStart(output, tempPath.c_str(), deltaOptions, files.size());
+		if (!builder)
+			return false;
+
+		size_t removedIt = 0;
+
+		// search uses the delta contents instead of reading the file if the change list has the same attributes; files modified within the
+		// time stamp granularity of the read could change again without changing the attributes, so their time stamp is not recorded
+		uint64_t racyTimeStamp = getCurrentTimeStamp(1);
+
+		// files are added in path order; removed files are stored without contents to mark the base files as superseded
+		for (auto& f: files)
+		{
+			for (; removedIt < removed.size() && removed[removedIt] < f.path; ++removedIt)
+				buildAppendFilePart(builder, removed[removedIt].c_str(), 0, nullptr, 0, 0, 0, 0, DF_REMOVED);
+
+			buildAppendFile(builder, f.path.c_str(), f.timeStamp < racyTimeStamp ? f.timeStamp : 0, f.fileSize);
+		}
+
+		for (; removedIt < removed.size(); ++removedIt)
+			buildAppendFilePart(builder, removed[removedIt].c_str(), 0, nullptr, 0, 0, 0, 0, DF_REMOVED);
+
+		if (!buildFinish(builder, &totalChunks))
+			return false;
+	}
+
+	if (!renameFile(tempPath.c_str(), targetPath.c_str()))
+	{
+		output->error("Error saving data file %s\n", targetPath.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+static void removeProcessedChanges(Output* output, const char* path, const std::vector<std::string>& processed)
+{
+	// other processes can add changes while the update runs, so only the changes that were processed are removed
+	std::vector<std::string> changes = readChanges(output, path);
+	std::vector<std::string> remaining;
+
+	for (auto& c: changes)
+		if (!std::binary_search(processed.begin(), processed.end(), c))
+			remaining.push_back(c);
+
+	if (remaining.empty())
+		removeFile(replaceExtension(path, ".qgc").c_str());
+	else if (!writeChanges(path, remaining))
+		output->error("Error writing changes for project %s\n", path);
+}
+
+bool updateProjectChanges(Output* output, const char* path, const std::vector<std::string>* changeList)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	FileLock lock(replaceExtension(path, ".qgl").c_str());
+	if (!lock)
+	{
+		output->error("Error locking project %s\n", path);
+		return false;
+	}
+
+	// changes can only be applied to an existing database, so fall back to a full update if it's missing or out of date
+	{
+		FileStream in(replaceExtension(path, ".qgd").c_str(), "rb");
+		DataFileHeader header;
+
+		if (!in || !read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0)
+			return updateProjectAll(output, path, false);
+	}
+
+	output->print("Updating %s:\n", path);
+
+	ProjectOptions options;
+	std::unique_ptr<ProjectGroup> group = parseProject(output, path, &options);
+	if (!group)
+		return false;
+
+	std::vector<std::string> changes = changeList ? *changeList : readChanges(output, path);
+
+	if (changes.empty())
+	{
+		output->print("No changes\n");
+		return true;
+	}
+
+	if (options.scanCache)
+		scanCacheInvalidateFiles(output, path, changes);
+
+	output->print("Reading data pack...\r");
+
+	std::vector<FileInfo> baseFiles;
+	if (!readDataFileList(output, replaceExtension(path, ".qgd").c_str(), baseFiles, nullptr))
+		return false;
+
+	std::vector<FileInfo> deltaFiles;
+	std::vector<std::string> deltaRemoved;
+	if (!readDeltaFileList(output, path, deltaFiles, deltaRemoved))
+		return false;
+
+	std::sort(changes.begin(), changes.end());
+	changes.erase(std::unique(changes.begin(), changes.end()), changes.end());
+
+	UpdateStatistics stats = {};
+	std::vector<FileInfo> files = mergeChangedFiles(group.get(), mergeDeltaFiles(baseFiles, deltaFiles, deltaRemoved), changes, stats);
+
+	// file table only contains paths so it only needs to be rebuilt if files were added or removed
+	if (stats.filesAdded || stats.filesRemoved)
+	{
+		output->print("Building file table...\r");
+
+		if (!buildFiles(output, path, files))
+			return false;
+	}
+
+	// new delta segment supersedes the base files from the old delta segment and all changed files
+	std::vector<std::string> superseded = changes;
+
+	for (auto& f: deltaFiles)
+		superseded.push_back(f.path);
+
+	superseded.insert(superseded.end(), deltaRemoved.begin(), deltaRemoved.end());
+
+	std::sort(superseded.begin(), superseded.end());
+	superseded.erase(std::unique(superseded.begin(), superseded.end()), superseded.end());
+
+	std::vector<FileInfo> segmentFiles;
+	std::vector<std::string> segmentRemoved;
+
+	for (auto& p: superseded)
+	{
+		const FileInfo* file = findFile(files, p);
+		const FileInfo* base = findFile(baseFiles, p);
+
+		// files that are current in the base data file don't need to be in the delta segment
+		if (file && (!base || base->timeStamp != file->timeStamp || base->fileSize != file->fileSize))
+			segmentFiles.push_back(*file);
+		else if (!file && base)
+			segmentRemoved.push_back(p);
+	}
+
+	// once the delta segment gets large enough, searching it becomes expensive so we fold it into the base data file
+	if (getTotalFileSize(segmentFiles) > getTotalFileSize(baseFiles) * kDeltaMaxRatio)
+	{
+		if (!updateProjectFiles(output, path, options, files, false, start))
+			return false;
+	}
+	else
+	{
+		unsigned int totalChunks = 0;
+
+		if (segmentFiles.empty() && segmentRemoved.empty())
+			removeFile(replaceExtension(path, ".qgs").c_str());
+		else if (!writeDeltaSegment(output, path, options, segmentFiles, segmentRemoved, totalChunks))
+			return false;
+
+		output->print("\n");
+
+		auto time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start);
+
+		printFileStatistics(output, stats);
+		output->print("%d chunks written to delta segment in %.2f sec\n", totalChunks, time.count() / 1e3);
+	}
+
+	// change list is only removed once the changes are in the published data, so that searches never miss the changed files
+	if (!changeList)
+		removeProcessedChanges(output, path, changes);
+
+	return true;
+}
+
+struct CompactFilePart
+{
+	std::string path;
+	DataChunkFileHeader header;
+	std::vector<char> contents;
+};
+
+static bool compactAppendFilePart(BuildContext* builder, std::unordered_map<uint64_t, std::vector<char>>& originals, const char* path, const DataChunkFileHeader& f, const char* data)
+{
+	if (f.flags & DF_REMOVED)
+		return true;
+
+	if (f.flags & DF_DUPLICATE)
+	{
+		auto original = originals.find(f.contentHash);
+
+		// compaction never reads project files, so the original has to be in the database before the duplicate
+		if (original == originals.end())
+			return false;
+
+		// the builder stores the file as a duplicate again if the original is still there, or as a regular file otherwise
+		buildAppendDuplicateFile(builder, path, f.timeStamp, f.fileSize, f.contentHash, std::string(data + f.dataOffset, f.dataSize).c_str(), original->second);
+	}
+	else
+		buildAppendFilePart(builder, path, f.startLine, data + f.dataOffset, f.dataSize, f.timeStamp, f.fileSize, f.contentHash, f.flags);
+
+	return true;
+}
+
+bool compactProject(Output* output, const char* path)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	output->print("Compacting %s:\n", path);
+
+	ProjectOptions options;
+	std::unique_ptr<ProjectGroup> group = parseProject(output, path, &options);
+	if (!group)
+		return false;
+
+	// updates wait for the compaction to finish, since they would otherwise write the same temporary data file
+	FileLock lock(replaceExtension(path, ".qgl").c_str());
+	if (!lock)
+	{
+		output->error("Error locking project %s\n", path);
+		return false;
+	}
+
+	// compaction only reads the existing database so it can run in the background
+	setBackgroundPriority();
+
+	std::string targetPath = replaceExtension(path, ".qgd");
+	std::string tempPath = targetPath + "_";
+
+	output->print("Reading data pack...\r");
+
+	std::vector<FileInfo> files;
+	if (!getDataFileList(output, path, files))
+		return false;
+
+	// delta segment is small, so we keep its contents in memory and merge it with the base data file in path order
+	std::vector<CompactFilePart> delta;
+	std::vector<std::string> deltaPaths;
+
+	uint64_t deltaTimeStamp = 0, deltaSize = 0;
+	std::string deltaPath = replaceExtension(path, ".qgs");
+
+	bool hasDelta = getFileAttributes(deltaPath.c_str(), &deltaTimeStamp, &deltaSize);
+
+	if (hasDelta && !readDataFile(output, deltaPath.c_str(), true, [&](const DataChunkHeader& chunk, const char* data) {
+		const DataChunkFileHeader* chunkFiles = reinterpret_cast<const DataChunkFileHeader*>(data);
+
+		for (size_t i = 0; i < chunk.fileCount; ++i)
+		{
+			const DataChunkFileHeader& f = chunkFiles[i];
+			CompactFilePart part = { std::string(data + f.nameOffset, f.nameLength), f, std::vector<char>(data + f.dataOffset, data + f.dataOffset + f.dataSize) };
+
+			part.header.dataOffset = 0;
+
+			if (deltaPaths.empty() || deltaPaths.back() != part.path)
+				deltaPaths.push_back(part.path);
+
+			delta.push_back(std::move(part));
+		}
+	}))
+		return false;
+
+	std::vector<char> dictionary;
+
+	if (options.dictionary && options.compression == PC_LZ4)
+	{
+		FileStream in;
+
+		// keep using the existing dictionary; the dictionary is only retrained on build
+		if (!openFile(output, in, targetPath.c_str(), dictionary) || dictionary.empty())
+			dictionary = buildPrepareDictionary(output, files);
+	}
+
+	// duplicate files only reference the original file, so we keep the contents of the originals until the last chunk that references them
+	std::unordered_map<uint64_t, unsigned int> references;
+
+	if (!getDuplicateReferences(output, targetPath.c_str(), references))
+		return false;
+
+	unsigned int totalChunks = 0;
+
+	{
+		BuildContext* builder = buildStart(output, tempPath.c_str(), options, files.size(), dictionary);
+		if (!builder)
+			return false;
+
+		// all chunks are recompressed with the best compression level and get new chunk boundaries and indices
+		buildSetCompressionLevel(builder, kCompactDataCompressionLevel);
+
+		std::unordered_map<uint64_t, std::vector<char>> originals;
+		size_t deltaIt = 0;
+
+		std::vector<uint64_t> chunkReferences;
+		bool referencesValid = true;
+
+		bool result = readDataFile(output, targetPath.c_str(), true, [&](const DataChunkHeader& chunk, const char* data) {
+			const DataChunkFileHeader* chunkFiles = reinterpret_cast<const DataChunkFileHeader*>(data);
+
+			chunkReferences.clear();
+
+			for (size_t i = 0; i < chunk.fileCount; ++i)
+			{
+				const DataChunkFileHeader& f = chunkFiles[i];
+				std::string filePath(data + f.nameOffset, f.nameLength);
+
+				if (f.flags & DF_DUPLICATE)
+					chunkReferences.push_back(f.contentHash);
+
+				if ((f.flags & DF_HASDUPLICATES) && !(f.flags & DF_DUPLICATE) && references.count(f.contentHash))
+				{
+					std::vector<char>& contents = originals[f.contentHash];
+					contents.insert(contents.end(), data + f.dataOffset, data + f.dataOffset + f.dataSize);
+				}
+
+				// delta files go before the first part of the next file
+				for (; f.startLine == 0 && deltaIt < delta.size() && delta[deltaIt].path < filePath; ++deltaIt)
+					referencesValid &= compactAppendFilePart(builder, originals, delta[deltaIt].path.c_str(), delta[deltaIt].header, delta[deltaIt].contents.data());
+
+				// files from the delta segment supersede the base files with the same path
+				if (!std::binary_search(deltaPaths.begin(), deltaPaths.end(), filePath))
+					referencesValid &= compactAppendFilePart(builder, originals, filePath.c_str(), f, data);
+			}
+
+			std::sort(chunkReferences.begin(), chunkReferences.end());
+			chunkReferences.erase(std::unique(chunkReferences.begin(), chunkReferences.end()), chunkReferences.end());
+
+			// the duplicates in this chunk were appended, so the originals that no later chunk references can be released
+			for (uint64_t h: chunkReferences)
+			{
+				auto it = references.find(h);
+
+				if (it != references.end() && --it->second == 0)
+				{
+					references.erase(it);
+					originals.erase(h);
+				}
+			}
+		});
+
+		for (; deltaIt < delta.size(); ++deltaIt)
+			referencesValid &= compactAppendFilePart(builder, originals, delta[deltaIt].path.c_str(), delta[deltaIt].header, delta[deltaIt].contents.data());
+
+		bool finished = buildFinish(builder, &totalChunks);
+
+		if (result && !referencesValid)
+			output->error("Error reading data file %s: duplicate file without original, update the project to fix\n", targetPath.c_str());
+
+		if (!result || !referencesValid || !finished)
+			return false;
+	}
+
+	output->print("\n");
+
+	auto time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start);
+
+	output->print("%d files compacted into %d chunks in %.2f sec\n", int(files.size()), totalChunks, time.count() / 1e3);
+
+	if (!renameFile(tempPath.c_str(), targetPath.c_str()))
+	{
+		output->error("Error saving data file %s\n", targetPath.c_str());
+		return false;
+	}
+
+	uint64_t currentTimeStamp, currentSize;
+
+	// the new data file has all changes from the delta segment that was read; an update could have written a new one in the meantime
+	if (hasDelta && getFileAttributes(deltaPath.c_str(), &currentTimeStamp, &currentSize) && currentTimeStamp == deltaTimeStamp && currentSize == deltaSize)
+		removeFile(deltaPath.c_str());
+
 	return true;
 }
@@ -1,6 +1,22 @@
 // This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
 #pragma once
 
+#include <string>
+#include <vector>
+
 class Output;
+struct FileInfo;
+
+bool updateProject(Output* output, const char* path, bool fast = false);
+
+// Applies changed files to the delta segment; the changes are read from the change list, which is updated once the changes are published, unless the caller provides them
+bool updateProjectChanges(Output* output, const char* path, const std::vector<std::string>* changes = nullptr);
+
+// Rewrites the project database with optimal chunk sizes and compression, merging the delta segment
+bool compactProject(Output* output, const char* path);
+
+// Gets the list of files in the project database, including the delta segment
+bool getDataFileList(Output* output, const char* path, std::vector<FileInfo>& result);
 
-bool updateProject(Output* output, const char* path);
+// Gets the path of the last file in each chunk of the project database, in chunk order
+bool getDataChunkKeys(Output* output, const char* path, std::vector<std::string>& result);
@@ -4,125 +4,90 @@
 
 #include "project.hpp"
 #include "fileutil.hpp"
-#include "filestream.hpp"
+#include "pollwatch.hpp"
 #include "output.hpp"
-#include "format.hpp"
-#include "compression.hpp"
 #include "constants.hpp"
 #include "update.hpp"
 #include "changes.hpp"
+#include "overlay.hpp"
 
 #include <set>
-#include <thread>
+#include <memory>
 #include <mutex>
+#include <thread>
 #include <condition_variable>
 #include <chrono>
+#include <algorithm>
 
 #include <string.h>
 
+// The context is shared with the watcher callbacks, which can be called after watchProject returns
 struct WatchContext
 {
 	Output* output;
 
-	std::thread updateThread;
-	std::vector<std::thread> watchingThreads;
+	std::unique_ptr<ProjectGroup> group;
+	bool polling;
 
 	std::set<std::string> changedFiles;
 	std::mutex changedFilesMutex;
 	std::condition_variable changedFilesChanged;
 
-	~WatchContext()
-	{
-		for (auto& t: watchingThreads)
-			t.join();
-
-		if (updateThread.joinable())
-			updateThread.join();
-	}
+	// the update runs on a separate thread; files that change while it runs stay in the change list after it finishes
+	bool updating;
+	bool updateFinished;
+	bool updateSucceeded;
+	std::set<std::string> updateChangedFiles;
 };
 
-static void fileChanged(WatchContext* context, ProjectGroup* group, const char* path, const char* file)
+static void fileChanged(WatchContext* context, const char* path, const char* file)
 {
-	if (isFileAcceptable(group, file))
-	{
-		std::string npath = normalizePath(path, file);
+	std::string npath = normalizePath(path, file);
 
-		std::unique_lock<std::mutex> lock(context->changedFilesMutex);
+	// ignore files are read again when they change; directories that they don't ignore anymore are picked up by the next full update
+	const char* name = strrchr(npath.c_str(), '/');
 
-		context->changedFiles.insert(npath);
-		context->changedFilesChanged.notify_one();
-	}
-}
+	if (name && (strcmp(name + 1, ".gitignore") == 0 || strcmp(name + 1, ".ignore") == 0))
+		resetIgnoreFiles(context->group.get());
 
-static void startWatchingRec(WatchContext* context, ProjectGroup* group)
-{
-	for (auto& path : group->paths)
+	if (isFileInProject(context->group.get(), npath))
 	{
-		context->output->print("Watching folder %s...\n", path.c_str());
-
-		context->watchingThreads.emplace_back([=]
-		{
-			if (!watchDirectory(path.c_str(), [=](const char* file) { fileChanged(context, group, path.c_str(), file); }))
-				context->output->error("Error watching folder %s\n", path.c_str());
+		invalidateOverlayFiles({ npath });
 
-			context->output->print("No longer watching folder %s\n", path.c_str());
-		});
-	}
+		std::unique_lock<std::mutex> lock(context->changedFilesMutex);
 
-	for (auto& child: group->groups)
-		startWatchingRec(context, child.get());
-}
+		context->changedFiles.insert(npath);
 
-static void processChunk(std::vector<FileInfo>& result, const char* data, size_t fileCount)
-{
-	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
+		if (context->updating)
+			context->updateChangedFiles.insert(npath);
 
-	for (unsigned int i = 0; i < fileCount; ++i)
-	{
-		const DataChunkFileHeader& file = files[i];
-
-		if (file.startLine == 0)
-			result.push_back({ std::string(data + file.nameOffset, file.nameLength), file.timeStamp, file.fileSize });
+		context->changedFilesChanged.notify_one();
 	}
 }
 
-static bool getDataFileList(Output* output, const char* path, std::vector<FileInfo>& result)
+static void startWatching(const std::shared_ptr<WatchContext>& context, ProjectGroup* group, const std::string& path)
 {
-	FileStream in(path, "rb");
-	if (!in)
-	{
-		output->error("Error reading data file %s\n", path);
-		return false;
-	}
-
-	DataFileHeader header;
-	if (!read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0)
-	{
-		output->error("Error reading data file %s: file format is out of date, update the project to fix\n", path);
-		return false;
-	}
+	context->output->print("Watching folder %s...\n", path.c_str());
 
-	DataChunkHeader chunk;
+	auto callback = [=](const char* file) { fileChanged(context.get(), path.c_str(), file); };
 
-	while (read(in, chunk))
-	{
-		in.skip(chunk.extraSize);
-		in.skip(chunk.indexSize);
+	// directories that the scan skips aren't watched, so that large ignored trees don't use up watches
+	auto directoryFilter = [=](const char* dir) { return isDirectoryAcceptable(group, dir) && !isPathIgnored(group, path, normalizePath(path.c_str(), dir), true); };
 
-		std::unique_ptr<char[]> data(new (std::nothrow) char[chunk.compressedSize + chunk.uncompressedSize]);
+	if (!(context->polling ? watchDirectoryPolling(path.c_str(), callback, directoryFilter) : watchDirectory(path.c_str(), callback, directoryFilter)))
+		context->output->error("Error watching folder %s\n", path.c_str());
+}
 
-		if (!data || !read(in, data.get(), chunk.compressedSize))
-		{
-			output->error("Error reading data file %s: malformed chunk\n", path);
-			return false;
-		}
+static void startWatchingRec(const std::shared_ptr<WatchContext>& context, ProjectGroup* group)
+{
+	for (auto& path : group->paths)
+		startWatching(context, group, path);
 
-		char* uncompressed = data.get() + chunk.compressedSize;
-		decompressPartial(uncompressed, chunk.uncompressedSize, data.get(), chunk.compressedSize, chunk.fileTableSize);
-		processChunk(result, uncompressed, chunk.fileCount);
-	}
+	for (auto& path : group->gitPaths)
+		startWatching(context, group, path);
 
-	return true;
+	for (auto& child: group->groups)
+		startWatchingRec(context, child.get());
 }
 
 static std::vector<std::string> getChanges(const std::vector<FileInfo>& files, const std::vector<FileInfo>& packFiles)
@@ -165,32 +130,86 @@ static std::vector<std::string> getChanges(const std::vector<FileInfo>& files, c
 	return result;
 }
 
-static void printStatistics(Output* output, const char* path, size_t fileCount)
+static size_t getDirtyChunkCount(const std::vector<std::string>& chunkKeys, const std::vector<std::string>& changedFiles)
 {
-	output->print("%s: %d files changed\r", getProjectName(path).c_str(), int(fileCount));
+	size_t result = 0;
+	size_t lastChunk = ~size_t(0);
+
+	// chunks are sorted by the path of their last file, so the first chunk with a key that isn't less than the path has the file; paths after all chunks start a new chunk
+	for (auto& path: changedFiles)
+	{
+		size_t chunk = std::lower_bound(chunkKeys.begin(), chunkKeys.end(), path) - chunkKeys.begin();
+
+		result += chunk != lastChunk;
+		lastChunk = chunk;
+	}
+
+	return result;
+}
+
+static bool isUpdateNeeded(size_t fileCount, size_t dirtyChunkCount, size_t chunkCount)
+{
+	return fileCount > size_t(kWatchUpdateThresholdFiles) || (fileCount > 0 && dirtyChunkCount > chunkCount * kWatchUpdateThresholdChunks);
+}
+
+static void printStatistics(Output* output, const char* path, size_t fileCount, size_t chunkCount)
+{
+	output->print("%s: %d files changed in %d chunks\r", getProjectName(path).c_str(), int(fileCount), int(chunkCount));
+}
+
+static void updateChanges(WatchContext* context, const std::string& path, const std::vector<std::string>& changedFiles)
+{
+	// searches and the watcher keep running during the update, so it only uses idle resources
+	setBackgroundThreadPriority();
+
+	// the change list is complete since we started from a full scan, so only changed files need to be updated; the watcher keeps the change list file
+	bool result = updateProjectChanges(context->output, path.c_str(), &changedFiles);
+
+	std::unique_lock<std::mutex> lock(context->changedFilesMutex);
+
+	context->updateFinished = true;
+	context->updateSucceeded = result;
+	context->changedFilesChanged.notify_one();
 }
 
 void watchProject(Output* output, const char* path, bool interactive)
 {
-	WatchContext context = { output };
+	std::shared_ptr<WatchContext> contextPtr = std::make_shared<WatchContext>();
+	WatchContext& context = *contextPtr;
 	const char* lineEnd = interactive ? "\n" : "\r";
 
+	context.output = output;
+	context.updating = false;
+
 	output->print("Watching %s:\n", path);
 
-	std::unique_ptr<ProjectGroup> group = parseProject(output, path);
+	// searches in interactive mode run in the same process, so they can use the contents of changed files that the watcher keeps up to date
+	if (interactive)
+		enableOverlay();
+
+	ProjectOptions options;
+	std::unique_ptr<ProjectGroup>& group = context.group;
+
+	group = parseProject(output, path, &options);
 	if (!group)
 		return;
 
-	startWatchingRec(&context, group.get());
+	context.polling = options.watchPolling;
+
+	startWatchingRec(contextPtr, group.get());
 
 	output->print("Scanning project...%s", lineEnd);
 
-	std::vector<FileInfo> files = getProjectGroupFiles(output, group.get());
+	std::vector<FileInfo> files = getProjectGroupFiles(output, group.get(), options);
 
 	output->print("Reading data pack...%s", lineEnd);
 
 	std::vector<FileInfo> packFiles;
-	if (!getDataFileList(output, replaceExtension(path, ".qgd").c_str(), packFiles))
+	if (!getDataFileList(output, path, packFiles))
+		return;
+
+	std::vector<std::string> chunkKeys;
+	if (!getDataChunkKeys(output, path, chunkKeys))
 		return;
 
 	removeFile(replaceExtension(path, ".qgc").c_str());
@@ -205,14 +224,20 @@ void watchProject(Output* output, const char* path, bool interactive)
 
 	output->print("Listening for changes\n");
 
-	bool updateNeeded = changedFiles.size() > size_t(kWatchUpdateThresholdFiles);
+	size_t dirtyChunks = getDirtyChunkCount(chunkKeys, changedFiles);
+
+	bool updateNeeded = isUpdateNeeded(changedFiles.size(), dirtyChunks, chunkKeys.size());
 	bool writeNeeded = true; // write initial state
 	auto writeDeadline = std::chrono::steady_clock::now();
 
+	std::thread updateThread;
+	std::vector<std::string> updateFiles;
+
 	for (;;)
 	{
 		bool updateNow = false;
 		bool writeNow = false;
+		bool updateFinished = false;
 
 		{
 			std::unique_lock<std::mutex> lock(context.changedFilesMutex);
@@ -225,7 +250,7 @@ void watchProject(Output* output, const char* path, bool interactive)
 					writeNow = true;
 				}
 			}
-			else if (updateNeeded)
+			else if (updateNeeded && !context.updating)
 			{
 				if (context.changedFilesChanged.wait_for(lock, std::chrono::seconds(kWatchUpdateTimeout)) == std::cv_status::timeout)
 				{
@@ -238,6 +263,32 @@ void watchProject(Output* output, const char* path, bool interactive)
 				context.changedFilesChanged.wait(lock);
 			}
 
+			if (context.updating && context.updateFinished)
+			{
+				updateFinished = true;
+
+				context.updating = false;
+
+				if (context.updateSucceeded)
+				{
+					// the updated files are in the delta segment now, unless they changed again during the update
+					std::vector<std::string> updatedFiles;
+
+					for (auto& f: updateFiles)
+						if (context.updateChangedFiles.count(f) == 0)
+						{
+							context.changedFiles.erase(f);
+							updatedFiles.push_back(f);
+						}
+
+					updateFiles.swap(updatedFiles);
+				}
+				else
+					updateFiles.clear();
+
+				context.updateChangedFiles.clear();
+			}
+
 			if (context.changedFiles.size() != changedFiles.size())
 			{
 				changedFiles.assign(context.changedFiles.begin(), context.changedFiles.end());
@@ -248,47 +299,53 @@ void watchProject(Output* output, const char* path, bool interactive)
 					writeDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(kWatchWriteDeadline);
 				}
 
-				if (changedFiles.size() > size_t(kWatchUpdateThresholdFiles))
-				{
-					updateNeeded = true;
-				}
+				dirtyChunks = getDirtyChunkCount(chunkKeys, changedFiles);
+				updateNeeded = isUpdateNeeded(changedFiles.size(), dirtyChunks, chunkKeys.size());
 			}
-		}
-
-		if (updateNow)
-		{
-			assert(updateNeeded);
 
+			if (updateNow)
 			{
-				std::unique_lock<std::mutex> lock(context.changedFilesMutex);
+				assert(updateNeeded);
 
-				context.changedFiles.clear();
-			}
+				// the update works on a snapshot of the changes; new changes are collected and written to the change list while it runs
+				updateFiles = changedFiles;
 
-			// this removes the current changes file and updates the pack
-			if (updateProject(output, path))
-			{
-				updateNeeded = false;
+				context.updating = true;
+				context.updateFinished = false;
 			}
-			else
+		}
+
+		if (updateFinished)
+		{
+			updateThread.join();
+
+			// updated files are searched in the delta segment from now on, and folding the delta segment into the data file changes the chunks
+			if (!updateFiles.empty())
 			{
-				// update failed; restore the change list pre-update and try again
-				{
-					std::unique_lock<std::mutex> lock(context.changedFilesMutex);
+				invalidateOverlayFiles(updateFiles);
 
-					context.changedFiles.insert(changedFiles.begin(), changedFiles.end());
-				}
+				chunkKeys.clear();
+
+				if (!getDataChunkKeys(output, path, chunkKeys))
+					chunkKeys.clear();
 
-				// update may have removed the change list so we'll need to restore that as well
-				writeNeeded = true;
+				dirtyChunks = getDirtyChunkCount(chunkKeys, changedFiles);
+				updateNeeded = isUpdateNeeded(changedFiles.size(), dirtyChunks, chunkKeys.size());
 			}
+
+			writeNeeded = true;
+			writeDeadline = std::chrono::steady_clock::now();
+		}
+		else if (updateNow)
+		{
+			updateThread = std::thread(updateChanges, &context, std::string(path), updateFiles);
 		}
 		else if (writeNow)
 		{
 			assert(writeNeeded);
 
 			if (!interactive)
-				printStatistics(output, path, changedFiles.size());
+				printStatistics(output, path, changedFiles.size(), dirtyChunks);
 
 			if (writeChanges(path, changedFiles))
 			{